@@ -0,0 +1,38 @@
+# frozen_string_literal: true
+
+# Measures how long it takes to get the backtraces of every thread in a process with lots of threads (e.g. when a
+# watchdog dumps all threads of a stuck server), using Backtracie.all_thread_backtraces and, for comparison, calling
+# Backtracie.backtrace_locations and Thread#backtrace_locations for each thread in Thread.list.
+#
+# Usage: bundle exec ruby benchmarks/all_thread_backtraces.rb [thread_count]
+
+require "backtracie"
+require "benchmark"
+
+THREAD_COUNT = Integer(ARGV[0] || 200)
+STACK_DEPTH = 40
+ITERATIONS = 100
+
+def parked_thread(depth)
+  return sleep if depth == 0
+
+  parked_thread(depth - 1)
+end
+
+threads = Array.new(THREAD_COUNT) { Thread.new { parked_thread(STACK_DEPTH) } }
+Thread.pass until threads.all? { |it| it.status == "sleep" }
+
+puts RUBY_DESCRIPTION
+puts "#{THREAD_COUNT} threads, depth #{STACK_DEPTH}, average of #{ITERATIONS} iterations"
+
+{
+  "all_thread_backtraces" => -> { Backtracie.all_thread_backtraces },
+  "backtrace_locations" => -> { Thread.list.to_h { |it| [it, Backtracie.backtrace_locations(it)] } },
+  "Thread#backtrace_locations" => -> { Thread.list.to_h { |it| [it, it.backtrace_locations] } }
+}.each do |name, capture|
+  capture.call # warm up
+  time = Benchmark.realtime { ITERATIONS.times { capture.call } }
+  puts format("%-28s %8.2fms", name, time * 1000 / ITERATIONS)
+end
+
+threads.each(&:kill).each(&:join)
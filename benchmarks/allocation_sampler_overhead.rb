@@ -0,0 +1,68 @@
+# frozen_string_literal: true
+
+# Measures the overhead of running a Backtracie::AllocationSampler on an allocation-heavy workload, at several sampling
+# intervals, by comparing how much CPU a fixed amount of work takes with and without it. For comparison, it also
+# measures ObjectSpace.trace_object_allocations, which records the allocation site of every object.
+#
+# Usage: bundle exec ruby benchmarks/allocation_sampler_overhead.rb [intervals...]
+
+require "backtracie"
+require "objspace"
+
+INTERVALS = ARGV.empty? ? [1, 10, 100, 1_000, 10_000] : ARGV.map { |it| Integer(it) }
+STACK_DEPTH = 20
+REQUESTS_PER_RUN = 20_000
+RUNS = 5
+
+def request_handler(depth, &block)
+  return yield if depth == 0
+
+  request_handler(depth - 1, &block)
+end
+
+# Allocates a bunch of short-lived objects, and keeps a few of them around (like a cache would)
+def simulated_request(retained)
+  rows = 20.times.map { |i| {id: i, name: "row #{i}", tags: [i.to_s, "tag"]} }
+  retained << rows.first if retained.size < 10_000
+  rows.map { |row| row[:name].upcase }.join(",").size
+end
+
+def cpu_time
+  Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+end
+
+def measure
+  retained = []
+  GC.start
+  start = cpu_time
+  REQUESTS_PER_RUN.times { request_handler(STACK_DEPTH) { simulated_request(retained) } }
+  cpu_time - start
+end
+
+def median(values)
+  values.sort[values.size / 2]
+end
+
+measure # Warm up
+
+puts RUBY_DESCRIPTION
+puts "stack depth #{STACK_DEPTH}, median of #{RUNS} runs"
+
+baseline = median(Array.new(RUNS) { measure })
+puts format("%-40s %.3fs cpu", "Without sampler:", baseline)
+
+INTERVALS.each do |interval|
+  sampler = nil
+  time = median(Array.new(RUNS) {
+    sampler = Backtracie::AllocationSampler.new(interval: interval)
+    sampler.start
+    measure.tap { sampler.stop }
+  })
+  puts format("%-40s %.3fs cpu, %6.1f%% overhead (%d samples, %d unique stacks)",
+    "AllocationSampler, interval #{interval}:", time, (time / baseline - 1) * 100, sampler.sample_count,
+    sampler.stack_table.stack_count)
+end
+
+time = median(Array.new(RUNS) { ObjectSpace.trace_object_allocations { measure } })
+puts format("%-40s %.3fs cpu, %6.1f%% overhead", "ObjectSpace.trace_object_allocations:", time,
+  (time / baseline - 1) * 100)
@@ -0,0 +1,32 @@
+# frozen_string_literal: true
+
+# Measures how long it takes to identify the current stack, e.g. for grouping errors, using
+# Backtracie.caller_fingerprint and, for comparison, hashing the qualified method names and paths of
+# Backtracie.caller_locations.
+#
+# Usage: bundle exec ruby benchmarks/caller_fingerprint.rb [stack_depth]
+
+require "backtracie"
+require "benchmark"
+
+STACK_DEPTH = Integer(ARGV[0] || 50)
+ITERATIONS = 100_000
+
+def deep_stack(depth, &block)
+  (depth == 0) ? yield : deep_stack(depth - 1, &block)
+end
+
+deep_stack(STACK_DEPTH) do
+  puts RUBY_DESCRIPTION
+  puts "depth #{caller_locations.size}, average of #{ITERATIONS} iterations"
+
+  {
+    "caller_fingerprint" => -> { Backtracie.caller_fingerprint },
+    "caller_fingerprint(depth: 10)" => -> { Backtracie.caller_fingerprint(depth: 10) },
+    "caller_locations + hash" => -> { Backtracie.caller_locations.map { |it| [it.qualified_method_name, it.path] }.hash }
+  }.each do |name, fingerprint|
+    fingerprint.call # warm up
+    time = Benchmark.realtime { ITERATIONS.times { fingerprint.call } }
+    puts format("%-30s %8.2fus", name, time * 1_000_000 / ITERATIONS)
+  end
+end
@@ -0,0 +1,33 @@
+# frozen_string_literal: true
+
+# Measures how long it takes to format a whole backtrace into a single String (e.g. when logging an exception), using
+# Backtracie.format_backtrace and, for comparison, joining the #to_s of every location, for both Backtracie and
+# Thread::Backtrace::Locations.
+#
+# Usage: bundle exec ruby benchmarks/format_backtrace.rb [stack_depth]
+
+require "backtracie"
+require "benchmark"
+
+STACK_DEPTH = Integer(ARGV[0] || 50)
+ITERATIONS = 10_000
+
+def deep_stack(depth, &block)
+  (depth == 0) ? yield : deep_stack(depth - 1, &block)
+end
+
+backtracie_locations, ruby_locations = deep_stack(STACK_DEPTH) { [Backtracie.caller_locations, caller_locations] }
+
+puts RUBY_DESCRIPTION
+puts "depth #{backtracie_locations.size}, average of #{ITERATIONS} iterations"
+
+{
+  "format_backtrace" => -> { Backtracie.format_backtrace(backtracie_locations) },
+  "format_backtrace (fancy)" => -> { Backtracie.format_backtrace(backtracie_locations, style: :fancy) },
+  "Location#to_s + join" => -> { backtracie_locations.map(&:to_s).join("\n") },
+  "Thread::Backtrace::Location" => -> { ruby_locations.map(&:to_s).join("\n") }
+}.each do |name, format|
+  format.call # warm up
+  time = Benchmark.realtime { ITERATIONS.times { format.call } }
+  puts format("%-28s %8.2fus", name, time * 1_000_000 / ITERATIONS)
+end
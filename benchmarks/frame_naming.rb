@@ -0,0 +1,64 @@
+# frozen_string_literal: true
+
+# Measures how long it takes to render qualified method names from scratch (i.e. without the name cache) for frames
+# whose names are pathologically long: methods on singleton classes of singleton classes of anonymous classes, methods
+# in deeply nested modules with long names, and refined methods. Compares with the cached names, as returned by
+# Backtracie.backtrace_locations.
+#
+# Note that rendering is dominated by working out the names of the modules involved, not by building the String: with
+# the length-tracked strbuilder appends, the "without name cache" time didn't change measurably (on Ruby 3.1, 8.7-9.8us
+# vs 9.5-10.7us before at nesting 20, and 294-337us vs 288-313us before at nesting 200, i.e. within run-to-run noise).
+#
+# Usage: bundle exec ruby benchmarks/frame_naming.rb [nesting]
+
+require "backtracie"
+require "benchmark"
+
+NESTING = Integer(ARGV[0] || 20)
+ITERATIONS = 1000
+
+def nested_module(depth)
+  (1..depth).reduce(Object) { |parent, i| parent.const_set(:"NestedModuleWithAVeryLongName#{i}", Module.new) }
+end
+
+# Each singleton class's methods get called on the class before it
+singletons = (1..NESTING).reduce([Class.new]) { |classes, _| classes << classes.last.singleton_class }
+singletons.last.define_method(:park) { |&block| block.call }
+
+deeply_nested = nested_module(NESTING)
+deeply_nested.module_eval("class Parked; def park; yield; end; end", __FILE__, __LINE__)
+
+refinement = Module.new do
+  refine(deeply_nested::Parked) do
+    def park
+      super
+    end
+  end
+end
+using refinement
+
+ready = Queue.new
+thread = Thread.new do
+  singletons[-2].park do
+    deeply_nested::Parked.new.park do
+      ready << true
+      sleep
+    end
+  end
+end
+ready.pop
+Thread.pass until thread.status == "sleep"
+
+puts RUBY_DESCRIPTION
+puts "nesting #{NESTING}, average of #{ITERATIONS} iterations"
+
+{
+  "without name cache" => -> { Backtracie::TestHelpers.frame_names_without_name_cache(thread) },
+  "with name cache" => -> { Backtracie::TestHelpers.frame_names_from_single_captures(thread) }
+}.each do |name, render|
+  render.call # warm up
+  time = Benchmark.realtime { ITERATIONS.times { render.call } }
+  puts format("%-20s %8.2fus", name, time * 1_000_000 / ITERATIONS)
+end
+
+thread.kill.join
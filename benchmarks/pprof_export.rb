@@ -0,0 +1,132 @@
+# frozen_string_literal: true
+
+# Measures how long it takes to export a stack table as a pprof profile, and how much memory it takes to do so, using
+# Backtracie::StackTable#write_pprof (with and without gzip) and, for comparison, a simple encoder written in Ruby on
+# top of the stack table's public methods.
+#
+# Each encoder runs in a forked child, so that its peak memory usage can be measured separately; this needs Linux
+# (/proc/self/clear_refs and /proc/self/status).
+#
+# Usage: bundle exec ruby benchmarks/pprof_export.rb [stack_count]
+
+require "backtracie"
+require "benchmark"
+require "stringio"
+require "zlib"
+
+STACK_COUNT = Integer(ARGV[0] || 20_000)
+STACK_DEPTH = 40
+METHOD_COUNT = 200
+
+# Lots of different methods, so that the profile has a realistic amount of functions and strings
+METHOD_COUNT.times do |i|
+  Object.define_method(:"benchmark_method_#{i}") do |table, path|
+    return table.capture(Thread.current) if path.empty?
+
+    send(:"benchmark_method_#{path.first}", table, path.drop(1))
+  end
+end
+
+# Simplified version of what a pprof encoder written in Ruby looks like
+def ruby_write_pprof(table, samples, output)
+  strings = {"" => 0}
+  intern = ->(string) { strings[string] ||= strings.size }
+  varint = ->(value) {
+    bytes = []
+    loop do
+      byte = value & 0x7f
+      value >>= 7
+      break bytes << byte if value == 0
+
+      bytes << (byte | 0x80)
+    end
+    bytes.pack("C*")
+  }
+  field = ->(number, value) {
+    if value.is_a?(String)
+      varint.((number << 3) | 2) + varint.(value.bytesize) + value
+    else
+      varint.(number << 3) + varint.(value)
+    end
+  }
+
+  functions = {}
+  locations = {}
+  encoded_samples = samples.map do |stack_id, count|
+    location_ids = table.stack_frames(stack_id).map do |frame_id|
+      locations[frame_id] ||= begin
+        name = intern.(table.frame_qualified_method_name(frame_id))
+        function_id = functions[name] ||= functions.size + 1
+        [frame_id + 1, function_id, table.frame_lineno(frame_id)]
+      end
+      frame_id + 1
+    end
+    field.(2, field.(1, location_ids.map(&varint).join) + field.(2, varint.(count)))
+  end
+
+  output << field.(1, field.(1, intern.("samples")) + field.(2, intern.("count")))
+  encoded_samples.each { |it| output << it }
+  locations.each_value do |id, function_id, line|
+    output << field.(4, field.(1, id) + field.(4, field.(1, function_id) + field.(2, line)))
+  end
+  functions.each { |name, id| output << field.(5, field.(1, id) + field.(2, name)) }
+  strings.each_key { |it| output << field.(6, it) }
+end
+
+def status_kb(name)
+  File.read("/proc/self/status")[/^#{name}:\s+(\d+) kB/, 1].to_i
+end
+
+def measure(name)
+  read_end, write_end = IO.pipe
+  pid = fork do
+    read_end.close
+    GC.start
+    File.write("/proc/self/clear_refs", "5") # Resets VmHWM to the current RSS
+    rss_before = status_kb("VmRSS")
+    allocations_before = GC.stat(:total_allocated_objects)
+
+    bytes = nil
+    time = Benchmark.realtime { bytes = yield }
+
+    write_end.write(Marshal.dump([
+      time, bytes, status_kb("VmHWM") - rss_before, GC.stat(:total_allocated_objects) - allocations_before
+    ]))
+  end
+  write_end.close
+  time, bytes, peak_kb, allocations = Marshal.load(read_end.read)
+  Process.wait(pid)
+
+  puts format("%-20s %8.1fms %10d bytes %8d kB peak %10d objects allocated", name, time * 1000, bytes, peak_kb,
+    allocations)
+end
+
+table = Backtracie::StackTable.new
+random = Random.new(42)
+samples = Hash.new(0)
+STACK_COUNT.times do
+  path = Array.new(STACK_DEPTH) { random.rand(METHOD_COUNT) }
+  samples[benchmark_method_0(table, path)] += random.rand(1..10)
+end
+
+puts RUBY_DESCRIPTION
+puts "#{samples.size} stacks, #{table.frame_count} frames, depth #{STACK_DEPTH}"
+
+measure("ruby") do
+  output = StringIO.new
+  ruby_write_pprof(table, samples, output)
+  output.string.bytesize
+end
+measure("native") do
+  output = StringIO.new
+  table.write_pprof(samples, output)
+  output.string.bytesize
+end
+measure("native, gzip") do
+  output = StringIO.new
+  table.write_pprof(samples, output, gzip: true)
+  output.string.bytesize
+end
+File.open(File::NULL, "wb") do |file|
+  measure("native, to fd") { table.write_pprof(samples, file.fileno) }
+end
@@ -0,0 +1,116 @@
+# frozen_string_literal: true
+
+# Measures the overhead of running a Backtracie::Sampler on a process with lots of threads (similar to e.g. a Puma
+# server with a 32-thread pool), by comparing how much CPU a fixed amount of work takes with and without the sampler.
+#
+# Most of the threads in a busy thread pool are waiting for work (or IO) at any given time, but they still get sampled,
+# so the benchmark keeps thread_count - 1 threads parked with a deep stack, and runs the work on the remaining one.
+#
+# CPU time varies by several percent from run to run (more so on shared machines), which is more than the overhead
+# being measured. So rather than comparing a few long runs, this alternates lots of short runs with and without the
+# sampler (each starting from a fresh GC), and reports the median of the overhead within each pair of runs, with a 95%
+# confidence interval for it. Pinning the process to a CPU (e.g. with taskset) narrows the interval.
+#
+# The time the sampler measured itself spending on sampling is shown too. It's much more stable, but only a lower bound
+# of the overhead. So the target of staying under 1% at 100 Hz is reported as not met when either that or the whole
+# confidence interval is above it, as met when the whole interval is below it, and as inconclusive otherwise.
+#
+# On Ruby 3.1, with the defaults, sampling took 1.14-1.29% of the CPU time (~110us per tick), so the target is not met
+# with 32 threads this deep; the median overhead of three invocations ranged from -0.93% to 1.57%, with 95% confidence
+# intervals about 4 points wide, on a noisy VM. With 8 threads, sampling took 0.36% of the CPU time.
+#
+# Usage: bundle exec ruby benchmarks/sampler_overhead.rb [thread_count] [frequency_hz] [pairs_of_runs]
+
+require "backtracie"
+
+THREAD_COUNT = Integer(ARGV[0] || 32)
+FREQUENCY_HZ = Integer(ARGV[1] || 100)
+PAIRS = Integer(ARGV[2] || 100)
+STACK_DEPTH = 40
+REQUESTS_PER_RUN = 4_000
+TARGET_OVERHEAD_PERCENT = 1.0
+
+def request_handler(depth, &block)
+  return yield if depth == 0
+
+  request_handler(depth - 1, &block)
+end
+
+def simulated_request
+  200.times.map { |i| i.to_s }.join.size
+end
+
+def cpu_time
+  Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID)
+end
+
+def measure
+  GC.start
+  start = cpu_time
+  REQUESTS_PER_RUN.times { request_handler(STACK_DEPTH) { simulated_request } }
+  cpu_time - start
+end
+
+def measure_sampled(sampler)
+  sampler.start
+  # The timer thread only starts once it gets the GVL, so wait for it, lest the start of the run go unsampled
+  tick_count = sampler.tick_count
+  Thread.pass until sampler.tick_count > tick_count
+  measure
+ensure
+  sampler.stop
+end
+
+parked = Queue.new
+parked_threads = (THREAD_COUNT - 1).times.map { Thread.new { request_handler(STACK_DEPTH) { parked.pop } } }
+sleep 0.1 until parked_threads.all? { |it| it.status == "sleep" }
+
+sampler = Backtracie::Sampler.new(frequency: FREQUENCY_HZ)
+measure_sampled(sampler) # Warm up, including the stack table
+measure
+sampling_time_before = sampler.sampling_time
+tick_count_before = sampler.tick_count
+
+overheads = []
+sampled_cpu_time = 0.0
+PAIRS.times do |pair|
+  if pair.even?
+    baseline = measure
+    sampled = measure_sampled(sampler)
+  else
+    sampled = measure_sampled(sampler)
+    baseline = measure
+  end
+  overheads << (sampled / baseline - 1) * 100
+  sampled_cpu_time += sampled
+end
+
+parked.close
+parked_threads.each(&:join)
+
+# Distribution-free confidence interval for the median: the ranks around the middle that the median falls between
+# with 95% probability
+overheads.sort!
+overhead = overheads[PAIRS / 2]
+margin = (1.96 * Math.sqrt(PAIRS) / 2).ceil
+low, high = overheads[[PAIRS / 2 - margin, 0].max], overheads[[PAIRS / 2 + margin, PAIRS - 1].min]
+sampling_time = sampler.sampling_time - sampling_time_before
+sampling_percent = sampling_time / sampled_cpu_time * 100
+tick_count = sampler.tick_count - tick_count_before
+
+puts RUBY_DESCRIPTION
+puts "#{THREAD_COUNT} threads, stack depth #{STACK_DEPTH}, sampling at #{FREQUENCY_HZ} Hz, #{PAIRS} pairs of runs"
+puts format("CPU overhead:        %.2f%% (median; 95%% confidence interval %.2f%% to %.2f%%)", overhead, low, high)
+puts format("Time spent sampling: %.2f%% of the sampled cpu time (%d ticks, %.1fus each)",
+  sampling_percent, tick_count, sampling_time * 1_000_000 / tick_count)
+if FREQUENCY_HZ == 100
+  verdict =
+    if low > TARGET_OVERHEAD_PERCENT || sampling_percent > TARGET_OVERHEAD_PERCENT
+      "NOT met"
+    elsif high < TARGET_OVERHEAD_PERCENT
+      "met"
+    else
+      "inconclusive, the confidence interval includes it (try more pairs of runs)"
+    end
+  puts format("Target of under %.0f%% at 100 Hz: %s", TARGET_OVERHEAD_PERCENT, verdict)
+end
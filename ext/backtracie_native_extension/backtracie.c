@@ -25,9 +25,12 @@
 
 #include <ruby.h>
 #include <ruby/debug.h>
+#include <ruby/encoding.h>
 #include <ruby/intern.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "backtracie_private.h"
 #include "public/backtracie.h"
@@ -39,22 +42,148 @@
 // non-static, used in backtracie_frames.c
 VALUE backtracie_main_object_instance = Qnil;
 VALUE backtracie_frame_wrapper_class = Qnil;
+VALUE backtracie_minimal_frame_wrapper_class = Qnil;
 
 static ID ensure_object_is_thread_id;
 static ID to_s_id;
+static ID debug_id;
+static ID max_depth_id;
+static ID frame_wrapper_ivar_id;
+static ID frame_index_ivar_id;
+static ID path_frame_index_ivar_id;
+static ID absolute_path_ivar_id;
+static ID base_label_ivar_id;
+static ID label_ivar_id;
+static ID lineno_ivar_id;
+static ID path_ivar_id;
+static ID qualified_method_name_ivar_id;
+static ID path_is_synthetic_ivar_id;
+static ID debug_ivar_id;
+static ID memo_ivar_id;
+static ID style_id;
+static ID default_id;
+static ID fancy_id;
 static VALUE backtracie_module = Qnil;
 static VALUE backtracie_location_class = Qnil;
+static VALUE scratch_frame_wrapper = Qnil;
+static VALUE backtracie_minimal_location_class = Qnil;
+// Path of locations that have none, as there's no Ruby frame below them
+static VALUE in_native_code_path = Qnil;
+static VALUE location_memo_class = Qnil;
 
-static VALUE primitive_caller_locations(VALUE self);
-static VALUE primitive_backtrace_locations(VALUE self, VALUE thread);
+typedef VALUE (*location_field_function)(VALUE location);
+
+// See all_fiber_backtraces
+typedef struct {
+  VALUE thread;
+  VALUE gc_was_disabled;
+  // Grown by backtracie_capture_all_fibers_for_thread
+  backtracie_fiber_stack_t *stacks;
+  int capa;
+} all_fiber_backtraces_t;
+
+// The fields of a location that get computed lazily; see new_location
+typedef enum {
+  ABSOLUTE_PATH_FIELD,
+  BASE_LABEL_FIELD,
+  LABEL_FIELD,
+  LINENO_FIELD,
+  PATH_FIELD,
+  QUALIFIED_METHOD_NAME_FIELD,
+  LOCATION_FIELD_COUNT
+} location_field;
+
+// Holds the lazily-computed fields of the locations for the frames_len frames
+// starting at frames_start in a frame wrapper, LOCATION_FIELD_COUNT of them
+// per frame, each Qundef until it gets computed. The locations themselves are
+// frozen, so this is where they memoize their fields.
+typedef struct {
+  int frames_start;
+  int frames_len;
+  VALUE *fields;
+} location_memo_t;
+
+static void location_memo_mark(void *ptr);
+static void location_memo_compact(void *ptr);
+static void location_memo_free(void *ptr);
+static size_t location_memo_memsize(const void *ptr);
+static const rb_data_type_t location_memo_type = {
+    .wrap_struct_name = "backtracie_location_memo",
+    .function = {.dmark = location_memo_mark,
+                 .dfree = location_memo_free,
+                 .dsize = location_memo_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = location_memo_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE primitive_caller_locations(VALUE self, VALUE start, VALUE length,
+                                        VALUE debug, VALUE max_depth);
+static VALUE primitive_backtrace_locations(int argc, VALUE *argv, VALUE self);
+static VALUE primitive_caller_location(VALUE self, VALUE skip, VALUE filter);
+static VALUE primitive_minimal_caller_locations(VALUE self);
+static VALUE minimal_backtrace_locations(VALUE self, VALUE thread);
+static VALUE cache_stats(VALUE self);
+static VALUE hits_and_misses(uint64_t hits, uint64_t misses);
 static VALUE collect_backtrace_locations(VALUE self, VALUE thread,
-                                         int ignored_stack_top_frames);
-inline static VALUE new_location(VALUE absolute_path, VALUE base_label,
-                                 VALUE label, VALUE lineno, VALUE path,
-                                 VALUE qualified_method_name,
-                                 VALUE path_is_synthetic, VALUE debug);
-static VALUE frame_to_location(const raw_location *raw_loc,
-                               const raw_location *prev_ruby_loc);
+                                         int ignored_stack_top_frames,
+                                         int max_frames, bool debug);
+static VALUE capture_frames(VALUE thread, int ignored_stack_top_frames,
+                            int max_frames);
+static bool stack_has_frames(VALUE thread, int frames);
+static VALUE new_locations(VALUE frame_wrapper, int frames_start,
+                           int frames_len, bool debug);
+static VALUE copy_scratch_frames(void);
+static VALUE all_thread_backtraces(VALUE self);
+static VALUE fiber_backtrace_locations(VALUE self, VALUE fiber);
+static VALUE all_fiber_backtraces(int argc, VALUE *argv, VALUE self);
+static VALUE collect_all_fiber_backtraces(VALUE state_ptr);
+static VALUE finish_all_fiber_backtraces(VALUE state_ptr);
+static int frames_to_skip(VALUE start);
+static int frames_to_capture(VALUE length, VALUE max_depth);
+static VALUE new_location(VALUE frame_wrapper, VALUE memo, int frame_index,
+                          int path_frame_index, bool debug);
+static VALUE location_memo_new(int frames_start, int frames_len);
+static VALUE *location_memo_slot(VALUE location, location_field field);
+static VALUE location_memoized_field(VALUE location, location_field field,
+                                     ID ivar_id,
+                                     location_field_function compute_field);
+static const raw_location *location_frame(VALUE location, ID index_ivar_id);
+static VALUE location_absolute_path(VALUE self);
+static VALUE location_base_label(VALUE self);
+static VALUE location_label(VALUE self);
+static VALUE location_lineno(VALUE self);
+static VALUE location_path(VALUE self);
+static VALUE location_qualified_method_name(VALUE self);
+static VALUE location_path_is_synthetic(VALUE self);
+static VALUE compute_absolute_path(VALUE location);
+static VALUE compute_base_label(VALUE location);
+static VALUE compute_label(VALUE location);
+static VALUE compute_lineno(VALUE location);
+static VALUE compute_path(VALUE location);
+static VALUE compute_qualified_method_name(VALUE location);
+static VALUE collect_minimal_backtrace_locations(VALUE thread,
+                                                 int ignored_stack_top_frames);
+static const minimal_location_t *minimal_location_frame(VALUE location,
+                                                        ID index_ivar_id);
+static VALUE minimal_location_absolute_path(VALUE self);
+static VALUE minimal_location_lineno(VALUE self);
+static VALUE minimal_location_qualified_method_name(VALUE self);
+static VALUE compute_minimal_absolute_path(VALUE location);
+static VALUE compute_minimal_qualified_method_name(VALUE location);
+static VALUE location_to_s(VALUE self);
+static VALUE location_fancy_to_s(VALUE self);
+static VALUE format_backtrace(int argc, VALUE *argv, VALUE self);
+static VALUE location_peek_field(VALUE location, location_field field,
+                                 ID ivar_id,
+                                 location_field_function compute_field);
+static void append_location(strbuilder_t *out, VALUE location, bool fancy);
+static void append_field(strbuilder_t *out, VALUE value);
+static VALUE finish_formatted(strbuilder_t *out);
 static VALUE debug_raw_location(const raw_location *the_location);
 static VALUE debug_frame(VALUE frame);
 static VALUE cfunc_function_info(const raw_location *the_location);
@@ -67,27 +196,118 @@ void Init_backtracie_native_extension(void) {
                  rb_intern("eval"), 1, rb_str_new2("self"));
   ensure_object_is_thread_id = rb_intern("ensure_object_is_thread");
   to_s_id = rb_intern("to_s");
+  debug_id = rb_intern("debug");
+  max_depth_id = rb_intern("max_depth");
+  frame_wrapper_ivar_id = rb_intern("@frame_wrapper");
+  frame_index_ivar_id = rb_intern("@frame_index");
+  path_frame_index_ivar_id = rb_intern("@path_frame_index");
+  absolute_path_ivar_id = rb_intern("@absolute_path");
+  base_label_ivar_id = rb_intern("@base_label");
+  label_ivar_id = rb_intern("@label");
+  lineno_ivar_id = rb_intern("@lineno");
+  path_ivar_id = rb_intern("@path");
+  qualified_method_name_ivar_id = rb_intern("@qualified_method_name");
+  path_is_synthetic_ivar_id = rb_intern("@path_is_synthetic");
+  debug_ivar_id = rb_intern("@debug");
+  memo_ivar_id = rb_intern("@memo");
+  style_id = rb_intern("style");
+  default_id = rb_intern("default");
+  fancy_id = rb_intern("fancy");
 
   backtracie_module = rb_const_get(rb_cObject, rb_intern("Backtracie"));
   rb_global_variable(&backtracie_module);
+  in_native_code_path = backtracie_interned_str(
+      "(in native code)", strlen("(in native code)"));
+  rb_global_variable(&in_native_code_path);
 
   rb_define_module_function(backtracie_module, "backtrace_locations",
-                            primitive_backtrace_locations, 1);
+                            primitive_backtrace_locations, -1);
+  rb_define_module_function(backtracie_module, "minimal_backtrace_locations",
+                            minimal_backtrace_locations, 1);
+  rb_define_module_function(backtracie_module, "all_thread_backtraces",
+                            all_thread_backtraces, 0);
+  rb_define_module_function(backtracie_module, "fiber_backtrace_locations",
+                            fiber_backtrace_locations, 1);
+  rb_define_module_function(backtracie_module, "all_fiber_backtraces",
+                            all_fiber_backtraces, -1);
+  rb_define_module_function(backtracie_module, "cache_stats", cache_stats, 0);
+  rb_define_module_function(backtracie_module, "format_backtrace",
+                            format_backtrace, -1);
 
   backtracie_location_class =
       rb_const_get(backtracie_module, rb_intern("Location"));
   rb_global_variable(&backtracie_location_class);
 
+  // These are the lazy counterparts to the fields set by
+  // Backtracie::Location#initialize; see new_location below for details.
+  rb_define_method(backtracie_location_class, "absolute_path",
+                   location_absolute_path, 0);
+  rb_define_method(backtracie_location_class, "base_label",
+                   location_base_label, 0);
+  rb_define_method(backtracie_location_class, "label", location_label, 0);
+  rb_define_method(backtracie_location_class, "lineno", location_lineno, 0);
+  rb_define_method(backtracie_location_class, "path", location_path, 0);
+  rb_define_method(backtracie_location_class, "qualified_method_name",
+                   location_qualified_method_name, 0);
+  rb_define_method(backtracie_location_class, "path_is_synthetic",
+                   location_path_is_synthetic, 0);
+  rb_define_method(backtracie_location_class, "to_s", location_to_s, 0);
+  rb_define_method(backtracie_location_class, "fancy_to_s",
+                   location_fancy_to_s, 0);
+
+  location_memo_class =
+      rb_define_class_under(backtracie_module, "LocationMemo", rb_cObject);
+  // this class should only be instantiated via location_memo_new
+  rb_undef_alloc_func(location_memo_class);
+
+  backtracie_minimal_location_class =
+      rb_const_get(backtracie_module, rb_intern("MinimalLocation"));
+  rb_global_variable(&backtracie_minimal_location_class);
+
+  rb_define_method(backtracie_minimal_location_class, "absolute_path",
+                   minimal_location_absolute_path, 0);
+  rb_define_method(backtracie_minimal_location_class, "lineno",
+                   minimal_location_lineno, 0);
+  rb_define_method(backtracie_minimal_location_class, "qualified_method_name",
+                   minimal_location_qualified_method_name, 0);
+  rb_define_method(backtracie_minimal_location_class, "path_is_synthetic",
+                   location_path_is_synthetic, 0);
+  // Minimal locations only have the one way of being rendered
+  rb_define_method(backtracie_minimal_location_class, "to_s",
+                   location_fancy_to_s, 0);
+
   VALUE backtracie_primitive_module =
       rb_define_module_under(backtracie_module, "Primitive");
 
   rb_define_module_function(backtracie_primitive_module, "caller_locations",
-                            primitive_caller_locations, 0);
+                            primitive_caller_locations, 4);
+  rb_define_module_function(backtracie_primitive_module, "caller_location",
+                            primitive_caller_location, 2);
+  rb_define_module_function(backtracie_primitive_module,
+                            "minimal_caller_locations",
+                            primitive_minimal_caller_locations, 0);
 
   backtracie_frame_wrapper_class =
       rb_define_class_under(backtracie_module, "FrameWrapper", rb_cObject);
   // this class should only be instantiated via backtracie_frame_wrapper_new
   rb_undef_alloc_func(backtracie_frame_wrapper_class);
+  scratch_frame_wrapper = backtracie_frame_wrapper_new(0);
+  rb_global_variable(&scratch_frame_wrapper);
+
+  backtracie_minimal_frame_wrapper_class = rb_define_class_under(
+      backtracie_module, "MinimalFrameWrapper", rb_cObject);
+  // this class should only be instantiated via
+  // backtracie_minimal_frame_wrapper_new
+  rb_undef_alloc_func(backtracie_minimal_frame_wrapper_class);
+
+  backtracie_gc_epoch_init();
+  backtracie_name_cache_init();
+  backtracie_fingerprint_init(backtracie_module);
+  backtracie_stack_table_init(backtracie_module);
+  backtracie_sample_ring_init(backtracie_module);
+  backtracie_sampler_init(backtracie_module);
+  backtracie_allocation_sampler_init(backtracie_module);
+  backtracie_gvl_profiler_init(backtracie_module);
 
   // Create some classes which are used to simulate interesting scenarios in
   // tests
@@ -95,9 +315,11 @@ void Init_backtracie_native_extension(void) {
 }
 
 // Get array of Backtracie::Locations for a given thread; if thread is nil,
-// returns for the current thread
+// returns for the current thread. At most max_frames locations are returned,
+// and the stack is not walked any further than needed to find them.
 static VALUE collect_backtrace_locations(VALUE self, VALUE thread,
-                                         int ignored_stack_top_frames) {
+                                         int ignored_stack_top_frames,
+                                         int max_frames, bool debug) {
   if (!RTEST(thread)) {
     thread = rb_thread_current();
   }
@@ -108,34 +330,41 @@ static VALUE collect_backtrace_locations(VALUE self, VALUE thread,
     return Qnil;
   }
 
-  int raw_frame_count = backtracie_frame_count_for_thread(thread);
+  VALUE frame_wrapper =
+      capture_frames(thread, ignored_stack_top_frames, max_frames);
+  // Also as with Ruby, skipping past the end of the stack returns nil, but
+  // skipping exactly all of it returns an empty array
+  if (*backtracie_frame_wrapper_len(frame_wrapper) == 0 &&
+      !stack_has_frames(thread, ignored_stack_top_frames)) {
+    return Qnil;
+  }
+  VALUE rb_locations = new_locations(
+      frame_wrapper, 0, *backtracie_frame_wrapper_len(frame_wrapper), debug);
 
-  // Allocate memory for the raw_locations, and keep track of it on the Ruby
-  // heap so it will be GC'd even if we raise.
-  // Zero the frame array so our mark function doesn't get confused too.
-  VALUE frame_wrapper = backtracie_frame_wrapper_new(raw_frame_count);
-  raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
-  int *raw_frames_len = backtracie_frame_wrapper_len(frame_wrapper);
+  RB_GC_GUARD(frame_wrapper);
+  return rb_locations;
+}
 
-  for (int i = ignored_stack_top_frames; i < raw_frame_count; i++) {
-    bool valid_frame = backtracie_capture_frame_for_thread(
-        thread, i, &raw_frames[*raw_frames_len]);
-    if (valid_frame) {
-      (*raw_frames_len)++;
-    }
-  }
+// Returns an array of Backtracie::Locations for the frames_len frames starting
+// at frames_start in the given frame wrapper
+static VALUE new_locations(VALUE frame_wrapper, int frames_start,
+                           int frames_len, bool debug) {
+  raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
 
-  VALUE rb_locations = rb_ary_new_capa(*raw_frames_len);
+  VALUE memo = location_memo_new(frames_start, frames_len);
+  VALUE rb_locations = rb_ary_new_capa(frames_len);
   // Iterate _backwards_ through the frames, so we can keep track of the
   // previous ruby frame for a C frame. This is required because C frames don't
   // have filenames or line numbers; we must instead use the filename/lineno of
   // the _caller_ of the function.
-  raw_location *prev_ruby_loc = NULL;
-  for (int i = *raw_frames_len - 1; i >= 0; i--) {
-    if (raw_frames[i].is_ruby_frame) {
-      prev_ruby_loc = &raw_frames[i];
+  int prev_ruby_frame_index = -1;
+  for (int i = frames_len - 1; i >= 0; i--) {
+    int frame_index = frames_start + i;
+    if (raw_frames[frame_index].is_ruby_frame) {
+      prev_ruby_frame_index = frame_index;
     }
-    VALUE rb_loc = frame_to_location(&raw_frames[i], prev_ruby_loc);
+    VALUE rb_loc = new_location(frame_wrapper, memo, frame_index,
+                                prev_ruby_frame_index, debug);
     rb_ary_store(rb_locations, i, rb_loc);
   }
 
@@ -143,65 +372,734 @@ static VALUE collect_backtrace_locations(VALUE self, VALUE thread,
   return rb_locations;
 }
 
-static VALUE primitive_caller_locations(VALUE self) {
+// Captures the stacks of all threads in one go, rather than one
+// backtrace_locations call per thread: the frames of every thread are captured
+// together into the scratch wrapper, and then copied into a single wrapper
+// shared by all of the returned locations.
+static VALUE all_thread_backtraces(VALUE self) {
+  int thread_count = backtracie_capture_all_threads(Qnil, NULL, 0);
+  VALUE stacks_buffer;
+  backtracie_thread_stack_t *stacks =
+      ALLOCV_N(backtracie_thread_stack_t, stacks_buffer, thread_count);
+
+  thread_count = backtracie_capture_all_threads(scratch_frame_wrapper, stacks,
+                                                thread_count);
+  VALUE frame_wrapper = copy_scratch_frames();
+
+  // None of the threads can go away while this runs, as nothing here releases
+  // the GVL
+  VALUE result = rb_hash_new();
+  for (int i = 0; i < thread_count; i++) {
+    rb_hash_aset(result, stacks[i].thread,
+                 new_locations(frame_wrapper, stacks[i].frames_start,
+                               stacks[i].frames_len, false));
+  }
+
+  ALLOCV_END(stacks_buffer);
+  RB_GC_GUARD(frame_wrapper);
+  return result;
+}
+
+// Returns nil if the fiber has no stack, which is the case if it hasn't been
+// started yet, or has already finished
+static VALUE fiber_backtrace_locations(VALUE self, VALUE fiber) {
+  int frame_count = backtracie_frame_count_for_fiber(fiber);
+  backtracie_frame_wrapper_reserve(scratch_frame_wrapper, frame_count);
+  if (!backtracie_capture_frames_for_fiber(
+          fiber, 0, frame_count,
+          backtracie_frame_wrapper_frames(scratch_frame_wrapper),
+          backtracie_frame_wrapper_len(scratch_frame_wrapper))) {
+    return Qnil;
+  }
+
+  VALUE frame_wrapper = copy_scratch_frames();
+  return new_locations(frame_wrapper, 0,
+                       *backtracie_frame_wrapper_len(frame_wrapper), false);
+}
+
+// Like all_thread_backtraces, but for the fibers of a thread
+static VALUE all_fiber_backtraces(int argc, VALUE *argv, VALUE self) {
+  VALUE thread;
+  rb_scan_args(argc, argv, "01", &thread);
+  if (NIL_P(thread)) {
+    thread = rb_thread_current();
+  }
+  rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
+
+  // Some of the fibers found may not be referenced by anything else, and if a
+  // GC frees them, we'd be left with dangling references to them in between
+  // finding them and putting them into the result
+  all_fiber_backtraces_t state = {.thread = thread,
+                                  .gc_was_disabled = rb_gc_disable(),
+                                  .stacks = NULL,
+                                  .capa = 0};
+  return rb_ensure(collect_all_fiber_backtraces, (VALUE)&state,
+                   finish_all_fiber_backtraces, (VALUE)&state);
+}
+
+static VALUE collect_all_fiber_backtraces(VALUE state_ptr) {
+  all_fiber_backtraces_t *state = (all_fiber_backtraces_t *)state_ptr;
+  int fiber_count = backtracie_capture_all_fibers_for_thread(
+      state->thread, scratch_frame_wrapper, &state->stacks, &state->capa);
+  VALUE frame_wrapper = copy_scratch_frames();
+
+  VALUE result = rb_hash_new();
+  for (int i = 0; i < fiber_count; i++) {
+    backtracie_fiber_stack_t *stack = &state->stacks[i];
+    rb_hash_aset(result, stack->fiber,
+                 new_locations(frame_wrapper, stack->frames_start,
+                               stack->frames_len, false));
+  }
+
+  RB_GC_GUARD(frame_wrapper);
+  return result;
+}
+
+static VALUE finish_all_fiber_backtraces(VALUE state_ptr) {
+  all_fiber_backtraces_t *state = (all_fiber_backtraces_t *)state_ptr;
+  xfree(state->stacks);
+  return backtracie_restore_gc(state->gc_was_disabled);
+}
+
+// Captures the frames of the given thread into a new frame wrapper, sized to
+// fit them exactly.
+//
+// The number of frames on a thread's stack (which we need to size the buffer
+// for the capture) is usually a lot larger than the number of frames we end up
+// capturing, as it includes frames that don't show up in backtraces, and the
+// ones being skipped. So we first capture into scratch_frame_wrapper, which is
+// reused across calls, and then copy only the captured frames.
+//
+// A single scratch wrapper is enough: this runs with the GVL held, and doesn't
+// call any Ruby code between capturing the frames and copying them out.
+static VALUE capture_frames(VALUE thread, int ignored_stack_top_frames,
+                            int max_frames) {
+  int raw_frame_count = backtracie_frame_count_for_thread(thread);
+  if (max_frames > raw_frame_count) {
+    max_frames = raw_frame_count;
+  }
+  backtracie_frame_wrapper_reserve(scratch_frame_wrapper, max_frames);
+  int *scratch_len = backtracie_frame_wrapper_len(scratch_frame_wrapper);
+  backtracie_capture_frames_for_thread(
+      thread, ignored_stack_top_frames, max_frames,
+      backtracie_frame_wrapper_frames(scratch_frame_wrapper), scratch_len);
+
+  return copy_scratch_frames();
+}
+
+// Returns true if the thread's stack has at least the given number of frames
+// (that would show up in a backtrace)
+static bool stack_has_frames(VALUE thread, int frames) {
+  if (frames == 0) {
+    return true;
+  }
+  raw_location last_frame;
+  int len;
+  backtracie_capture_frames_for_thread(thread, frames - 1, 1, &last_frame,
+                                       &len);
+  return len > 0;
+}
+
+// Moves the frames captured into scratch_frame_wrapper into a new frame
+// wrapper, sized to fit them exactly, leaving the scratch wrapper empty.
+static VALUE copy_scratch_frames(void) {
+  int *scratch_len = backtracie_frame_wrapper_len(scratch_frame_wrapper);
+
+  // Allocating the wrapper may trigger a GC, but while the captured frames are
+  // in the scratch wrapper, they are marked by it
+  VALUE frame_wrapper = backtracie_frame_wrapper_new(*scratch_len);
+  memcpy(backtracie_frame_wrapper_frames(frame_wrapper),
+         backtracie_frame_wrapper_frames(scratch_frame_wrapper),
+         sizeof(raw_location) * *scratch_len);
+  *backtracie_frame_wrapper_len(frame_wrapper) = *scratch_len;
+
+  backtracie_frame_wrapper_clear(scratch_frame_wrapper);
+  return frame_wrapper;
+}
+
+static VALUE primitive_caller_locations(VALUE self, VALUE start, VALUE length,
+                                        VALUE debug, VALUE max_depth) {
   // Ignore:
   // * the current stack frame (native)
   // * the Backtracie.caller_locations that called us
-  // * the frame from the caller itself (since we're replicating the semantics
-  // of Kernel#caller_locations)
+  // * the first start frames from the caller onwards (since we're replicating
+  // the semantics of Kernel#caller_locations, where start defaults to 1, which
+  // skips the frame from the caller itself)
+  int ignored_stack_top_frames = 2 + frames_to_skip(start);
+
+  return collect_backtrace_locations(self, Qnil, ignored_stack_top_frames,
+                                     frames_to_capture(length, max_depth),
+                                     RTEST(debug));
+}
+
+static VALUE primitive_backtrace_locations(int argc, VALUE *argv, VALUE self) {
+  VALUE thread, start, length;
+  VALUE options;
+  rb_scan_args(argc, argv, "12:", &thread, &start, &length, &options);
+
+  ID option_ids[] = {debug_id, max_depth_id};
+  VALUE option_values[] = {Qundef, Qundef};
+  if (!NIL_P(options)) {
+    rb_get_kwargs(options, option_ids, 0, 2, option_values);
+  }
+  VALUE debug = option_values[0];
+  VALUE max_depth = option_values[1] != Qundef ? option_values[1] : Qnil;
+
+  rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
+
+  int ignored_stack_top_frames = NIL_P(start) ? 0 : frames_to_skip(start);
+
+  return collect_backtrace_locations(self, thread, ignored_stack_top_frames,
+                                     frames_to_capture(length, max_depth),
+                                     debug != Qundef && RTEST(debug));
+}
+
+static VALUE primitive_caller_location(VALUE self, VALUE skip, VALUE filter) {
+  // Ignore:
+  // * the current stack frame (native)
+  // * the Backtracie.caller_location that called us
+  // * the caller of Backtracie.caller_location, as caller_location returns
+  // the location of _its_ caller (like caller_locations does, with its
+  // default start of 1)
+  // * the first skip frames from there on
+  int ignored_stack_top_frames = 3 + frames_to_skip(skip);
+
+  if (!NIL_P(filter)) {
+    Check_Type(filter, T_ARRAY);
+    for (long i = 0; i < RARRAY_LEN(filter); i++) {
+      Check_Type(RARRAY_AREF(filter, i), T_STRING);
+    }
+  }
+
+  raw_location frames[2];
+  int frames_len = backtracie_find_caller_frame(
+      rb_thread_current(), ignored_stack_top_frames, filter, frames);
+  if (frames_len == 0) {
+    return Qnil;
+  }
+
+  // The frames are on the C stack, so the GC can't see them until they get
+  // into the wrapper; creating it is fine, as they are still on the Ruby stack
+  // too
+  VALUE frame_wrapper = backtracie_frame_wrapper_new(frames_len);
+  memcpy(backtracie_frame_wrapper_frames(frame_wrapper), frames,
+         sizeof(raw_location) * frames_len);
+  *backtracie_frame_wrapper_len(frame_wrapper) = frames_len;
+
+  // See collect_backtrace_locations for why cfuncs take their path from
+  // another frame
+  int path_frame_index = frames_len - 1;
+  if (!frames[path_frame_index].is_ruby_frame) {
+    path_frame_index = -1;
+  }
+  return new_location(frame_wrapper, location_memo_new(0, 1), 0,
+                      path_frame_index, false);
+}
+
+// The start and length arguments work as for Kernel#caller_locations and
+// Thread#backtrace_locations; max_depth is an extra cap on the number of
+// frames, which callers can use without having to pick a start.
+static int frames_to_skip(VALUE start) {
+  int frames = NUM2INT(start);
+  if (frames < 0) {
+    rb_raise(rb_eArgError, "negative level (%d)", frames);
+  }
+  return frames;
+}
+
+static int frames_to_capture(VALUE length, VALUE max_depth) {
+  int frames = INT_MAX;
+  if (!NIL_P(length)) {
+    frames = NUM2INT(length);
+    if (frames < 0) {
+      rb_raise(rb_eArgError, "negative size (%d)", frames);
+    }
+  }
+  if (!NIL_P(max_depth)) {
+    int max_depth_frames = NUM2INT(max_depth);
+    if (max_depth_frames < 0) {
+      rb_raise(rb_eArgError, "negative max_depth (%d)", max_depth_frames);
+    }
+    if (max_depth_frames < frames) {
+      frames = max_depth_frames;
+    }
+  }
+  return frames;
+}
+
+static VALUE primitive_minimal_caller_locations(VALUE self) {
+  // Ignore:
+  // * the current stack frame (native)
+  // * the Backtracie.minimal_caller_locations that called us
+  // * the caller of Backtracie.minimal_caller_locations, as with
+  // caller_locations and its default start of 1 (minimal_caller_locations
+  // takes no start, so this is always skipped)
   int ignored_stack_top_frames = 3;
 
-  return collect_backtrace_locations(self, Qnil, ignored_stack_top_frames);
+  return collect_minimal_backtrace_locations(rb_thread_current(),
+                                             ignored_stack_top_frames);
 }
 
-static VALUE primitive_backtrace_locations(VALUE self, VALUE thread) {
+static VALUE minimal_backtrace_locations(VALUE self, VALUE thread) {
   rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
 
-  int ignored_stack_top_frames = 0;
+  return collect_minimal_backtrace_locations(thread, 0);
+}
+
+static VALUE cache_stats(VALUE self) {
+  uint64_t hits, misses;
+  VALUE stats = rb_hash_new();
 
-  return collect_backtrace_locations(self, thread, ignored_stack_top_frames);
+  backtracie_line_number_cache_stats(&hits, &misses);
+  rb_hash_aset(stats, ID2SYM(rb_intern("line_number_cache")),
+               hits_and_misses(hits, misses));
+  backtracie_name_cache_stats(&hits, &misses);
+  rb_hash_aset(stats, ID2SYM(rb_intern("name_cache")),
+               hits_and_misses(hits, misses));
+
+  return stats;
 }
 
-inline static VALUE new_location(VALUE absolute_path, VALUE base_label,
-                                 VALUE label, VALUE lineno, VALUE path,
-                                 VALUE qualified_method_name,
-                                 VALUE path_is_synthetic, VALUE debug) {
-  VALUE arguments[] = {
-      absolute_path,         base_label,        label, lineno, path,
-      qualified_method_name, path_is_synthetic, debug};
-  return rb_class_new_instance(VALUE_COUNT(arguments), arguments,
-                               backtracie_location_class);
-}
-
-static VALUE frame_to_location(const raw_location *raw_loc,
-                               const raw_location *prev_ruby_loc) {
-  // If raw_loc != prev_ruby_loc, that means this location is a cfunc, and not a
-  // ruby frame; so, it doesn't _actually_ have a path. For compatability with
-  // Thread#backtrace et. al., we return the frame of the previous
-  // actually-a-ruby-frame location. When we do that, we set a flag
+static VALUE hits_and_misses(uint64_t hits, uint64_t misses) {
+  VALUE result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("hits")), ULL2NUM(hits));
+  rb_hash_aset(result, ID2SYM(rb_intern("misses")), ULL2NUM(misses));
+  return result;
+}
+
+// Backtracie::Locations returned by collect_backtrace_locations don't have any
+// of their fields computed up-front; instead, they keep a reference to the
+// frame wrapper holding the captured raw_locations, and each field gets
+// computed the first time it is read. Callers usually only look at a handful
+// of frames, so there's no point in building every string for every frame.
+//
+// Like the Locations created with Backtracie::Location.new, these are frozen,
+// so they can't memoize their fields as instance variables. Instead, they
+// share a location_memo_t with the other locations for the same frames.
+//
+// path_frame_index is the index of the frame whose filename/lineno should be
+// used for this location, or -1 if there is no such frame.
+//
+// The debug information is only built when asked for, as it is quite expensive
+// to compute (and hold on to), and is unlikely to be useful outside of
+// backtracie development.
+static VALUE new_location(VALUE frame_wrapper, VALUE memo, int frame_index,
+                          int path_frame_index, bool debug) {
+  raw_location *raw_frames = backtracie_frame_wrapper_frames(frame_wrapper);
+
+  VALUE location = rb_obj_alloc(backtracie_location_class);
+  rb_ivar_set(location, frame_wrapper_ivar_id, frame_wrapper);
+  rb_ivar_set(location, memo_ivar_id, memo);
+  rb_ivar_set(location, frame_index_ivar_id, INT2FIX(frame_index));
+  rb_ivar_set(location, path_frame_index_ivar_id, INT2FIX(path_frame_index));
+  // If the location's path is not its own, that means this location is a
+  // cfunc, and not a ruby frame; so, it doesn't _actually_ have a path. For
+  // compatability with Thread#backtrace et. al., we return the path of the
+  // previous actually-a-ruby-frame location. When we do that, we set a flag
   // path_is_synthetic on the location so that interested callers can know if
   // that's the case.
-  VALUE filename_abs;
-  VALUE filename_rel;
-  VALUE line_number;
-  VALUE path_is_synthetic;
-  if (prev_ruby_loc) {
-    filename_abs = backtracie_frame_filename_rbstr(prev_ruby_loc, true);
-    filename_rel = backtracie_frame_filename_rbstr(prev_ruby_loc, false);
-    line_number = INT2NUM(backtracie_frame_line_number(prev_ruby_loc));
-    path_is_synthetic = (raw_loc != prev_ruby_loc) ? Qtrue : Qfalse;
+  rb_ivar_set(location, path_is_synthetic_ivar_id,
+              to_boolean(path_frame_index != frame_index));
+  if (debug) {
+    rb_ivar_set(location, debug_ivar_id,
+                debug_raw_location(&raw_frames[frame_index]));
+  }
+  rb_obj_freeze(location);
+  return location;
+}
+
+static VALUE location_memo_new(int frames_start, int frames_len) {
+  location_memo_t *memo_data;
+  VALUE memo = TypedData_Make_Struct(location_memo_class, location_memo_t,
+                                     &location_memo_type, memo_data);
+  memo_data->frames_start = frames_start;
+  memo_data->frames_len = frames_len;
+  memo_data->fields = ALLOC_N(VALUE, frames_len * LOCATION_FIELD_COUNT);
+  for (int i = 0; i < frames_len * LOCATION_FIELD_COUNT; i++) {
+    memo_data->fields[i] = Qundef;
+  }
+  return memo;
+}
+
+static void location_memo_mark(void *ptr) {
+  location_memo_t *memo_data = (location_memo_t *)ptr;
+  for (int i = 0; i < memo_data->frames_len * LOCATION_FIELD_COUNT; i++) {
+#ifdef PRE_GC_MARK_MOVABLE
+    rb_gc_mark(memo_data->fields[i]);
+#else
+    rb_gc_mark_movable(memo_data->fields[i]);
+#endif
+  }
+}
+
+static void location_memo_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  location_memo_t *memo_data = (location_memo_t *)ptr;
+  for (int i = 0; i < memo_data->frames_len * LOCATION_FIELD_COUNT; i++) {
+    memo_data->fields[i] = rb_gc_location(memo_data->fields[i]);
+  }
+#endif
+}
+
+static void location_memo_free(void *ptr) {
+  location_memo_t *memo_data = (location_memo_t *)ptr;
+  xfree(memo_data->fields);
+  xfree(memo_data);
+}
+
+static size_t location_memo_memsize(const void *ptr) {
+  const location_memo_t *memo_data = (const location_memo_t *)ptr;
+  return sizeof(location_memo_t) +
+         sizeof(VALUE) * memo_data->frames_len * LOCATION_FIELD_COUNT;
+}
+
+// Returns where the given field of the location gets memoized, or NULL if the
+// location has no memo, as is the case for the ones created with
+// Backtracie::Location.new, which have all of their fields in instance
+// variables instead. The slot starts out as Qundef.
+static VALUE *location_memo_slot(VALUE location, location_field field) {
+  VALUE memo = rb_attr_get(location, memo_ivar_id);
+  if (NIL_P(memo)) {
+    return NULL;
+  }
+  location_memo_t *memo_data;
+  TypedData_Get_Struct(memo, location_memo_t, &location_memo_type,
+                       memo_data);
+  int memo_index = NUM2INT(rb_ivar_get(location, frame_index_ivar_id)) -
+                   memo_data->frames_start;
+  BACKTRACIE_ASSERT(memo_index >= 0 && memo_index < memo_data->frames_len);
+  return &memo_data->fields[memo_index * LOCATION_FIELD_COUNT + field];
+}
+
+static VALUE location_memoized_field(VALUE location, location_field field,
+                                     ID ivar_id,
+                                     location_field_function compute_field) {
+  VALUE *slot = location_memo_slot(location, field);
+  if (slot == NULL) {
+    return rb_ivar_get(location, ivar_id);
+  }
+  if (*slot == Qundef) {
+    // The memo is kept alive by the location, and its fields never move, so
+    // the slot is still valid after computing the field
+    *slot = compute_field(location);
+  }
+  return *slot;
+}
+
+// Returns the frame stored at the index kept in the given instance variable,
+// or NULL if there's no such frame. The returned pointer is owned by the
+// location's frame wrapper, which the location keeps alive.
+static const raw_location *location_frame(VALUE location, ID index_ivar_id) {
+  VALUE frame_wrapper = rb_ivar_get(location, frame_wrapper_ivar_id);
+  int frame_index = NUM2INT(rb_ivar_get(location, index_ivar_id));
+  if (frame_index < 0) {
+    return NULL;
+  }
+  BACKTRACIE_ASSERT(frame_index <
+                    *backtracie_frame_wrapper_len(frame_wrapper));
+  return &backtracie_frame_wrapper_frames(frame_wrapper)[frame_index];
+}
+
+static VALUE location_absolute_path(VALUE self) {
+  return location_memoized_field(self, ABSOLUTE_PATH_FIELD,
+                                 absolute_path_ivar_id, compute_absolute_path);
+}
+
+static VALUE location_base_label(VALUE self) {
+  return location_memoized_field(self, BASE_LABEL_FIELD, base_label_ivar_id,
+                                 compute_base_label);
+}
+
+static VALUE location_label(VALUE self) {
+  return location_memoized_field(self, LABEL_FIELD, label_ivar_id,
+                                 compute_label);
+}
+
+static VALUE location_lineno(VALUE self) {
+  return location_memoized_field(self, LINENO_FIELD, lineno_ivar_id,
+                                 compute_lineno);
+}
+
+static VALUE location_path(VALUE self) {
+  return location_memoized_field(self, PATH_FIELD, path_ivar_id,
+                                 compute_path);
+}
+
+static VALUE location_qualified_method_name(VALUE self) {
+  return location_memoized_field(self, QUALIFIED_METHOD_NAME_FIELD,
+                                 qualified_method_name_ivar_id,
+                                 compute_qualified_method_name);
+}
+
+static VALUE location_path_is_synthetic(VALUE self) {
+  return rb_ivar_get(self, path_is_synthetic_ivar_id);
+}
+
+static VALUE compute_absolute_path(VALUE location) {
+  const raw_location *path_loc =
+      location_frame(location, path_frame_index_ivar_id);
+  if (!path_loc) {
+    return in_native_code_path;
+  }
+  return backtracie_frame_filename_value(path_loc, true);
+}
+
+static VALUE compute_base_label(VALUE location) {
+  return backtracie_frame_label_value(
+      location_frame(location, frame_index_ivar_id), true);
+}
+
+static VALUE compute_label(VALUE location) {
+  return backtracie_frame_label_value(
+      location_frame(location, frame_index_ivar_id), false);
+}
+
+static VALUE compute_lineno(VALUE location) {
+  const raw_location *path_loc =
+      location_frame(location, path_frame_index_ivar_id);
+  if (!path_loc) {
+    return INT2NUM(0);
+  }
+  return INT2NUM(backtracie_frame_line_number(path_loc));
+}
+
+static VALUE compute_path(VALUE location) {
+  const raw_location *path_loc =
+      location_frame(location, path_frame_index_ivar_id);
+  if (!path_loc) {
+    return in_native_code_path;
+  }
+  return backtracie_frame_filename_value(path_loc, false);
+}
 
+static VALUE compute_qualified_method_name(VALUE location) {
+  return backtracie_frame_name_value(
+      location_frame(location, frame_index_ivar_id));
+}
+
+// Like collect_backtrace_locations, but returns Backtracie::MinimalLocations,
+// which only keep alive the few objects needed to render them (and not the
+// iseqs of the frames, as Backtracie::Locations do)
+static VALUE collect_minimal_backtrace_locations(VALUE thread,
+                                                 int ignored_stack_top_frames) {
+  if (!backtracie_is_thread_alive(thread)) {
+    return Qnil;
+  }
+
+  int raw_frame_count = backtracie_frame_count_for_thread(thread);
+  backtracie_frame_wrapper_reserve(scratch_frame_wrapper, raw_frame_count);
+  raw_location *raw_frames =
+      backtracie_frame_wrapper_frames(scratch_frame_wrapper);
+  int *raw_frames_len = backtracie_frame_wrapper_len(scratch_frame_wrapper);
+  backtracie_capture_frames_for_thread(thread, ignored_stack_top_frames,
+                                       raw_frame_count, raw_frames,
+                                       raw_frames_len);
+
+  // See capture_frames for why using the scratch wrapper here is fine
+  VALUE frame_wrapper = backtracie_minimal_frame_wrapper_new(*raw_frames_len);
+  minimal_location_t *frames =
+      backtracie_minimal_frame_wrapper_frames(frame_wrapper);
+  int *frames_len = backtracie_minimal_frame_wrapper_len(frame_wrapper);
+  for (int i = 0; i < *raw_frames_len; i++) {
+    backtracie_raw_location_to_minimal_location(&raw_frames[i], &frames[i]);
+  }
+  *frames_len = *raw_frames_len;
+  backtracie_frame_wrapper_clear(scratch_frame_wrapper);
+
+  VALUE memo = location_memo_new(0, *frames_len);
+  VALUE rb_locations = rb_ary_new_capa(*frames_len);
+  // As in collect_backtrace_locations, cfuncs use the path and line number of
+  // their caller
+  int prev_ruby_frame_index = -1;
+  for (int i = *frames_len - 1; i >= 0; i--) {
+    if (frames[i].is_ruby_frame) {
+      prev_ruby_frame_index = i;
+    }
+    VALUE location = rb_obj_alloc(backtracie_minimal_location_class);
+    rb_ivar_set(location, frame_wrapper_ivar_id, frame_wrapper);
+    rb_ivar_set(location, memo_ivar_id, memo);
+    rb_ivar_set(location, frame_index_ivar_id, INT2FIX(i));
+    rb_ivar_set(location, path_frame_index_ivar_id,
+                INT2FIX(prev_ruby_frame_index));
+    rb_ivar_set(location, path_is_synthetic_ivar_id,
+                to_boolean(prev_ruby_frame_index != i));
+    rb_obj_freeze(location);
+    rb_ary_store(rb_locations, i, location);
+  }
+
+  RB_GC_GUARD(frame_wrapper);
+  return rb_locations;
+}
+
+static const minimal_location_t *minimal_location_frame(VALUE location,
+                                                        ID index_ivar_id) {
+  VALUE frame_wrapper = rb_ivar_get(location, frame_wrapper_ivar_id);
+  int frame_index = NUM2INT(rb_ivar_get(location, index_ivar_id));
+  if (frame_index < 0) {
+    return NULL;
+  }
+  BACKTRACIE_ASSERT(frame_index <
+                    *backtracie_minimal_frame_wrapper_len(frame_wrapper));
+  return &backtracie_minimal_frame_wrapper_frames(frame_wrapper)[frame_index];
+}
+
+static VALUE minimal_location_absolute_path(VALUE self) {
+  return location_memoized_field(self, ABSOLUTE_PATH_FIELD,
+                                 absolute_path_ivar_id,
+                                 compute_minimal_absolute_path);
+}
+
+static VALUE minimal_location_lineno(VALUE self) {
+  const minimal_location_t *path_loc =
+      minimal_location_frame(self, path_frame_index_ivar_id);
+  return INT2NUM(path_loc ? path_loc->line_number : 0);
+}
+
+static VALUE minimal_location_qualified_method_name(VALUE self) {
+  return location_memoized_field(self, QUALIFIED_METHOD_NAME_FIELD,
+                                 qualified_method_name_ivar_id,
+                                 compute_minimal_qualified_method_name);
+}
+
+static VALUE compute_minimal_absolute_path(VALUE location) {
+  const minimal_location_t *path_loc =
+      minimal_location_frame(location, path_frame_index_ivar_id);
+  if (!path_loc) {
+    return in_native_code_path;
+  }
+  return SAFE_NAVIGATION(backtracie_frozen_str, path_loc->filename);
+}
+
+static VALUE compute_minimal_qualified_method_name(VALUE location) {
+  return backtracie_name_cache_lookup_value(
+      minimal_location_frame(location, frame_index_ivar_id));
+}
+
+// Location#to_s, MinimalLocation#to_s and Location#fancy_to_s render straight
+// into the String they return, from the (possibly not yet memoized) fields of
+// the location; see append_location.
+static VALUE location_to_s(VALUE self) {
+  strbuilder_t out;
+  strbuilder_init_rstring(&out, 128);
+  append_location(&out, self, false);
+  return finish_formatted(&out);
+}
+
+static VALUE location_fancy_to_s(VALUE self) {
+  strbuilder_t out;
+  strbuilder_init_rstring(&out, 128);
+  append_location(&out, self, true);
+  return finish_formatted(&out);
+}
+
+// Renders a whole backtrace (an Array of Backtracie::Locations,
+// Backtracie::MinimalLocations, or anything else that responds to #to_s, such
+// as Thread::Backtrace::Locations) into a single String, one location per
+// line. With style: :fancy, Backtracie::Locations are rendered with
+// #fancy_to_s rather than #to_s.
+static VALUE format_backtrace(int argc, VALUE *argv, VALUE self) {
+  VALUE locations, options;
+  rb_scan_args(argc, argv, "1:", &locations, &options);
+  VALUE style = Qundef;
+  if (!NIL_P(options)) {
+    rb_get_kwargs(options, &style_id, 0, 1, &style);
+  }
+  bool fancy = false;
+  if (style == ID2SYM(fancy_id)) {
+    fancy = true;
+  } else if (style != Qundef && style != ID2SYM(default_id)) {
+    rb_raise(rb_eArgError, "unknown style: %s",
+             RSTRING_PTR(rb_inspect(style)));
+  }
+  Check_Type(locations, T_ARRAY);
+
+  // Most lines fit in this, so the String rarely needs to grow
+  strbuilder_t out;
+  strbuilder_init_rstring(&out, RARRAY_LEN(locations) * 128);
+  for (long i = 0; i < RARRAY_LEN(locations); i++) {
+    if (i > 0) {
+      strbuilder_append_literal(&out, "\n");
+    }
+    append_location(&out, RARRAY_AREF(locations, i), fancy);
+  }
+  return finish_formatted(&out);
+}
+
+// Like location_memoized_field, but doesn't memoize the field, so that
+// formatting a location doesn't keep all of its Strings around
+static VALUE location_peek_field(VALUE location, location_field field,
+                                 ID ivar_id,
+                                 location_field_function compute_field) {
+  VALUE *slot = location_memo_slot(location, field);
+  if (slot == NULL) {
+    return rb_ivar_get(location, ivar_id);
+  }
+  return *slot != Qundef ? *slot : compute_field(location);
+}
+
+// Renders location the same way as the Ruby versions of Location#to_s (or, if
+// fancy, Location#fancy_to_s) and MinimalLocation#to_s did, e.g.
+// "path:lineno:in `label'". Anything else gets rendered with its own #to_s.
+static void append_location(strbuilder_t *out, VALUE location, bool fancy) {
+  VALUE path, lineno, name;
+  bool quote_name = false;
+  if (rb_obj_is_kind_of(location, backtracie_location_class)) {
+    path = location_peek_field(location, PATH_FIELD, path_ivar_id,
+                               compute_path);
+    lineno = location_peek_field(location, LINENO_FIELD, lineno_ivar_id,
+                                 compute_lineno);
+    if (fancy) {
+      name = location_peek_field(location, QUALIFIED_METHOD_NAME_FIELD,
+                                 qualified_method_name_ivar_id,
+                                 compute_qualified_method_name);
+    } else {
+      name = location_peek_field(location, LABEL_FIELD, label_ivar_id,
+                                 compute_label);
+      quote_name = true;
+    }
+  } else if (rb_obj_is_kind_of(location, backtracie_minimal_location_class)) {
+    path = location_peek_field(location, ABSOLUTE_PATH_FIELD,
+                               absolute_path_ivar_id,
+                               compute_minimal_absolute_path);
+    lineno = minimal_location_lineno(location);
+    name = location_peek_field(location, QUALIFIED_METHOD_NAME_FIELD,
+                               qualified_method_name_ivar_id,
+                               compute_minimal_qualified_method_name);
   } else {
-    filename_abs = rb_str_new2("(in native code)");
-    filename_rel = rb_str_dup(filename_abs);
-    line_number = INT2NUM(0);
-    path_is_synthetic = Qtrue;
+    append_field(out, location);
+    return;
+  }
+
+  append_field(out, path);
+  if (lineno != INT2FIX(0)) {
+    strbuilder_append_literal(out, ":");
+    append_field(out, lineno);
   }
+  strbuilder_append_literal(out, ":in ");
+  if (quote_name) {
+    strbuilder_append_literal(out, "`");
+  }
+  append_field(out, name);
+  if (quote_name) {
+    strbuilder_append_literal(out, "'");
+  }
+}
+
+// Appends value the same way string interpolation would
+static void append_field(strbuilder_t *out, VALUE value) {
+  if (FIXNUM_P(value)) {
+    strbuilder_appendf(out, "%ld", FIX2LONG(value));
+  } else if (!NIL_P(value)) {
+    strbuilder_append_value(
+        out, RB_TYPE_P(value, T_STRING) ? value : rb_obj_as_string(value));
+  }
+}
 
-  return new_location(filename_abs, backtracie_frame_label_rbstr(raw_loc, true),
-                      backtracie_frame_label_rbstr(raw_loc, false), line_number,
-                      filename_rel, backtracie_frame_name_rbstr(raw_loc),
-                      path_is_synthetic, debug_raw_location(raw_loc));
+static VALUE finish_formatted(strbuilder_t *out) {
+  VALUE formatted = strbuilder_finish_rstring(out);
+  // As with string literals, and the paths and labels being rendered
+  rb_enc_associate(formatted, rb_utf8_encoding());
+  return formatted;
 }
 
 static VALUE debug_raw_location(const raw_location *the_location) {
@@ -0,0 +1,527 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements Backtracie::AllocationSampler, which captures the stack
+// of one in every `interval` object allocations into a Backtracie::StackTable,
+// and keeps track of which of the sampled objects are still alive.
+//
+// Sampling happens in a RUBY_INTERNAL_EVENT_NEWOBJ hook, which runs in the
+// middle of allocating an object, and so must not allocate any Ruby objects
+// itself. Capturing stacks into a stack table doesn't, and neither does
+// anything else in here: memory is allocated with plain malloc, in the same way
+// as the stack table does it.
+//
+// Sampled objects are kept in a hash table of object => stack id, which
+// doesn't mark them (so it doesn't keep them alive); instead, entries get
+// removed by a RUBY_INTERNAL_EVENT_FREEOBJ hook when their object is freed.
+// As the stacks are interned into minimal frames, each sample costs a table
+// entry, and doesn't retain any iseqs or strings.
+//
+// Only one allocation sampler can be running at any given time, as the running
+// sampler is what keeps it from being garbage collected while the hooks are
+// using it.
+
+#include "extconf.h"
+
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+#define DEFAULT_INTERVAL 1000
+#define INITIAL_LIVE_OBJECTS_CAPA 1024 // Must be a power of two
+
+typedef struct {
+  VALUE object; // 0 means "empty slot"
+  uint32_t stack_id;
+} live_object_t;
+
+typedef struct {
+  VALUE stack_table;
+  VALUE newobj_tracepoint;
+  VALUE freeobj_tracepoint;
+  uint32_t interval;
+  uint32_t allocations_until_sample;
+  uint64_t allocation_count;
+  uint64_t sample_count;
+
+  // Number of sampled allocations, and of sampled objects that are still
+  // alive, for each stack id
+  uint64_t *allocation_counts;
+  uint64_t *live_counts;
+  uint32_t counts_capa;
+
+  // Open-addressing hash table (with linear probing) of the sampled objects
+  // that are still alive
+  live_object_t *live_objects;
+  uint32_t live_objects_len;
+  uint32_t live_objects_capa;
+} allocation_sampler_t;
+
+static VALUE backtracie_module = Qnil;
+static ID interval_id;
+
+// The allocation sampler that is currently running (if any)
+static VALUE running_allocation_sampler = Qnil;
+
+static void allocation_sampler_mark(void *ptr);
+static void allocation_sampler_compact(void *ptr);
+static void allocation_sampler_free(void *ptr);
+static size_t allocation_sampler_memsize(const void *ptr);
+static const rb_data_type_t allocation_sampler_type = {
+    .wrap_struct_name = "backtracie_allocation_sampler",
+    .function = {.dmark = allocation_sampler_mark,
+                 .dfree = allocation_sampler_free,
+                 .dsize = allocation_sampler_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = allocation_sampler_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE allocation_sampler_alloc(VALUE klass);
+static allocation_sampler_t *get_allocation_sampler(VALUE self);
+static VALUE allocation_sampler_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE allocation_sampler_start(VALUE self);
+static VALUE allocation_sampler_stop(VALUE self);
+static VALUE allocation_sampler_is_running(VALUE self);
+static VALUE allocation_sampler_stack_table(VALUE self);
+static VALUE allocation_sampler_samples(VALUE self);
+static VALUE allocation_sampler_live_samples(VALUE self);
+static VALUE allocation_sampler_allocation_stack(VALUE self, VALUE object);
+static VALUE allocation_sampler_allocation_count(VALUE self);
+static VALUE allocation_sampler_sample_count(VALUE self);
+static VALUE counts_to_hash(const uint64_t *counts, uint32_t len);
+static void on_newobj(VALUE tracepoint, void *data);
+static void on_freeobj(VALUE tracepoint, void *data);
+static bool reserve_counts(allocation_sampler_t *sampler, uint32_t stack_id);
+static uint32_t live_object_slot(VALUE object, uint32_t capa);
+static bool rebuild_live_objects(allocation_sampler_t *sampler, uint32_t capa,
+                                 bool update_locations);
+static bool live_objects_insert(allocation_sampler_t *sampler, VALUE object,
+                                uint32_t stack_id);
+static live_object_t *live_objects_find(allocation_sampler_t *sampler,
+                                        VALUE object);
+static void live_objects_delete(allocation_sampler_t *sampler,
+                                live_object_t *entry);
+static void live_objects_clear(allocation_sampler_t *sampler);
+
+void backtracie_allocation_sampler_init(VALUE module) {
+  backtracie_module = module;
+  interval_id = rb_intern("interval");
+  rb_global_variable(&running_allocation_sampler);
+
+  VALUE allocation_sampler_class = rb_define_class_under(
+      backtracie_module, "AllocationSampler", rb_cObject);
+  rb_define_alloc_func(allocation_sampler_class, allocation_sampler_alloc);
+
+  rb_define_method(allocation_sampler_class, "initialize",
+                   allocation_sampler_initialize, -1);
+  rb_define_method(allocation_sampler_class, "start", allocation_sampler_start,
+                   0);
+  rb_define_method(allocation_sampler_class, "stop", allocation_sampler_stop,
+                   0);
+  rb_define_method(allocation_sampler_class, "running?",
+                   allocation_sampler_is_running, 0);
+  rb_define_method(allocation_sampler_class, "stack_table",
+                   allocation_sampler_stack_table, 0);
+  rb_define_method(allocation_sampler_class, "samples",
+                   allocation_sampler_samples, 0);
+  rb_define_method(allocation_sampler_class, "live_samples",
+                   allocation_sampler_live_samples, 0);
+  rb_define_method(allocation_sampler_class, "allocation_stack",
+                   allocation_sampler_allocation_stack, 1);
+  rb_define_method(allocation_sampler_class, "allocation_count",
+                   allocation_sampler_allocation_count, 0);
+  rb_define_method(allocation_sampler_class, "sample_count",
+                   allocation_sampler_sample_count, 0);
+}
+
+static VALUE allocation_sampler_alloc(VALUE klass) {
+  allocation_sampler_t *sampler;
+  VALUE self = TypedData_Make_Struct(klass, allocation_sampler_t,
+                                     &allocation_sampler_type, sampler);
+  sampler->stack_table = Qnil;
+  sampler->newobj_tracepoint = Qnil;
+  sampler->freeobj_tracepoint = Qnil;
+  sampler->interval = DEFAULT_INTERVAL;
+  return self;
+}
+
+static allocation_sampler_t *get_allocation_sampler(VALUE self) {
+  allocation_sampler_t *sampler;
+  TypedData_Get_Struct(self, allocation_sampler_t, &allocation_sampler_type,
+                       sampler);
+  return sampler;
+}
+
+static VALUE allocation_sampler_initialize(int argc, VALUE *argv, VALUE self) {
+  allocation_sampler_t *sampler = get_allocation_sampler(self);
+  VALUE options;
+  VALUE interval = Qundef;
+
+  rb_scan_args(argc, argv, ":", &options);
+  if (!NIL_P(options)) {
+    rb_get_kwargs(options, &interval_id, 0, 1, &interval);
+  }
+
+  if (interval != Qundef) {
+    int interval_allocations = NUM2INT(interval);
+    if (interval_allocations <= 0) {
+      rb_raise(rb_eArgError, "interval must be positive");
+    }
+    sampler->interval = (uint32_t)interval_allocations;
+  }
+  sampler->stack_table = backtracie_stack_table_new();
+  sampler->newobj_tracepoint =
+      rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_NEWOBJ, on_newobj, sampler);
+  sampler->freeobj_tracepoint =
+      rb_tracepoint_new(0, RUBY_INTERNAL_EVENT_FREEOBJ, on_freeobj, sampler);
+
+  return self;
+}
+
+static VALUE allocation_sampler_start(VALUE self) {
+  allocation_sampler_t *sampler = get_allocation_sampler(self);
+
+  if (running_allocation_sampler == self) {
+    return self;
+  }
+  if (RTEST(running_allocation_sampler)) {
+    rb_raise(rb_eRuntimeError,
+             "Another Backtracie::AllocationSampler is already running");
+  }
+
+  // Objects sampled before the last stop are not being tracked anymore
+  if (sampler->counts_capa > 0) {
+    memset(sampler->live_counts, 0, sizeof(uint64_t) * sampler->counts_capa);
+  }
+  sampler->allocations_until_sample = sampler->interval;
+  running_allocation_sampler = self;
+  rb_tracepoint_enable(sampler->freeobj_tracepoint);
+  rb_tracepoint_enable(sampler->newobj_tracepoint);
+
+  return self;
+}
+
+// Stops sampling, and stops tracking the sampled objects; live_samples keeps
+// returning the objects that were alive at this point.
+static VALUE allocation_sampler_stop(VALUE self) {
+  allocation_sampler_t *sampler = get_allocation_sampler(self);
+
+  if (running_allocation_sampler != self) {
+    return self;
+  }
+
+  rb_tracepoint_disable(sampler->newobj_tracepoint);
+  rb_tracepoint_disable(sampler->freeobj_tracepoint);
+  live_objects_clear(sampler);
+  running_allocation_sampler = Qnil;
+
+  return self;
+}
+
+static VALUE allocation_sampler_is_running(VALUE self) {
+  return running_allocation_sampler == self ? Qtrue : Qfalse;
+}
+
+static VALUE allocation_sampler_stack_table(VALUE self) {
+  return get_allocation_sampler(self)->stack_table;
+}
+
+// Returns a hash of stack id => number of sampled allocations with that stack
+static VALUE allocation_sampler_samples(VALUE self) {
+  allocation_sampler_t *sampler = get_allocation_sampler(self);
+  return counts_to_hash(sampler->allocation_counts, sampler->counts_capa);
+}
+
+// Returns a hash of stack id => number of sampled objects with that allocation
+// stack that are still alive. Objects only get noticed as freed when the GC
+// sweeps them, so a GC.start beforehand makes this more accurate.
+static VALUE allocation_sampler_live_samples(VALUE self) {
+  allocation_sampler_t *sampler = get_allocation_sampler(self);
+  return counts_to_hash(sampler->live_counts, sampler->counts_capa);
+}
+
+// Returns the id of the stack where the given object was allocated, or nil if
+// its allocation wasn't sampled (or the sampler is not running)
+static VALUE allocation_sampler_allocation_stack(VALUE self, VALUE object) {
+  live_object_t *entry =
+      live_objects_find(get_allocation_sampler(self), object);
+  return entry == NULL ? Qnil : UINT2NUM(entry->stack_id);
+}
+
+static VALUE allocation_sampler_allocation_count(VALUE self) {
+  return ULL2NUM(get_allocation_sampler(self)->allocation_count);
+}
+
+static VALUE allocation_sampler_sample_count(VALUE self) {
+  return ULL2NUM(get_allocation_sampler(self)->sample_count);
+}
+
+static VALUE counts_to_hash(const uint64_t *counts, uint32_t len) {
+  VALUE samples = rb_hash_new();
+  for (uint32_t stack_id = 0; stack_id < len; stack_id++) {
+    if (counts[stack_id] > 0) {
+      rb_hash_aset(samples, UINT2NUM(stack_id), ULL2NUM(counts[stack_id]));
+    }
+  }
+  return samples;
+}
+
+// Must not allocate any Ruby objects; see the top of this file.
+static void on_newobj(VALUE tracepoint, void *data) {
+  allocation_sampler_t *sampler = (allocation_sampler_t *)data;
+  sampler->allocation_count++;
+  if (--sampler->allocations_until_sample > 0) {
+    return;
+  }
+  sampler->allocations_until_sample = sampler->interval;
+
+  VALUE object = rb_tracearg_object(rb_tracearg_from_tracepoint(tracepoint));
+  // We're in no position to raise from here, so if we run out of memory (or
+  // the stack table is full), we drop the sample
+  uint32_t stack_id;
+  if (!backtracie_try_capture_stack_for_thread(
+          sampler->stack_table, rb_thread_current(), 0, &stack_id)) {
+    return;
+  }
+  if (!reserve_counts(sampler, stack_id) ||
+      !live_objects_insert(sampler, object, stack_id)) {
+    return;
+  }
+
+  sampler->allocation_counts[stack_id]++;
+  sampler->live_counts[stack_id]++;
+  sampler->sample_count++;
+}
+
+// Runs during GC, for every object that gets freed, so this needs to be cheap
+static void on_freeobj(VALUE tracepoint, void *data) {
+  allocation_sampler_t *sampler = (allocation_sampler_t *)data;
+  if (sampler->live_objects_len == 0) {
+    return;
+  }
+
+  VALUE object = rb_tracearg_object(rb_tracearg_from_tracepoint(tracepoint));
+  live_object_t *entry = live_objects_find(sampler, object);
+  if (entry != NULL) {
+    sampler->live_counts[entry->stack_id]--;
+    live_objects_delete(sampler, entry);
+  }
+}
+
+static bool reserve_counts(allocation_sampler_t *sampler, uint32_t stack_id) {
+  if (stack_id < sampler->counts_capa) {
+    return true;
+  }
+
+  uint32_t new_capa = sampler->counts_capa == 0 ? 1024 : sampler->counts_capa;
+  while (stack_id >= new_capa) {
+    new_capa *= 2;
+  }
+  uint64_t *new_allocation_counts =
+      realloc(sampler->allocation_counts, sizeof(uint64_t) * new_capa);
+  if (new_allocation_counts == NULL) {
+    return false;
+  }
+  sampler->allocation_counts = new_allocation_counts;
+  uint64_t *new_live_counts =
+      realloc(sampler->live_counts, sizeof(uint64_t) * new_capa);
+  if (new_live_counts == NULL) {
+    return false;
+  }
+  sampler->live_counts = new_live_counts;
+
+  size_t added = sizeof(uint64_t) * (new_capa - sampler->counts_capa);
+  memset(sampler->allocation_counts + sampler->counts_capa, 0, added);
+  memset(sampler->live_counts + sampler->counts_capa, 0, added);
+  sampler->counts_capa = new_capa;
+  return true;
+}
+
+static uint32_t live_object_slot(VALUE object, uint32_t capa) {
+  // Fibonacci hashing; object addresses are aligned, so their lowest bits are
+  // always the same, and can't be used directly
+  return (uint32_t)(((uint64_t)object * 0x9e3779b97f4a7c15ULL) >> 32) &
+         (capa - 1);
+}
+
+// Moves all entries into a new table with the given capacity. If
+// update_locations is set, also replaces every object with its new location,
+// in case it was moved by GC compaction.
+static bool rebuild_live_objects(allocation_sampler_t *sampler, uint32_t capa,
+                                 bool update_locations) {
+  live_object_t *new_live_objects = calloc(capa, sizeof(live_object_t));
+  if (new_live_objects == NULL) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < sampler->live_objects_capa; i++) {
+    live_object_t entry = sampler->live_objects[i];
+    if (entry.object == 0) {
+      continue;
+    }
+#ifndef PRE_GC_MARK_MOVABLE
+    if (update_locations) {
+      entry.object = rb_gc_location(entry.object);
+    }
+#endif
+    uint32_t slot = live_object_slot(entry.object, capa);
+    while (new_live_objects[slot].object != 0) {
+      slot = (slot + 1) & (capa - 1);
+    }
+    new_live_objects[slot] = entry;
+  }
+
+  free(sampler->live_objects);
+  sampler->live_objects = new_live_objects;
+  sampler->live_objects_capa = capa;
+  return true;
+}
+
+static bool live_objects_insert(allocation_sampler_t *sampler, VALUE object,
+                                uint32_t stack_id) {
+  // Keep the load factor at or below 50%
+  if ((sampler->live_objects_len + 1) * 2 > sampler->live_objects_capa) {
+    uint32_t new_capa = sampler->live_objects_capa == 0
+                            ? INITIAL_LIVE_OBJECTS_CAPA
+                            : sampler->live_objects_capa * 2;
+    if (!rebuild_live_objects(sampler, new_capa, false)) {
+      return false;
+    }
+  }
+
+  uint32_t mask = sampler->live_objects_capa - 1;
+  uint32_t slot = live_object_slot(object, sampler->live_objects_capa);
+  while (sampler->live_objects[slot].object != 0) {
+    if (sampler->live_objects[slot].object == object) {
+      // Shouldn't happen, as objects get removed when they are freed, but
+      // just in case, the newest allocation wins
+      sampler->live_counts[sampler->live_objects[slot].stack_id]--;
+      sampler->live_objects[slot].stack_id = stack_id;
+      return true;
+    }
+    slot = (slot + 1) & mask;
+  }
+  sampler->live_objects[slot].object = object;
+  sampler->live_objects[slot].stack_id = stack_id;
+  sampler->live_objects_len++;
+  return true;
+}
+
+static live_object_t *live_objects_find(allocation_sampler_t *sampler,
+                                        VALUE object) {
+  if (sampler->live_objects_len == 0 || SPECIAL_CONST_P(object)) {
+    return NULL;
+  }
+
+  uint32_t mask = sampler->live_objects_capa - 1;
+  uint32_t slot = live_object_slot(object, sampler->live_objects_capa);
+  while (sampler->live_objects[slot].object != 0) {
+    if (sampler->live_objects[slot].object == object) {
+      return &sampler->live_objects[slot];
+    }
+    slot = (slot + 1) & mask;
+  }
+  return NULL;
+}
+
+// Removes the entry, shifting back any later entries in the same run, so that
+// lookups don't stop early at the empty slot it leaves behind
+static void live_objects_delete(allocation_sampler_t *sampler,
+                                live_object_t *entry) {
+  uint32_t mask = sampler->live_objects_capa - 1;
+  uint32_t hole = (uint32_t)(entry - sampler->live_objects);
+
+  for (uint32_t slot = (hole + 1) & mask;
+       sampler->live_objects[slot].object != 0; slot = (slot + 1) & mask) {
+    uint32_t home = live_object_slot(sampler->live_objects[slot].object,
+                                     sampler->live_objects_capa);
+    // The entry can only move back if that doesn't put it before its home
+    if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+      sampler->live_objects[hole] = sampler->live_objects[slot];
+      hole = slot;
+    }
+  }
+  sampler->live_objects[hole].object = 0;
+  sampler->live_objects_len--;
+}
+
+static void live_objects_clear(allocation_sampler_t *sampler) {
+  free(sampler->live_objects);
+  sampler->live_objects = NULL;
+  sampler->live_objects_len = 0;
+  sampler->live_objects_capa = 0;
+}
+
+static void allocation_sampler_mark(void *ptr) {
+  allocation_sampler_t *sampler = (allocation_sampler_t *)ptr;
+  // Note that the live objects are deliberately not marked
+#ifdef PRE_GC_MARK_MOVABLE
+  rb_gc_mark(sampler->stack_table);
+  rb_gc_mark(sampler->newobj_tracepoint);
+  rb_gc_mark(sampler->freeobj_tracepoint);
+#else
+  rb_gc_mark_movable(sampler->stack_table);
+  rb_gc_mark_movable(sampler->newobj_tracepoint);
+  rb_gc_mark_movable(sampler->freeobj_tracepoint);
+#endif
+}
+
+static void allocation_sampler_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  allocation_sampler_t *sampler = (allocation_sampler_t *)ptr;
+  sampler->stack_table = rb_gc_location(sampler->stack_table);
+  sampler->newobj_tracepoint = rb_gc_location(sampler->newobj_tracepoint);
+  sampler->freeobj_tracepoint = rb_gc_location(sampler->freeobj_tracepoint);
+
+  // Live objects may have moved as well, which changes where they belong in
+  // the table
+  if (sampler->live_objects_len > 0 &&
+      !rebuild_live_objects(sampler, sampler->live_objects_capa, true)) {
+    // We can't keep entries with outdated objects around, so as a last resort,
+    // stop tracking them
+    live_objects_clear(sampler);
+    memset(sampler->live_counts, 0, sizeof(uint64_t) * sampler->counts_capa);
+  }
+#endif
+}
+
+static void allocation_sampler_free(void *ptr) {
+  allocation_sampler_t *sampler = (allocation_sampler_t *)ptr;
+  free(sampler->allocation_counts);
+  free(sampler->live_counts);
+  free(sampler->live_objects);
+  xfree(sampler);
+}
+
+static size_t allocation_sampler_memsize(const void *ptr) {
+  const allocation_sampler_t *sampler = (const allocation_sampler_t *)ptr;
+  return sizeof(allocation_sampler_t) +
+         2 * sizeof(uint64_t) * sampler->counts_capa +
+         sizeof(live_object_t) * sampler->live_objects_capa;
+}
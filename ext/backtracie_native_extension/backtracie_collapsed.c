@@ -0,0 +1,207 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements exporting stacks from a Backtracie::StackTable in the
+// "collapsed" (aka "folded") format used by Brendan Gregg's flamegraph tools,
+// one line per stack:
+//
+//   outermost_frame;...;innermost_frame sample_count
+//
+// Exporting works off a snapshot of the stack table (see backtracie_symbols.c),
+// and doesn't need the GVL. Output is built in a single reusable buffer, which
+// gets handed over to the write function whenever it grows past
+// FLUSH_THRESHOLD.
+
+#include "extconf.h"
+
+#include <errno.h>
+#include <ruby.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+#include "strbuilder.h"
+
+#define FLUSH_THRESHOLD (64 * 1024)
+
+typedef struct {
+  const backtracie_symbols_t *symbols;
+  const uint32_t *stack_ids;
+  const uint64_t *counts;
+  size_t len;
+  backtracie_write_function_t write;
+  void *write_data;
+  size_t bytes_written;
+
+  // Where to go if something fails, with the error to return
+  jmp_buf abort;
+  int error;
+
+  strbuilder_t buffer;
+  // Frame ids of the current stack
+  uint32_t *frame_ids;
+  uint32_t frame_ids_capa;
+} collapsed_export_t;
+
+typedef struct {
+  const uint32_t *stack_ids;
+  const uint64_t *counts;
+  size_t len;
+} collapsed_args_t;
+
+static int export_collapsed(const backtracie_symbols_t *symbols,
+                            void *export_data,
+                            backtracie_write_function_t write,
+                            void *write_data, size_t *bytes_written);
+static void write_collapsed(collapsed_export_t *state);
+static void flush(collapsed_export_t *state);
+static void *checked_realloc(collapsed_export_t *state, void *ptr, size_t size);
+
+size_t backtracie_stack_table_write_collapsed(VALUE table,
+                                              const uint32_t *stack_ids,
+                                              const uint64_t *counts,
+                                              size_t len, VALUE output) {
+  collapsed_args_t args = {
+      .stack_ids = stack_ids,
+      .counts = counts,
+      .len = len,
+  };
+  return backtracie_output_export(
+      output, backtracie_stack_table_symbolize(table, stack_ids, counts, len),
+      export_collapsed, &args);
+}
+
+static int export_collapsed(const backtracie_symbols_t *symbols,
+                            void *export_data,
+                            backtracie_write_function_t write,
+                            void *write_data, size_t *bytes_written) {
+  collapsed_args_t *args = (collapsed_args_t *)export_data;
+  return backtracie_symbols_write_collapsed(symbols, args->stack_ids,
+                                            args->counts, args->len, write,
+                                            write_data, bytes_written);
+}
+
+int backtracie_symbols_write_collapsed(const backtracie_symbols_t *symbols,
+                                       const uint32_t *stack_ids,
+                                       const uint64_t *counts, size_t len,
+                                       backtracie_write_function_t write,
+                                       void *write_data,
+                                       size_t *bytes_written) {
+  // Lives on the heap, as it gets modified after setjmp
+  collapsed_export_t *state = calloc(1, sizeof(collapsed_export_t));
+  if (state == NULL) {
+    return ENOMEM;
+  }
+  state->symbols = symbols;
+  state->stack_ids = stack_ids;
+  state->counts = counts;
+  state->len = len;
+  state->write = write;
+  state->write_data = write_data;
+  strbuilder_init_growable(&state->buffer, FLUSH_THRESHOLD * 2);
+
+  if (setjmp(state->abort) == 0) {
+    write_collapsed(state);
+  }
+
+  int error = state->error;
+  *bytes_written = state->bytes_written;
+  strbuilder_free_growable(&state->buffer);
+  free(state->frame_ids);
+  free(state);
+  return error;
+}
+
+static void write_collapsed(collapsed_export_t *state) {
+  const backtracie_symbols_t *symbols = state->symbols;
+
+  for (size_t i = 0; i < state->len; i++) {
+    uint32_t stack_id = state->stack_ids[i];
+    if (stack_id == BACKTRACIE_EMPTY_STACK_ID || state->counts[i] == 0) {
+      continue;
+    }
+    BACKTRACIE_ASSERT(stack_id < symbols->stack_count &&
+                      symbols->stack_depths[stack_id] > 0);
+
+    uint32_t depth = symbols->stack_depths[stack_id];
+    if (depth > state->frame_ids_capa) {
+      state->frame_ids =
+          checked_realloc(state, state->frame_ids, sizeof(uint32_t) * depth);
+      state->frame_ids_capa = depth;
+    }
+    // Stacks go from the innermost frame to the outermost one, but the output
+    // needs to start from the outermost one
+    for (uint32_t j = depth; j > 0; j--) {
+      state->frame_ids[j - 1] = symbols->stack_frames[stack_id];
+      stack_id = symbols->stack_parents[stack_id];
+    }
+
+    for (uint32_t j = 0; j < depth; j++) {
+      if (j > 0) {
+        strbuilder_append_literal(&state->buffer, ";");
+      }
+      size_t name_len;
+      const char *name = backtracie_symbols_string(
+          symbols, symbols->frame_names[state->frame_ids[j]], &name_len);
+      strbuilder_append_len(&state->buffer, name, name_len);
+    }
+    strbuilder_appendf(&state->buffer, " %llu\n",
+                       (unsigned long long)state->counts[i]);
+    if (state->buffer.out_of_memory) {
+      state->error = ENOMEM;
+      longjmp(state->abort, 1);
+    }
+
+    if (state->buffer.attempted_size >= FLUSH_THRESHOLD) {
+      flush(state);
+    }
+  }
+  flush(state);
+}
+
+static void flush(collapsed_export_t *state) {
+  const char *buf = state->buffer.original_buf;
+  size_t len = state->buffer.attempted_size;
+
+  if (len == 0) {
+    return;
+  }
+
+  int error = state->write(state->write_data, buf, len);
+  if (error != 0) {
+    state->error = error;
+    longjmp(state->abort, 1);
+  }
+
+  state->bytes_written += len;
+  strbuilder_reset(&state->buffer);
+}
+
+static void *checked_realloc(collapsed_export_t *state, void *ptr,
+                             size_t size) {
+  void *result = realloc(ptr, size);
+  if (result == NULL) {
+    state->error = ENOMEM;
+    longjmp(state->abort, 1);
+  }
+  return result;
+}
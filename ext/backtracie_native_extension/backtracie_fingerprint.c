@@ -0,0 +1,168 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements stack fingerprints (and
+// Backtracie.caller_fingerprint); see the "Fingerprint API" section of
+// public/backtracie.h for what they are.
+//
+// A fingerprint is the FNV-1a hash of the hashes of each frame's qualified
+// method name, path and (optionally) line number, in order. Name hashes are
+// kept in the name cache, next to the names themselves, and path hashes in a
+// direct-mapped cache of their own, so for frames seen before, computing a
+// fingerprint only takes a few cache lookups per frame.
+
+#include "extconf.h"
+
+#include <limits.h>
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+// As with the line number cache in backtracie_frames.c, the cache does not
+// keep the paths alive; see backtracie_gc_epoch_t.
+#define PATH_HASH_CACHE_SIZE 1024 // Must be a power of two
+
+typedef struct {
+  VALUE path;
+  backtracie_gc_epoch_t gc_epoch;
+  uint64_t hash;
+} path_hash_cache_entry_t;
+
+static path_hash_cache_entry_t path_hash_cache[PATH_HASH_CACHE_SIZE];
+// See capture_frames in backtracie.c
+static VALUE scratch_frame_wrapper = Qnil;
+
+static uint64_t add_frame(uint64_t fingerprint, const minimal_location_t *loc,
+                          bool include_line_numbers);
+static uint64_t path_hash(VALUE path);
+static uint64_t fnv1a_u64(uint64_t hash, uint64_t value);
+static VALUE primitive_caller_fingerprint(VALUE self, VALUE skip, VALUE depth,
+                                          VALUE include_line_numbers);
+
+void backtracie_fingerprint_init(VALUE backtracie_module) {
+  scratch_frame_wrapper = backtracie_frame_wrapper_new(0);
+  rb_global_variable(&scratch_frame_wrapper);
+
+  VALUE backtracie_primitive_module =
+      rb_define_module_under(backtracie_module, "Primitive");
+  rb_define_module_function(backtracie_primitive_module, "caller_fingerprint",
+                            primitive_caller_fingerprint, 3);
+}
+
+uint64_t backtracie_frames_fingerprint(const raw_location *frames,
+                                       int frames_len,
+                                       bool include_line_numbers) {
+  uint64_t fingerprint = BACKTRACIE_FNV1A_OFFSET_BASIS;
+  for (int i = 0; i < frames_len; i++) {
+    minimal_location_t loc;
+    backtracie_raw_location_to_minimal_location(&frames[i], &loc);
+    fingerprint = add_frame(fingerprint, &loc, include_line_numbers);
+  }
+  return fingerprint;
+}
+
+uint64_t backtracie_minimal_frames_fingerprint(const minimal_location_t *frames,
+                                               int frames_len,
+                                               bool include_line_numbers) {
+  uint64_t fingerprint = BACKTRACIE_FNV1A_OFFSET_BASIS;
+  for (int i = 0; i < frames_len; i++) {
+    fingerprint = add_frame(fingerprint, &frames[i], include_line_numbers);
+  }
+  return fingerprint;
+}
+
+static uint64_t add_frame(uint64_t fingerprint, const minimal_location_t *loc,
+                          bool include_line_numbers) {
+  fingerprint =
+      fnv1a_u64(fingerprint, backtracie_name_cache_lookup_hash(loc));
+  fingerprint = fnv1a_u64(fingerprint, path_hash(loc->filename));
+  if (include_line_numbers) {
+    fingerprint = fnv1a_u64(fingerprint, loc->line_number);
+  }
+  return fingerprint;
+}
+
+// Returns the FNV-1a hash of the given path String; cfuncs have no path, and
+// get the hash of the empty string
+static uint64_t path_hash(VALUE path) {
+  if (!RTEST(path)) {
+    return BACKTRACIE_FNV1A_OFFSET_BASIS;
+  }
+
+  path_hash_cache_entry_t *entry =
+      &path_hash_cache[(path >> 3) & (PATH_HASH_CACHE_SIZE - 1)];
+  if (entry->path == path && backtracie_gc_epoch_is_current(&entry->gc_epoch)) {
+    return entry->hash;
+  }
+
+  entry->path = path;
+  backtracie_gc_epoch_for(path, &entry->gc_epoch);
+  entry->hash = backtracie_fnv1a(BACKTRACIE_FNV1A_OFFSET_BASIS,
+                                 RSTRING_PTR(path), RSTRING_LEN(path));
+  return entry->hash;
+}
+
+static uint64_t fnv1a_u64(uint64_t hash, uint64_t value) {
+  // Least significant byte first, so that fingerprints don't depend on the
+  // machine's endianness
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (unsigned char)(value >> (8 * i));
+  }
+  return backtracie_fnv1a(hash, bytes, sizeof(bytes));
+}
+
+static VALUE primitive_caller_fingerprint(VALUE self, VALUE skip, VALUE depth,
+                                          VALUE include_line_numbers) {
+  // Ignore:
+  // * the current stack frame (native)
+  // * the Backtracie.caller_fingerprint that called us
+  // * the caller of Backtracie.caller_fingerprint, as with caller_location
+  // * the first skip frames from there on
+  int frames_to_skip = NUM2INT(skip);
+  if (frames_to_skip < 0) {
+    rb_raise(rb_eArgError, "negative skip (%d)", frames_to_skip);
+  }
+  int max_frames = INT_MAX;
+  if (!NIL_P(depth)) {
+    max_frames = NUM2INT(depth);
+    if (max_frames < 0) {
+      rb_raise(rb_eArgError, "negative depth (%d)", max_frames);
+    }
+  }
+
+  VALUE thread = rb_thread_current();
+  int raw_frame_count = backtracie_frame_count_for_thread(thread);
+  if (max_frames > raw_frame_count) {
+    max_frames = raw_frame_count;
+  }
+  backtracie_frame_wrapper_reserve(scratch_frame_wrapper, max_frames);
+  raw_location *frames = backtracie_frame_wrapper_frames(scratch_frame_wrapper);
+  int *frames_len = backtracie_frame_wrapper_len(scratch_frame_wrapper);
+  backtracie_capture_frames_for_thread(thread, 3 + frames_to_skip, max_frames,
+                                       frames, frames_len);
+
+  uint64_t fingerprint = backtracie_frames_fingerprint(
+      frames, *frames_len, RTEST(include_line_numbers));
+
+  backtracie_frame_wrapper_clear(scratch_frame_wrapper);
+  return ULL2NUM(fingerprint);
+}
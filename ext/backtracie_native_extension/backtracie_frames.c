@@ -123,6 +123,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef PRE_MJIT_RUBY
 // The order of includes here is very important in older versions of Ruby
@@ -152,6 +153,11 @@
 #define rb_execution_context_t rb_thread_t
 #endif
 
+#ifndef ccan_list_for_each
+// The ccan list macros got prefixed on Ruby 3.2
+#define ccan_list_for_each list_for_each
+#endif
+
 #ifdef PRE_VM_ENV_RENAMES
 #define VM_ENV_LOCAL_P VM_EP_LEP_P
 #define VM_ENV_PREV_EP VM_EP_PREV_EP
@@ -162,23 +168,36 @@
 // This is managed in backtracie.c
 extern VALUE backtracie_main_object_instance;
 extern VALUE backtracie_frame_wrapper_class;
-static void raw_location_to_minimal_location(const raw_location *raw_loc,
-                                             minimal_location_t *min_loc);
-static void mod_to_s_anon(VALUE klass, strbuilder_t *strout);
-static void mod_to_s_refinement(VALUE klass, strbuilder_t *strout);
-static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout);
-static void mod_to_s(VALUE klass, strbuilder_t *strout);
-static void minimal_location_method_qualifier(const minimal_location_t *loc,
-                                              strbuilder_t *strout);
+extern VALUE backtracie_minimal_frame_wrapper_class;
+static void mod_to_s_anon(VALUE klass, strbuilder_t *strout,
+                          backtracie_anonymous_modules_t *anonymous_modules);
+static void
+mod_to_s_refinement(VALUE klass, strbuilder_t *strout,
+                    backtracie_anonymous_modules_t *anonymous_modules);
+static void
+mod_to_s_singleton(VALUE klass, strbuilder_t *strout,
+                   backtracie_anonymous_modules_t *anonymous_modules);
+static void mod_to_s(VALUE klass, strbuilder_t *strout,
+                     backtracie_anonymous_modules_t *anonymous_modules);
+static VALUE singleton_class_attached_object(VALUE klass);
+static void
+record_anonymous_module(backtracie_anonymous_modules_t *anonymous_modules);
+static void minimal_location_method_qualifier(
+    const minimal_location_t *loc, strbuilder_t *strout,
+    backtracie_anonymous_modules_t *anonymous_modules);
 static void minimal_location_method_name(const minimal_location_t *loc,
                                          strbuilder_t *strout);
 static bool frame_filename(const raw_location *loc, bool absolute,
                            strbuilder_t *strout);
 static bool iseq_path(const rb_iseq_t *iseq, bool absolute,
                       strbuilder_t *strout);
+static VALUE iseq_path_value(const rb_iseq_t *iseq, bool absolute);
 static int frame_label(const raw_location *loc, bool base,
                        strbuilder_t *strout);
+static VALUE frame_label_value(const raw_location *loc, bool base);
 static int calc_lineno(const rb_iseq_t *iseq, const void *pc);
+static int cached_calc_lineno(const rb_iseq_t *iseq, const void *pc);
+static size_t major_gc_count(void);
 static const rb_callable_method_entry_t *
 backtracie_vm_frame_method_entry(const rb_control_frame_t *cfp);
 
@@ -208,6 +227,56 @@ typedef struct {
   int len;
 } frame_wrapper_t;
 
+static void backtracie_minimal_frame_wrapper_mark(void *ptr);
+static void backtracie_minimal_frame_wrapper_compact(void *ptr);
+static void backtracie_minimal_frame_wrapper_free(void *ptr);
+static size_t backtracie_minimal_frame_wrapper_memsize(const void *ptr);
+static const rb_data_type_t backtracie_minimal_frame_wrapper_type = {
+    .wrap_struct_name = "backtracie_minimal_frame_wrapper",
+    .function = {.dmark = backtracie_minimal_frame_wrapper_mark,
+                 .dfree = backtracie_minimal_frame_wrapper_free,
+                 .dsize = backtracie_minimal_frame_wrapper_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = backtracie_minimal_frame_wrapper_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+typedef struct {
+  minimal_location_t *frames;
+  size_t capa;
+  int len;
+} minimal_frame_wrapper_t;
+
+// Computing a line number needs a binary search over the iseq's instruction
+// info table. When sampling a program in a steady state, the same few hundred
+// (iseq, pc) pairs account for almost all the frames, so we keep a small
+// direct-mapped cache of their line numbers.
+//
+// The cache does not keep the iseqs alive, so an entry is only trusted for as
+// long as its iseq can't have been freed (or moved) and its address reused;
+// see backtracie_gc_epoch_t.
+#define LINE_NUMBER_CACHE_SIZE 1024 // Must be a power of two
+
+typedef struct {
+  const rb_iseq_t *iseq;
+  const void *pc;
+  backtracie_gc_epoch_t gc_epoch;
+  int line_number;
+} line_number_cache_entry_t;
+
+static line_number_cache_entry_t line_number_cache[LINE_NUMBER_CACHE_SIZE];
+static uint64_t line_number_cache_hits = 0;
+static uint64_t line_number_cache_misses = 0;
+
+// The major GC count, as of the last time it was read (see major_gc_count)
+static VALUE major_gc_count_key = Qnil;
+static size_t last_gc_count = SIZE_MAX;
+static size_t last_major_gc_count = 0;
+
 static bool object_has_special_bt_handling(VALUE obj) {
   return obj == backtracie_main_object_instance || obj == rb_mRubyVMFrozenCore;
 }
@@ -246,6 +315,99 @@ bool backtracie_is_thread_alive(VALUE thread) {
   return !(thread_pointer->to_kill || thread_pointer->status == THREAD_KILLED);
 }
 
+void backtracie_interrupt_running_thread_for_postponed_jobs(void) {
+#ifndef PRE_RACTOR
+  // rb_postponed_job_register_one only flags the execution context of the
+  // calling thread, which is not useful when called from a thread that is not
+  // running Ruby code. Flag whichever one is holding the GVL instead, in the
+  // same way that rb_postponed_job_register_one did before Ruby 3.0 (where the
+  // current execution context was a global).
+  rb_execution_context_t *ec =
+      *(rb_execution_context_t * volatile *)&GET_VM()
+           ->ractor.main_ractor->threads.running_ec;
+  if (ec != NULL) {
+    RUBY_VM_SET_POSTPONED_JOB_INTERRUPT(ec);
+  }
+#endif
+}
+
+#ifndef PRE_THREAD_EVENT_HOOKS
+VALUE backtracie_current_thread_without_gvl(void) {
+  // Native threads are reused, and a thread that is starting up gets the GVL
+  // before its execution context gets set, so the current execution context
+  // may be left over from a thread that is long gone. Thus, don't touch it
+  // unless it's the one of the thread holding the GVL (which is alive), and
+  // that thread has already set up its stack.
+  const rb_execution_context_t *ec = rb_current_execution_context(false);
+  const rb_thread_t *running_thread =
+      GET_VM()->ractor.main_ractor->threads.sched.running;
+  if (ec == NULL || running_thread == NULL || running_thread->ec != ec ||
+      ec->vm_stack == NULL || ec->cfp == NULL) {
+    return Qnil;
+  }
+  return running_thread->self;
+}
+#endif
+
+void backtracie_each_thread(void (*function)(VALUE thread, void *data),
+                            void *data) {
+  rb_thread_t *thread_pointer = NULL;
+  // This is the list Thread.list is built from; unlike Thread.list, walking it
+  // doesn't allocate, and so is safe to do from a postponed job or while
+  // capturing frames for all threads.
+#ifndef PRE_RACTOR
+  ccan_list_for_each(&GET_VM()->ractor.main_ractor->threads.set,
+                     thread_pointer, lt_node) {
+#else
+  ccan_list_for_each(&GET_VM()->living_threads, thread_pointer, vmlt_node) {
+#endif
+    if (backtracie_is_thread_alive(thread_pointer->self)) {
+      function(thread_pointer->self, data);
+    }
+  }
+}
+
+typedef struct {
+  VALUE frame_wrapper;
+  backtracie_thread_stack_t *out;
+  int capa;
+  int thread_count;
+} capture_all_threads_state_t;
+
+static void capture_thread_into_wrapper(VALUE thread, void *data) {
+  capture_all_threads_state_t *state = (capture_all_threads_state_t *)data;
+  int thread_index = state->thread_count++;
+  if (thread_index >= state->capa) {
+    return;
+  }
+
+  int *len = backtracie_frame_wrapper_len(state->frame_wrapper);
+  int frame_count = backtracie_frame_count_for_thread(thread);
+  // May trigger a GC, which is fine: the frames captured so far are already
+  // part of the wrapper, and threads don't go away without the GVL being
+  // released.
+  backtracie_frame_wrapper_reserve(state->frame_wrapper, *len + frame_count);
+
+  backtracie_thread_stack_t *stack = &state->out[thread_index];
+  stack->thread = thread;
+  stack->frames_start = *len;
+  backtracie_capture_frames_for_thread(
+      thread, 0, frame_count,
+      backtracie_frame_wrapper_frames(state->frame_wrapper) + *len,
+      &stack->frames_len);
+  *len += stack->frames_len;
+}
+
+int backtracie_capture_all_threads(VALUE frame_wrapper,
+                                   backtracie_thread_stack_t *out, int capa) {
+  capture_all_threads_state_t state = {.frame_wrapper = frame_wrapper,
+                                       .out = out,
+                                       .capa = capa,
+                                       .thread_count = 0};
+  backtracie_each_thread(capture_thread_into_wrapper, &state);
+  return state.thread_count;
+}
+
 void backtracie_frame_mark(const raw_location *loc) {
   rb_gc_mark(loc->iseq);
   rb_gc_mark(loc->callable_method_entry);
@@ -270,6 +432,39 @@ void backtracie_frame_compact(raw_location *loc) {
 #endif
 }
 
+// Unlike raw_locations, minimal locations don't reference the iseq or cme, so
+// these only deal with the handful of objects needed to render them. Note that
+// all members of the method_qualifier union are VALUEs.
+void backtracie_minimal_frame_mark(const minimal_location_t *loc) {
+  rb_gc_mark(loc->filename);
+  rb_gc_mark(loc->method_qualifier.self);
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    rb_gc_mark(loc->method_name.base_label);
+  }
+}
+
+void backtracie_minimal_frame_mark_movable(const minimal_location_t *loc) {
+#ifdef PRE_GC_MARK_MOVABLE
+  backtracie_minimal_frame_mark(loc);
+#else
+  rb_gc_mark_movable(loc->filename);
+  rb_gc_mark_movable(loc->method_qualifier.self);
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    rb_gc_mark_movable(loc->method_name.base_label);
+  }
+#endif
+}
+
+void backtracie_minimal_frame_compact(minimal_location_t *loc) {
+#ifndef PRE_GC_MARK_MOVABLE
+  loc->filename = rb_gc_location(loc->filename);
+  loc->method_qualifier.self = rb_gc_location(loc->method_qualifier.self);
+  if (loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL) {
+    loc->method_name.base_label = rb_gc_location(loc->method_name.base_label);
+  }
+#endif
+}
+
 static int
 backtracie_frame_count_for_execution_context(rb_execution_context_t *ec) {
   const rb_control_frame_t *last_cfp = ec->cfp;
@@ -299,6 +494,32 @@ int backtracie_frame_count_for_thread(VALUE thread) {
 #endif
 }
 
+// Work out validity, or otherwise, of the given frame.
+// This expression is derived from what backtrace_each in vm_backtrace.c does.
+static bool is_valid_frame(const rb_control_frame_t *cfp,
+                           const rb_callable_method_entry_t *cme) {
+  return (!(cfp->iseq && !cfp->pc) &&
+          (VM_FRAME_RUBYFRAME_P(cfp) ||
+           (cme && cme->def->type == VM_METHOD_TYPE_CFUNC)));
+}
+
+static void fill_raw_location(const rb_control_frame_t *cfp,
+                              const rb_callable_method_entry_t *cme,
+                              raw_location *loc) {
+  loc->is_ruby_frame = VM_FRAME_RUBYFRAME_P(cfp);
+  loc->iseq = (VALUE)cfp->iseq;
+  loc->callable_method_entry = (VALUE)cme;
+  if (object_has_special_bt_handling(cfp->self) ||
+      class_or_module_or_iclass(cfp->self)) {
+    loc->self_or_self_class = cfp->self;
+    loc->self_is_real_self = 1;
+  } else {
+    loc->self_or_self_class = rb_class_of(cfp->self);
+    loc->self_is_real_self = 0;
+  }
+  loc->pc = cfp->pc;
+}
+
 static bool backtracie_capture_frame_for_execution_context(
     rb_execution_context_t *ec, int frame_index, raw_location *loc) {
   // The frame argument is zero-based with zero being "the frame closest to
@@ -316,29 +537,12 @@ static bool backtracie_capture_frame_for_execution_context(
   }
 
   const rb_callable_method_entry_t *cme = backtracie_vm_frame_method_entry(cfp);
-
-  // Work out validity, or otherwise, of this frame.
-  // This expression is derived from what backtrace_each in vm_backtrace.c does.
-  bool is_valid = (!(cfp->iseq && !cfp->pc) &&
-                   (VM_FRAME_RUBYFRAME_P(cfp) ||
-                    (cme && cme->def->type == VM_METHOD_TYPE_CFUNC)));
-  if (!is_valid) {
+  if (!is_valid_frame(cfp, cme)) {
     // Don't include this frame in backtraces
     return false;
   }
 
-  loc->is_ruby_frame = VM_FRAME_RUBYFRAME_P(cfp);
-  loc->iseq = (VALUE)cfp->iseq;
-  loc->callable_method_entry = (VALUE)cme;
-  if (object_has_special_bt_handling(cfp->self) ||
-      class_or_module_or_iclass(cfp->self)) {
-    loc->self_or_self_class = cfp->self;
-    loc->self_is_real_self = 1;
-  } else {
-    loc->self_or_self_class = rb_class_of(cfp->self);
-    loc->self_is_real_self = 0;
-  }
-  loc->pc = cfp->pc;
+  fill_raw_location(cfp, cme, loc);
   return true;
 }
 
@@ -358,35 +562,306 @@ bool backtracie_capture_frame_for_thread(VALUE thread, int frame_index,
 #endif
 }
 
+// Walks the stack of the given execution context once, from the most recently
+// called frame downwards, skipping over invalid frames. The first start valid
+// frames are skipped, and then at most max valid frames are written to out.
+// Returns the number of frames written.
+static int backtracie_capture_frames_for_execution_context(
+    rb_execution_context_t *ec, int start, int max, raw_location *out) {
+  if (ec->cfp == NULL) {
+    // See backtracie_frame_count_for_execution_context
+    return 0;
+  }
+
+  // -1 because of the two "dummy" frames at the bottom of the stack; see
+  // backtracie_capture_frame_for_execution_context.
+  const rb_control_frame_t *end_cfp = RUBY_VM_END_CONTROL_FRAME(ec) - 1;
+  int valid_frames_seen = 0;
+  int len = 0;
+  for (const rb_control_frame_t *cfp = ec->cfp;
+       len < max && RUBY_VM_VALID_CONTROL_FRAME_P(cfp, end_cfp);
+       cfp = RUBY_VM_PREVIOUS_CONTROL_FRAME(cfp)) {
+    const rb_callable_method_entry_t *cme =
+        backtracie_vm_frame_method_entry(cfp);
+    if (!is_valid_frame(cfp, cme)) {
+      continue;
+    }
+    if (valid_frames_seen++ < start) {
+      continue;
+    }
+    fill_raw_location(cfp, cme, &out[len++]);
+  }
+  return len;
+}
+
+bool backtracie_capture_frames_for_thread(VALUE thread, int start, int max,
+                                          raw_location *out, int *out_len) {
+  *out_len = 0;
+  if (!backtracie_is_thread_alive(thread)) {
+    return false;
+  }
+  rb_thread_t *thread_pointer = (rb_thread_t *)DATA_PTR(thread);
+
+#ifndef PRE_EXECUTION_CONTEXT
+  *out_len = backtracie_capture_frames_for_execution_context(
+      thread_pointer->ec, start, max, out);
+#else
+  *out_len = backtracie_capture_frames_for_execution_context(thread_pointer,
+                                                             start, max, out);
+#endif
+  return true;
+}
+
+#ifndef PRE_EXECUTION_CONTEXT
+// The rb_fiber_t struct is private to cont.c, so we can't get at a fiber's
+// execution context directly. What we do know is that it's embedded in the
+// rb_fiber_t, and that every execution context points back at its fiber; so we
+// get the offset of the execution context inside the fiber by looking at the
+// current one, and then double-check every fiber we look at against it.
+static const rb_data_type_t *fiber_data_type = NULL;
+static ptrdiff_t fiber_execution_context_offset = 0;
+
+static void fiber_layout_init(void) {
+  if (fiber_data_type != NULL) {
+    return;
+  }
+  // This may allocate the Fiber for the thread's root fiber, but only the
+  // first time around
+  VALUE current_fiber = rb_fiber_current();
+  rb_execution_context_t *ec =
+      ((rb_thread_t *)DATA_PTR(rb_thread_current()))->ec;
+  BACKTRACIE_ASSERT(DATA_PTR(current_fiber) == (void *)ec->fiber_ptr);
+
+  fiber_execution_context_offset = (char *)ec - (char *)ec->fiber_ptr;
+  fiber_data_type = RTYPEDDATA_TYPE(current_fiber);
+}
+
+static bool is_fiber(VALUE object) {
+  return RB_TYPE_P(object, T_DATA) && RTYPEDDATA_P(object) &&
+         RTYPEDDATA_TYPE(object) == fiber_data_type;
+}
+
+// Returns the execution context of the given fiber, or NULL if the fiber
+// hasn't started yet, or has already finished (and thus has no stack)
+static rb_execution_context_t *fiber_execution_context(VALUE fiber) {
+  void *fiber_pointer = DATA_PTR(fiber);
+  if (fiber_pointer == NULL) {
+    return NULL;
+  }
+  rb_execution_context_t *ec =
+      (rb_execution_context_t *)((char *)fiber_pointer +
+                                 fiber_execution_context_offset);
+  if ((void *)ec->fiber_ptr != fiber_pointer || ec->vm_stack == NULL ||
+      ec->cfp == NULL) {
+    return NULL;
+  }
+  return ec;
+}
+
+static rb_execution_context_t *checked_fiber_execution_context(VALUE fiber) {
+  fiber_layout_init();
+  if (!is_fiber(fiber)) {
+    rb_raise(rb_eArgError, "Expected to receive instance of Fiber");
+  }
+  return fiber_execution_context(fiber);
+}
+#endif
+
+int backtracie_frame_count_for_fiber(VALUE fiber) {
+#ifndef PRE_EXECUTION_CONTEXT
+  rb_execution_context_t *ec = checked_fiber_execution_context(fiber);
+  return ec == NULL ? 0 : backtracie_frame_count_for_execution_context(ec);
+#else
+  return 0;
+#endif
+}
+
+bool backtracie_capture_frames_for_fiber(VALUE fiber, int start, int max,
+                                         raw_location *out, int *out_len) {
+  *out_len = 0;
+#ifndef PRE_EXECUTION_CONTEXT
+  rb_execution_context_t *ec = checked_fiber_execution_context(fiber);
+  if (ec == NULL) {
+    return false;
+  }
+  *out_len =
+      backtracie_capture_frames_for_execution_context(ec, start, max, out);
+  return true;
+#else
+  return false;
+#endif
+}
+
+#ifndef PRE_EXECUTION_CONTEXT
+typedef struct {
+  rb_thread_t *thread_pointer;
+  VALUE frame_wrapper;
+  backtracie_fiber_stack_t **out;
+  int *capa;
+  int fiber_count;
+} capture_all_fibers_state_t;
+
+static void capture_fiber_into_wrapper(capture_all_fibers_state_t *state,
+                                       VALUE fiber) {
+  rb_execution_context_t *ec = fiber_execution_context(fiber);
+  if (ec == NULL || ec->thread_ptr != state->thread_pointer) {
+    return;
+  }
+  int fiber_index = state->fiber_count++;
+  if (fiber_index >= *state->capa) {
+    int new_capa = *state->capa < 8 ? 8 : *state->capa * 2;
+    *state->out =
+        xrealloc2(*state->out, new_capa, sizeof(backtracie_fiber_stack_t));
+    *state->capa = new_capa;
+  }
+
+  int *len = backtracie_frame_wrapper_len(state->frame_wrapper);
+  int frame_count = backtracie_frame_count_for_execution_context(ec);
+  backtracie_frame_wrapper_reserve(state->frame_wrapper, *len + frame_count);
+
+  backtracie_fiber_stack_t *stack = &(*state->out)[fiber_index];
+  stack->fiber = fiber;
+  stack->frames_start = *len;
+  stack->frames_len = backtracie_capture_frames_for_execution_context(
+      ec, 0, frame_count,
+      backtracie_frame_wrapper_frames(state->frame_wrapper) + *len);
+  *len += stack->frames_len;
+}
+
+static int capture_fibers_in_heap_page(void *page_start, void *page_end,
+                                       size_t stride, void *data) {
+  for (VALUE object = (VALUE)page_start; object != (VALUE)page_end;
+       object += stride) {
+    if (RBASIC(object)->flags != 0 && is_fiber(object)) {
+      capture_fiber_into_wrapper((capture_all_fibers_state_t *)data, object);
+    }
+  }
+  return 0;
+}
+
+static VALUE capture_all_fibers(VALUE state) {
+  rb_objspace_each_objects(capture_fibers_in_heap_page, (void *)state);
+  return Qnil;
+}
+#endif
+
+int backtracie_capture_all_fibers_for_thread(VALUE thread, VALUE frame_wrapper,
+                                             backtracie_fiber_stack_t **out,
+                                             int *capa) {
+#ifndef PRE_EXECUTION_CONTEXT
+  fiber_layout_init();
+  capture_all_fibers_state_t state = {
+      .thread_pointer = (rb_thread_t *)DATA_PTR(thread),
+      .frame_wrapper = frame_wrapper,
+      .out = out,
+      .capa = capa,
+      .fiber_count = 0};
+
+  // Ruby doesn't keep track of the fibers of a thread, so we need to look for
+  // them in the heap. The GC is kept off while doing so, as otherwise growing
+  // the frame wrapper might trigger a GC that frees fibers (and the objects
+  // referenced by their frames) which we have already captured, but which
+  // nothing else references.
+  rb_ensure(capture_all_fibers, (VALUE)&state, backtracie_restore_gc,
+            rb_gc_disable());
+  return state.fiber_count;
+#else
+  return 0;
+#endif
+}
+
+// Returns true if the absolute path of the given Ruby frame starts with any of
+// the given prefixes (an Array of Strings)
+static bool frame_path_excluded(const raw_location *loc,
+                                VALUE excluded_path_prefixes) {
+  VALUE path = iseq_path_value((const rb_iseq_t *)loc->iseq, true);
+  if (!RTEST(path)) {
+    return false;
+  }
+
+  long path_len = RSTRING_LEN(path);
+  for (long i = 0; i < RARRAY_LEN(excluded_path_prefixes); i++) {
+    VALUE prefix = RARRAY_AREF(excluded_path_prefixes, i);
+    long prefix_len = RSTRING_LEN(prefix);
+    if (prefix_len <= path_len &&
+        memcmp(RSTRING_PTR(path), RSTRING_PTR(prefix), prefix_len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int backtracie_find_caller_frame(VALUE thread, int start,
+                                 VALUE excluded_path_prefixes,
+                                 raw_location frames[2]) {
+  if (!backtracie_is_thread_alive(thread)) {
+    return 0;
+  }
+  rb_thread_t *thread_pointer = (rb_thread_t *)DATA_PTR(thread);
+#ifndef PRE_EXECUTION_CONTEXT
+  rb_execution_context_t *ec = thread_pointer->ec;
+#else
+  rb_execution_context_t *ec = thread_pointer;
+#endif
+
+  int frame_count = backtracie_frame_count_for_thread(thread);
+  int valid_frames_seen = 0;
+  int found = 0;
+  for (int i = 0; i < frame_count; i++) {
+    raw_location *loc = &frames[found];
+    if (!backtracie_capture_frame_for_execution_context(ec, i, loc)) {
+      continue;
+    }
+    if (valid_frames_seen++ < start) {
+      continue;
+    }
+
+    if (found == 1) {
+      // Looking for the Ruby frame that the cfunc in frames[0] takes its path
+      // and line number from
+      if (loc->is_ruby_frame) {
+        return 2;
+      }
+      continue;
+    }
+
+    if (NIL_P(excluded_path_prefixes)) {
+      found = 1;
+      if (loc->is_ruby_frame) {
+        return 1;
+      }
+    } else if (loc->is_ruby_frame &&
+               !frame_path_excluded(loc, excluded_path_prefixes)) {
+      return 1;
+    }
+  }
+  return found;
+}
+
 int backtracie_frame_line_number(const raw_location *loc) {
-  return calc_lineno((rb_iseq_t *)loc->iseq, loc->pc);
+  return cached_calc_lineno((rb_iseq_t *)loc->iseq, loc->pc);
 }
 
 size_t backtracie_frame_name_cstr(const raw_location *loc, char *buf,
                                   size_t buflen) {
-  strbuilder_t builder;
-  strbuilder_init(&builder, buf, buflen);
-
   minimal_location_t min_loc;
-  raw_location_to_minimal_location(loc, &min_loc);
-  minimal_location_method_qualifier(&min_loc, &builder);
-  minimal_location_method_name(&min_loc, &builder);
-
-  return builder.attempted_size;
+  backtracie_raw_location_to_minimal_location(loc, &min_loc);
+  return backtracie_minimal_frame_name_cstr(&min_loc, buf, buflen);
 }
 
 VALUE backtracie_frame_name_rbstr(const raw_location *loc) {
-  strbuilder_t builder;
-  strbuilder_init_growable(&builder, 256);
-
   minimal_location_t min_loc;
-  raw_location_to_minimal_location(loc, &min_loc);
-  minimal_location_method_qualifier(&min_loc, &builder);
-  minimal_location_method_name(&min_loc, &builder);
+  backtracie_raw_location_to_minimal_location(loc, &min_loc);
 
-  VALUE ret = strbuilder_to_value(&builder);
-  strbuilder_free_growable(&builder);
-  return ret;
+  size_t name_len;
+  const char *name = backtracie_name_cache_lookup(&min_loc, &name_len);
+  return rb_str_new(name, name_len);
+}
+
+VALUE backtracie_frame_name_value(const raw_location *loc) {
+  minimal_location_t min_loc;
+  backtracie_raw_location_to_minimal_location(loc, &min_loc);
+  return backtracie_name_cache_lookup_value(&min_loc);
 }
 
 size_t backtracie_frame_filename_cstr(const raw_location *loc, bool absolute,
@@ -400,8 +875,10 @@ size_t backtracie_frame_filename_cstr(const raw_location *loc, bool absolute,
 }
 
 VALUE backtracie_frame_filename_rbstr(const raw_location *loc, bool absolute) {
+  // Most paths fit on the stack, and then only get copied once, into the String
+  char buf[256];
   strbuilder_t builder;
-  strbuilder_init_growable(&builder, 256);
+  strbuilder_init_spill(&builder, buf, sizeof(buf));
 
   bool fname_found = frame_filename(loc, absolute, &builder);
 
@@ -413,6 +890,11 @@ VALUE backtracie_frame_filename_rbstr(const raw_location *loc, bool absolute) {
   return ret;
 }
 
+VALUE backtracie_frame_filename_value(const raw_location *loc, bool absolute) {
+  VALUE path = iseq_path_value((const rb_iseq_t *)loc->iseq, absolute);
+  return RTEST(path) ? backtracie_frozen_str(path) : Qnil;
+}
+
 static bool frame_filename(const raw_location *loc, bool absolute,
                            strbuilder_t *strout) {
   return iseq_path((const rb_iseq_t *)loc->iseq, absolute, strout);
@@ -429,8 +911,9 @@ size_t backtracie_frame_label_cstr(const raw_location *loc, bool base,
 }
 
 VALUE backtracie_frame_label_rbstr(const raw_location *loc, bool base) {
+  char buf[256];
   strbuilder_t builder;
-  strbuilder_init_growable(&builder, 256);
+  strbuilder_init_spill(&builder, buf, sizeof(buf));
 
   int label_found = frame_label(loc, base, &builder);
 
@@ -442,6 +925,11 @@ VALUE backtracie_frame_label_rbstr(const raw_location *loc, bool base) {
   return ret;
 }
 
+VALUE backtracie_frame_label_value(const raw_location *loc, bool base) {
+  VALUE label = frame_label_value(loc, base);
+  return RTEST(label) ? backtracie_frozen_str(label) : Qnil;
+}
+
 VALUE backtracie_frame_for_rb_profile(const raw_location *loc) {
   const rb_iseq_t *iseq = NULL;
   const rb_callable_method_entry_t *cme = NULL;
@@ -471,28 +959,40 @@ VALUE backtracie_frame_for_rb_profile(const raw_location *loc) {
 
 static int frame_label(const raw_location *loc, bool base,
                        strbuilder_t *strout) {
+  VALUE label = frame_label_value(loc, base);
+  if (!RTEST(label)) {
+    return 0;
+  }
+  strbuilder_append_value(strout, label);
+  return 1;
+}
+
+// Returns the label String kept by the iseq (or the method's name, for
+// cfuncs), or Qnil if there's none
+static VALUE frame_label_value(const raw_location *loc, bool base) {
   if (loc->is_ruby_frame) {
     // Replicate what rb_profile_frames would do
     if (!RTEST(loc->iseq)) {
-      return 0;
+      return Qnil;
     }
     rb_iseq_t *iseq = (rb_iseq_t *)loc->iseq;
-    VALUE label =
-        base ? iseq->body->location.base_label : iseq->body->location.label;
-    strbuilder_append_value(strout, label);
+    return base ? iseq->body->location.base_label : iseq->body->location.label;
   } else {
     if (!RTEST(loc->callable_method_entry)) {
-      return 0;
+      return Qnil;
     }
     rb_callable_method_entry_t *cme =
         (rb_callable_method_entry_t *)loc->callable_method_entry;
-    strbuilder_append_value(strout, rb_id2str(cme->def->original_id));
+    return rb_id2str(cme->def->original_id);
   }
-  return 1;
 }
 
-static void raw_location_to_minimal_location(const raw_location *raw_loc,
-                                             minimal_location_t *min_loc) {
+void backtracie_raw_location_to_minimal_location(const raw_location *raw_loc,
+                                                 minimal_location_t *min_loc) {
+  // Zero everything (including padding and unused union bytes), so that two
+  // minimal locations for the same frame can be compared field by field
+  memset(min_loc, 0, sizeof(minimal_location_t));
+  min_loc->filename = Qnil;
 
   min_loc->is_ruby_frame = raw_loc->is_ruby_frame;
   if (RTEST(raw_loc->callable_method_entry)) {
@@ -512,7 +1012,11 @@ static void raw_location_to_minimal_location(const raw_location *raw_loc,
   if (RTEST(raw_loc->iseq)) {
     min_loc->has_iseq_type = 1;
     min_loc->iseq_type = ((rb_iseq_t *)raw_loc->iseq)->body->type;
-    min_loc->line_number = calc_lineno((rb_iseq_t *)raw_loc->iseq, raw_loc->pc);
+    min_loc->line_number =
+        cached_calc_lineno((rb_iseq_t *)raw_loc->iseq, raw_loc->pc);
+    // Keeping the path string, rather than the iseq, is what makes minimal
+    // locations cheap to hold on to
+    min_loc->filename = iseq_path_value((rb_iseq_t *)raw_loc->iseq, true);
   } else {
     min_loc->has_iseq_type = 0;
     min_loc->line_number = 0;
@@ -535,7 +1039,8 @@ static void raw_location_to_minimal_location(const raw_location *raw_loc,
   }
 }
 
-static void mod_to_s_anon(VALUE klass, strbuilder_t *strout) {
+static void mod_to_s_anon(VALUE klass, strbuilder_t *strout,
+                          backtracie_anonymous_modules_t *anonymous_modules) {
   // Anonymous module/class - print the name of the first non-anonymous super.
   // something like "#{klazz.ancestors.map(&:name).compact.first}$anonymous"
   //
@@ -563,11 +1068,16 @@ static void mod_to_s_anon(VALUE klass, strbuilder_t *strout) {
     superclass = rb_class_superclass(superclass);
     BACKTRACIE_ASSERT(RTEST(superclass));
     superclass_name = rb_mod_name(superclass);
+    if (!RTEST(superclass_name)) {
+      record_anonymous_module(anonymous_modules);
+    }
   } while (!RTEST(superclass_name));
   strbuilder_append_value(strout, superclass_name);
 }
 
-static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout) {
+static void
+mod_to_s_singleton(VALUE klass, strbuilder_t *strout,
+                   backtracie_anonymous_modules_t *anonymous_modules) {
   VALUE singleton_of = rb_class_real(klass);
   // If this is the singleton_class of a Class, or Module, we want to print
   // the _value_ of the object, and _NOT_ its class.
@@ -580,14 +1090,28 @@ static void mod_to_s_singleton(VALUE klass, strbuilder_t *strout) {
   //        we want to output "Something"
   //
   if (singleton_of == rb_cModule || singleton_of == rb_cClass) {
-    // The first case. Use the id_attached symbol to get what this is the
-    // singleton_class _of_.
-    st_lookup(RCLASS_IV_TBL(klass), id__attached__, (st_data_t *)&singleton_of);
+    // The first case.
+    singleton_of = singleton_class_attached_object(klass);
   }
-  mod_to_s(singleton_of, strout);
+  mod_to_s(singleton_of, strout, anonymous_modules);
+}
+
+// Returns what the given singleton class is the singleton_class _of_
+static VALUE singleton_class_attached_object(VALUE klass) {
+#ifdef PRE_RB_CLASS_ATTACHED_OBJECT
+  VALUE attached_object = Qnil;
+  st_lookup(RCLASS_IV_TBL(klass), id__attached__,
+            (st_data_t *)&attached_object);
+  return attached_object;
+#else
+  // Ruby 3.2 no longer stores it as an instance variable
+  return rb_class_attached_object(klass);
+#endif
 }
 
-static void mod_to_s_refinement(VALUE refinement_module, strbuilder_t *strout) {
+static void
+mod_to_s_refinement(VALUE refinement_module, strbuilder_t *strout,
+                    backtracie_anonymous_modules_t *anonymous_modules) {
   ID id_refined_class;
   CONST_ID(id_refined_class, "__refined_class__");
   VALUE refined_class = rb_attr_get(refinement_module, id_refined_class);
@@ -595,22 +1119,24 @@ static void mod_to_s_refinement(VALUE refinement_module, strbuilder_t *strout) {
   CONST_ID(id_defined_at, "__defined_at__");
   VALUE defined_at = rb_attr_get(refinement_module, id_defined_at);
 
-  mod_to_s(refined_class, strout);
-  strbuilder_append(strout, "$refinement@");
-  mod_to_s(defined_at, strout);
+  mod_to_s(refined_class, strout, anonymous_modules);
+  strbuilder_append_literal(strout, "$refinement@");
+  mod_to_s(defined_at, strout, anonymous_modules);
 }
 
-static void mod_to_s(VALUE klass, strbuilder_t *strout) {
+static void mod_to_s(VALUE klass, strbuilder_t *strout,
+                     backtracie_anonymous_modules_t *anonymous_modules) {
   if (FL_TEST(klass, FL_SINGLETON)) {
-    mod_to_s_singleton(klass, strout);
-    strbuilder_append(strout, "$singleton");
+    mod_to_s_singleton(klass, strout, anonymous_modules);
+    strbuilder_append_literal(strout, "$singleton");
     return;
   }
 
   VALUE klass_name = rb_mod_name(klass);
   if (!RTEST(rb_mod_name(klass))) {
-    mod_to_s_anon(klass, strout);
-    strbuilder_append(strout, "$anonymous");
+    record_anonymous_module(anonymous_modules);
+    mod_to_s_anon(klass, strout, anonymous_modules);
+    strbuilder_append_literal(strout, "$anonymous");
     return;
   }
 
@@ -619,17 +1145,52 @@ static void mod_to_s(VALUE klass, strbuilder_t *strout) {
   strbuilder_append_value(strout, klass_name);
 }
 
-static void minimal_location_method_qualifier(const minimal_location_t *loc,
-                                              strbuilder_t *strout) {
+bool backtracie_method_qualifier_is_permanent(VALUE method_qualifier) {
+  if (object_has_special_bt_handling(method_qualifier)) {
+    return true;
+  }
+  if (!class_or_module_or_iclass(method_qualifier)) {
+    return false;
+  }
+  VALUE klass = method_qualifier;
+  // An include class lives for as long as the class it got included into,
+  // which we don't know about; but it doesn't keep that class alive either
+  if (RB_TYPE_P(klass, T_ICLASS)) {
+    klass = RBASIC_CLASS(klass);
+  }
+  // The singleton class of an object keeps that object alive, so only the
+  // singleton classes of classes and modules (which may themselves be
+  // singleton classes) are of interest
+  while (FL_TEST(klass, FL_SINGLETON)) {
+    VALUE real_class = rb_class_real(klass);
+    if (real_class != rb_cModule && real_class != rb_cClass) {
+      return false;
+    }
+    klass = singleton_class_attached_object(klass);
+  }
+  return RTEST(rb_mod_name(klass));
+}
+
+// A rendered name only stays correct for as long as the anonymous modules that
+// were looked at while rendering it stay anonymous, so the name cache doesn't
+// keep such names around.
+static void
+record_anonymous_module(backtracie_anonymous_modules_t *anonymous_modules) {
+  anonymous_modules->count++;
+}
+
+static void minimal_location_method_qualifier(
+    const minimal_location_t *loc, strbuilder_t *strout,
+    backtracie_anonymous_modules_t *anonymous_modules) {
   // First, check if it's a special object.
   if (loc->method_qualifier_contents ==
       BACKTRACIE_METHOD_QUALIFIER_CONTENTS_SELF) {
     if (loc->method_qualifier.self == backtracie_main_object_instance) {
-      strbuilder_append(strout, "Object$<main>#");
+      strbuilder_append_literal(strout, "Object$<main>#");
       return;
     }
     if (loc->method_qualifier.self == rb_mRubyVMFrozenCore) {
-      strbuilder_append(strout, "RubyVM::FrozenCore#");
+      strbuilder_append_literal(strout, "RubyVM::FrozenCore#");
       return;
     }
   }
@@ -642,8 +1203,8 @@ static void minimal_location_method_qualifier(const minimal_location_t *loc,
     if (RTEST(class_of_defined_class) &&
         FL_TEST(class_of_defined_class, RMODULE_IS_REFINEMENT)) {
       // The method being called is defined on a refinement.
-      mod_to_s_refinement(class_of_defined_class, strout);
-      strbuilder_append(strout, "#");
+      mod_to_s_refinement(class_of_defined_class, strout, anonymous_modules);
+      strbuilder_append_literal(strout, "#");
       return;
     }
   }
@@ -654,8 +1215,8 @@ static void minimal_location_method_qualifier(const minimal_location_t *loc,
     if (class_or_module_or_iclass(loc->method_qualifier.self)) {
       // We have something like SomeModule.foo being called directly like that,
       // without an instance.
-      mod_to_s(loc->method_qualifier.self, strout);
-      strbuilder_append(strout, ".");
+      mod_to_s(loc->method_qualifier.self, strout, anonymous_modules);
+      strbuilder_append_literal(strout, ".");
       return;
     }
   }
@@ -672,11 +1233,16 @@ static void minimal_location_method_qualifier(const minimal_location_t *loc,
     break;
   case BACKTRACIE_METHOD_QUALIFIER_CONTENTS_CME_CLASS:
     method_target = loc->method_qualifier.cme_defined_class;
+    // Methods defined in a module get the module's include class as their
+    // defined class, which no longer shares its name on Ruby 3.2+
+    if (RB_TYPE_P(method_target, T_ICLASS)) {
+      method_target = RBASIC_CLASS(method_target);
+    }
     break;
   }
 
-  mod_to_s(method_target, strout);
-  strbuilder_append(strout, "#");
+  mod_to_s(method_target, strout, anonymous_modules);
+  strbuilder_append_literal(strout, "#");
 }
 
 static void minimal_location_method_name(const minimal_location_t *loc,
@@ -686,7 +1252,7 @@ static void minimal_location_method_name(const minimal_location_t *loc,
     VALUE method_name = rb_id2str(loc->method_name.cme_method_id);
     strbuilder_append_value(strout, method_name);
     if (loc->has_iseq_type && iseq_type_is_block_or_eval(loc->iseq_type)) {
-      strbuilder_append(strout, "{block}");
+      strbuilder_append_literal(strout, "{block}");
     }
   } else {
     // With no CME, we _DO NOT_ want to use iseq->base_label if we're a block,
@@ -699,16 +1265,16 @@ static void minimal_location_method_name(const minimal_location_t *loc,
       if (RB_TYPE_P(loc->method_qualifier.self, T_CLASS)) {
         // No CME, and self being a class/module, means we're executing code
         // inside a class Foo; ...; end;
-        strbuilder_append(strout, "{class exec}");
+        strbuilder_append_literal(strout, "{class exec}");
         did_write_anything = true;
       }
       if (RB_TYPE_P(loc->method_qualifier.self, T_MODULE)) {
-        strbuilder_append(strout, "{module exec}");
+        strbuilder_append_literal(strout, "{module exec}");
         did_write_anything = true;
       }
     }
     if (loc->has_iseq_type && iseq_type_is_block_or_eval(loc->iseq_type)) {
-      strbuilder_append(strout, "{block}");
+      strbuilder_append_literal(strout, "{block}");
       did_write_anything = true;
     }
     if (!did_write_anything) {
@@ -724,9 +1290,20 @@ static void minimal_location_method_name(const minimal_location_t *loc,
 // returns true if a path was found, and false otherwise
 static bool iseq_path(const rb_iseq_t *iseq, bool absolute,
                       strbuilder_t *strout) {
-  if (!iseq) {
+  VALUE path_str = iseq_path_value(iseq, absolute);
+  if (RTEST(path_str)) {
+    strbuilder_append_value(strout, path_str);
+    return 1;
+  } else {
     return 0;
   }
+}
+
+// Returns the path String for the given iseq, or Qnil if it has none
+static VALUE iseq_path_value(const rb_iseq_t *iseq, bool absolute) {
+  if (!iseq) {
+    return Qnil;
+  }
 
   VALUE path_str;
 #ifdef PRE_LOCATION_PATHOBJ
@@ -742,13 +1319,65 @@ static bool iseq_path(const rb_iseq_t *iseq, bool absolute,
     path_str = RARRAY_AREF(pathobj, path_type);
   }
 #endif
+  return path_str;
+}
 
-  if (RTEST(path_str)) {
-    strbuilder_append_value(strout, path_str);
-    return 1;
-  } else {
-    return 0;
+static int cached_calc_lineno(const rb_iseq_t *iseq, const void *pc) {
+  // Mix the pc into the index, since many hot pcs will be in the same iseq
+  uintptr_t hash = ((uintptr_t)iseq >> 3) ^ ((uintptr_t)pc >> 3);
+  hash ^= hash >> 10;
+  line_number_cache_entry_t *entry =
+      &line_number_cache[hash & (LINE_NUMBER_CACHE_SIZE - 1)];
+
+  if (entry->iseq == iseq && entry->pc == pc &&
+      backtracie_gc_epoch_is_current(&entry->gc_epoch)) {
+    line_number_cache_hits++;
+    return entry->line_number;
+  }
+
+  line_number_cache_misses++;
+  int line_number = calc_lineno(iseq, pc);
+  entry->iseq = iseq;
+  entry->pc = pc;
+  backtracie_gc_epoch_for((VALUE)iseq, &entry->gc_epoch);
+  entry->line_number = line_number;
+  return line_number;
+}
+
+void backtracie_gc_epoch_init(void) {
+  // A static Symbol, so it never needs to be marked
+  major_gc_count_key = ID2SYM(rb_intern("major_gc_count"));
+  // The first call to rb_gc_stat sets up the Symbols for all of its keys
+  major_gc_count();
+}
+
+void backtracie_gc_epoch_for(VALUE object, backtracie_gc_epoch_t *epoch) {
+  epoch->gc_count = rb_gc_count();
+  epoch->major_gc_count = major_gc_count();
+  epoch->old = RB_OBJ_PROMOTED(object);
+}
+
+bool backtracie_gc_epoch_is_current(const backtracie_gc_epoch_t *epoch) {
+  if (epoch->gc_count == rb_gc_count()) {
+    return true; // No GC at all since
   }
+  return epoch->old && epoch->major_gc_count == major_gc_count();
+}
+
+// rb_gc_stat looks the key up among all of its stats, so the major GC count
+// is only read again once there's been a GC since the last time
+static size_t major_gc_count(void) {
+  size_t gc_count = rb_gc_count();
+  if (gc_count != last_gc_count) {
+    last_major_gc_count = rb_gc_stat(major_gc_count_key);
+    last_gc_count = gc_count;
+  }
+  return last_major_gc_count;
+}
+
+void backtracie_line_number_cache_stats(uint64_t *hits, uint64_t *misses) {
+  *hits = line_number_cache_hits;
+  *misses = line_number_cache_misses;
 }
 
 /**********************************************************************
@@ -875,6 +1504,36 @@ int *backtracie_frame_wrapper_len(VALUE wrapper) {
   return &frame_data->len;
 }
 
+size_t backtracie_frame_wrapper_capa(VALUE wrapper) {
+  frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, frame_wrapper_t, &backtracie_frame_wrapper_type,
+                       frame_data);
+  return frame_data->capa;
+}
+
+void backtracie_frame_wrapper_clear(VALUE wrapper) {
+  *backtracie_frame_wrapper_len(wrapper) = 0;
+}
+
+void backtracie_frame_wrapper_reserve(VALUE wrapper, size_t capa) {
+  frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, frame_wrapper_t, &backtracie_frame_wrapper_type,
+                       frame_data);
+  if (capa <= frame_data->capa) {
+    return;
+  }
+
+  size_t new_capa = frame_data->capa * 2;
+  if (new_capa < capa) {
+    new_capa = capa;
+  }
+  frame_data->frames =
+      xrealloc2(frame_data->frames, new_capa, sizeof(raw_location));
+  memset(&frame_data->frames[frame_data->capa], 0,
+         sizeof(raw_location) * (new_capa - frame_data->capa));
+  frame_data->capa = new_capa;
+}
+
 static void backtracie_frame_wrapper_mark(void *ptr) {
   frame_wrapper_t *frame_data = (frame_wrapper_t *)ptr;
   for (int i = 0; i < frame_data->len; i++) {
@@ -896,6 +1555,53 @@ static size_t backtracie_frame_wrapper_memsize(const void *ptr) {
   return sizeof(frame_wrapper_t) + sizeof(raw_location) * frame_data->capa;
 }
 
+VALUE backtracie_minimal_frame_wrapper_new(size_t count) {
+  minimal_frame_wrapper_t *frame_data;
+  VALUE wrapper = TypedData_Make_Struct(
+      backtracie_minimal_frame_wrapper_class, minimal_frame_wrapper_t,
+      &backtracie_minimal_frame_wrapper_type, frame_data);
+  frame_data->capa = count;
+  frame_data->len = 0;
+  frame_data->frames = xcalloc(count, sizeof(minimal_location_t));
+  return wrapper;
+}
+
+minimal_location_t *backtracie_minimal_frame_wrapper_frames(VALUE wrapper) {
+  minimal_frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, minimal_frame_wrapper_t,
+                       &backtracie_minimal_frame_wrapper_type, frame_data);
+  return frame_data->frames;
+}
+int *backtracie_minimal_frame_wrapper_len(VALUE wrapper) {
+  minimal_frame_wrapper_t *frame_data;
+  TypedData_Get_Struct(wrapper, minimal_frame_wrapper_t,
+                       &backtracie_minimal_frame_wrapper_type, frame_data);
+  return &frame_data->len;
+}
+
+static void backtracie_minimal_frame_wrapper_mark(void *ptr) {
+  minimal_frame_wrapper_t *frame_data = (minimal_frame_wrapper_t *)ptr;
+  for (int i = 0; i < frame_data->len; i++) {
+    backtracie_minimal_frame_mark_movable(&frame_data->frames[i]);
+  }
+}
+static void backtracie_minimal_frame_wrapper_compact(void *ptr) {
+  minimal_frame_wrapper_t *frame_data = (minimal_frame_wrapper_t *)ptr;
+  for (int i = 0; i < frame_data->len; i++) {
+    backtracie_minimal_frame_compact(&frame_data->frames[i]);
+  }
+}
+static void backtracie_minimal_frame_wrapper_free(void *ptr) {
+  minimal_frame_wrapper_t *frame_data = (minimal_frame_wrapper_t *)ptr;
+  xfree(frame_data->frames);
+}
+static size_t backtracie_minimal_frame_wrapper_memsize(const void *ptr) {
+  const minimal_frame_wrapper_t *frame_data =
+      (const minimal_frame_wrapper_t *)ptr;
+  return sizeof(minimal_frame_wrapper_t) +
+         sizeof(minimal_location_t) * frame_data->capa;
+}
+
 bool backtracie_capture_minimal_frame_for_thread(VALUE thread, int frame_index,
                                                  minimal_location_t *loc) {
   raw_location raw_loc;
@@ -903,7 +1609,7 @@ bool backtracie_capture_minimal_frame_for_thread(VALUE thread, int frame_index,
   if (!ret) {
     return ret;
   }
-  raw_location_to_minimal_location(&raw_loc, loc);
+  backtracie_raw_location_to_minimal_location(&raw_loc, loc);
 
   return ret;
 }
@@ -913,11 +1619,19 @@ size_t backtracie_minimal_frame_name_cstr(const minimal_location_t *loc,
 
   strbuilder_t builder;
   strbuilder_init(&builder, buf, buflen);
-  minimal_location_method_qualifier(loc, &builder);
-  minimal_location_method_name(loc, &builder);
+  size_t name_len;
+  const char *name = backtracie_name_cache_lookup(loc, &name_len);
+  strbuilder_append_len(&builder, name, name_len);
   return builder.attempted_size;
 }
 
+void backtracie_minimal_frame_render_name(
+    const minimal_location_t *loc, strbuilder_t *strout,
+    backtracie_anonymous_modules_t *anonymous_modules) {
+  minimal_location_method_qualifier(loc, strout, anonymous_modules);
+  minimal_location_method_name(loc, strout);
+}
+
 size_t backtracie_minimal_frame_filename_cstr(const minimal_location_t *loc,
                                               char *buf, size_t buflen) {
 
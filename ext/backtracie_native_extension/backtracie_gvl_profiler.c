@@ -0,0 +1,476 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements Backtracie::GvlProfiler, which records how long threads
+// spend waiting for the GVL, and where they were when they started waiting, to
+// help find out which code paths cause GVL contention.
+//
+// It relies on the thread event hooks added in Ruby 3.2: the READY event gets
+// reported when a thread starts waiting for the GVL, and the RESUMED event
+// once it gets it. READY runs without the GVL, so all it does is to take note
+// of the time in a thread-local. RESUMED runs with the GVL, but from deep
+// inside the VM, so it must neither allocate nor raise: it captures the stack
+// of the thread (which hasn't run any Ruby code since it started waiting) into
+// a Backtracie::SampleRing, along with the time waited. The waits in the ring
+// then get interned into a Backtracie::StackTable in bulk, by a postponed job,
+// or whenever the results get read.
+//
+// If the ring fills up before it gets flushed, further waits are dropped (and
+// counted in dropped_count), as are waits that can't be interned when flushing,
+// as the postponed job can't raise. Only one GVL profiler can be running at
+// any given time.
+
+#include "extconf.h"
+
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <ruby/thread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+#define DEFAULT_MAX_DEPTH 128
+#define MAX_MAX_DEPTH 1024
+#define PENDING_WAITS_CAPA 256
+#define FLUSH_BATCH_SIZE 64
+
+typedef struct {
+  VALUE stack_table;
+  int max_depth;
+#ifndef PRE_THREAD_EVENT_HOOKS
+  rb_internal_thread_event_hook_t *hook;
+#endif
+
+  // Waits captured by the hook that were not yet added to the stack table,
+  // along with how long they took (in nanoseconds). Created by the first
+  // start.
+  VALUE pending_waits;
+  uint64_t dropped_count;
+
+  // Number of waits, and total time waited, for each stack id
+  uint64_t *wait_counts;
+  uint64_t *wait_times_ns;
+  uint32_t counts_capa;
+  uint64_t wait_count;
+  uint64_t wait_time_ns;
+} gvl_profiler_t;
+
+static VALUE backtracie_module = Qnil;
+static ID max_depth_id;
+
+// The GVL profiler that is currently running (if any)
+static VALUE running_gvl_profiler = Qnil;
+
+#ifndef PRE_THREAD_EVENT_HOOKS
+// When the current thread started waiting for the GVL (or zero), and which run
+// of the profiler was it for; waits that started before the profiler was last
+// started get ignored.
+static __thread uint64_t ready_at_ns;
+static __thread uint64_t ready_generation;
+static uint64_t current_generation;
+#endif
+
+static void gvl_profiler_mark(void *ptr);
+static void gvl_profiler_compact(void *ptr);
+static void gvl_profiler_free(void *ptr);
+static size_t gvl_profiler_memsize(const void *ptr);
+static const rb_data_type_t gvl_profiler_type = {
+    .wrap_struct_name = "backtracie_gvl_profiler",
+    .function = {.dmark = gvl_profiler_mark,
+                 .dfree = gvl_profiler_free,
+                 .dsize = gvl_profiler_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = gvl_profiler_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE gvl_profiler_alloc(VALUE klass);
+static gvl_profiler_t *get_gvl_profiler(VALUE self);
+static VALUE gvl_profiler_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE gvl_profiler_start(VALUE self);
+static VALUE gvl_profiler_stop(VALUE self);
+static VALUE gvl_profiler_is_running(VALUE self);
+static VALUE gvl_profiler_stack_table(VALUE self);
+static VALUE gvl_profiler_samples(VALUE self);
+static VALUE gvl_profiler_wait_times(VALUE self);
+static VALUE gvl_profiler_write_collapsed(VALUE self, VALUE output);
+static VALUE gvl_profiler_wait_count(VALUE self);
+static VALUE gvl_profiler_wait_time(VALUE self);
+static VALUE gvl_profiler_dropped_count(VALUE self);
+static VALUE counts_to_hash(const uint64_t *counts, uint32_t len);
+static uint64_t monotonic_time_ns(void);
+#ifndef PRE_THREAD_EVENT_HOOKS
+static void on_thread_event(rb_event_flag_t event,
+                            const rb_internal_thread_event_data_t *event_data,
+                            void *data);
+static void record_wait(gvl_profiler_t *profiler, uint64_t wait_ns);
+#endif
+static void flush_job(void *unused);
+static void flush_pending_waits(gvl_profiler_t *profiler);
+static bool reserve_counts(gvl_profiler_t *profiler, uint32_t stack_id);
+
+void backtracie_gvl_profiler_init(VALUE module) {
+  backtracie_module = module;
+  max_depth_id = rb_intern("max_depth");
+  rb_global_variable(&running_gvl_profiler);
+
+  VALUE gvl_profiler_class =
+      rb_define_class_under(backtracie_module, "GvlProfiler", rb_cObject);
+  rb_define_alloc_func(gvl_profiler_class, gvl_profiler_alloc);
+
+  rb_define_method(gvl_profiler_class, "initialize", gvl_profiler_initialize,
+                   -1);
+  rb_define_method(gvl_profiler_class, "start", gvl_profiler_start, 0);
+  rb_define_method(gvl_profiler_class, "stop", gvl_profiler_stop, 0);
+  rb_define_method(gvl_profiler_class, "running?", gvl_profiler_is_running, 0);
+  rb_define_method(gvl_profiler_class, "stack_table", gvl_profiler_stack_table,
+                   0);
+  rb_define_method(gvl_profiler_class, "samples", gvl_profiler_samples, 0);
+  rb_define_method(gvl_profiler_class, "wait_times", gvl_profiler_wait_times,
+                   0);
+  rb_define_method(gvl_profiler_class, "write_collapsed",
+                   gvl_profiler_write_collapsed, 1);
+  rb_define_method(gvl_profiler_class, "wait_count", gvl_profiler_wait_count,
+                   0);
+  rb_define_method(gvl_profiler_class, "wait_time", gvl_profiler_wait_time, 0);
+  rb_define_method(gvl_profiler_class, "dropped_count",
+                   gvl_profiler_dropped_count, 0);
+}
+
+static VALUE gvl_profiler_alloc(VALUE klass) {
+  gvl_profiler_t *profiler;
+  VALUE self = TypedData_Make_Struct(klass, gvl_profiler_t, &gvl_profiler_type,
+                                     profiler);
+  profiler->stack_table = Qnil;
+  profiler->pending_waits = Qnil;
+  profiler->max_depth = DEFAULT_MAX_DEPTH;
+  return self;
+}
+
+static gvl_profiler_t *get_gvl_profiler(VALUE self) {
+  gvl_profiler_t *profiler;
+  TypedData_Get_Struct(self, gvl_profiler_t, &gvl_profiler_type, profiler);
+  return profiler;
+}
+
+static VALUE gvl_profiler_initialize(int argc, VALUE *argv, VALUE self) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  VALUE options;
+  VALUE max_depth = Qundef;
+
+  rb_scan_args(argc, argv, ":", &options);
+  if (!NIL_P(options)) {
+    rb_get_kwargs(options, &max_depth_id, 0, 1, &max_depth);
+  }
+
+  if (max_depth != Qundef) {
+    int max_depth_frames = NUM2INT(max_depth);
+    if (max_depth_frames <= 0 || max_depth_frames > MAX_MAX_DEPTH) {
+      rb_raise(rb_eArgError, "max_depth must be between 1 and %d",
+               MAX_MAX_DEPTH);
+    }
+    profiler->max_depth = max_depth_frames;
+  }
+  profiler->stack_table = backtracie_stack_table_new();
+
+  return self;
+}
+
+static VALUE gvl_profiler_start(VALUE self) {
+#ifdef PRE_THREAD_EVENT_HOOKS
+  rb_raise(rb_eNotImpError,
+           "Backtracie::GvlProfiler is only supported on Ruby 3.2 and newer");
+#else
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+
+  if (running_gvl_profiler == self) {
+    return self;
+  }
+  if (RTEST(running_gvl_profiler)) {
+    rb_raise(rb_eRuntimeError,
+             "Another Backtracie::GvlProfiler is already running");
+  }
+
+  if (NIL_P(profiler->pending_waits)) {
+    profiler->pending_waits =
+        backtracie_sample_ring_new(PENDING_WAITS_CAPA, profiler->max_depth);
+  }
+
+  current_generation++;
+  running_gvl_profiler = self;
+  profiler->hook = rb_internal_thread_add_event_hook(
+      on_thread_event,
+      RUBY_INTERNAL_THREAD_EVENT_READY | RUBY_INTERNAL_THREAD_EVENT_RESUMED,
+      profiler);
+
+  return self;
+#endif
+}
+
+static VALUE gvl_profiler_stop(VALUE self) {
+  if (running_gvl_profiler != self) {
+    return self;
+  }
+
+#ifndef PRE_THREAD_EVENT_HOOKS
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  // This waits for any hook calls that are in progress to finish
+  rb_internal_thread_remove_event_hook(profiler->hook);
+  profiler->hook = NULL;
+  running_gvl_profiler = Qnil;
+  flush_pending_waits(profiler);
+#endif
+
+  return self;
+}
+
+static VALUE gvl_profiler_is_running(VALUE self) {
+  return running_gvl_profiler == self ? Qtrue : Qfalse;
+}
+
+static VALUE gvl_profiler_stack_table(VALUE self) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  flush_pending_waits(profiler);
+  return profiler->stack_table;
+}
+
+// Returns a hash of stack id => number of times a thread waited for the GVL
+// with that stack
+static VALUE gvl_profiler_samples(VALUE self) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  flush_pending_waits(profiler);
+  return counts_to_hash(profiler->wait_counts, profiler->counts_capa);
+}
+
+// Returns a hash of stack id => total time (in nanoseconds) spent waiting for
+// the GVL with that stack
+static VALUE gvl_profiler_wait_times(VALUE self) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  flush_pending_waits(profiler);
+  return counts_to_hash(profiler->wait_times_ns, profiler->counts_capa);
+}
+
+// Like StackTable#write_collapsed(profiler.wait_times, output), so each stack
+// is weighted by the time spent waiting, in nanoseconds
+static VALUE gvl_profiler_write_collapsed(VALUE self, VALUE output) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  flush_pending_waits(profiler);
+
+  uint32_t len = profiler->counts_capa;
+  VALUE stack_ids_buffer, wait_times_buffer;
+  uint32_t *stack_ids = ALLOCV_N(uint32_t, stack_ids_buffer, len);
+  uint64_t *wait_times = ALLOCV_N(uint64_t, wait_times_buffer, len);
+
+  for (uint32_t stack_id = 0; stack_id < len; stack_id++) {
+    stack_ids[stack_id] = stack_id;
+  }
+  // Writing to output may run Ruby code, and thus record more waits, so work
+  // on a copy of the wait times
+  if (len > 0) {
+    memcpy(wait_times, profiler->wait_times_ns, sizeof(uint64_t) * len);
+  }
+
+  size_t bytes_written = backtracie_stack_table_write_collapsed(
+      profiler->stack_table, stack_ids, wait_times, len, output);
+
+  ALLOCV_END(stack_ids_buffer);
+  ALLOCV_END(wait_times_buffer);
+  return SIZET2NUM(bytes_written);
+}
+
+static VALUE gvl_profiler_wait_count(VALUE self) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  flush_pending_waits(profiler);
+  return ULL2NUM(profiler->wait_count);
+}
+
+// Returns the total time (in seconds) that threads spent waiting for the GVL
+static VALUE gvl_profiler_wait_time(VALUE self) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  flush_pending_waits(profiler);
+  return DBL2NUM(profiler->wait_time_ns / 1e9);
+}
+
+static VALUE gvl_profiler_dropped_count(VALUE self) {
+  gvl_profiler_t *profiler = get_gvl_profiler(self);
+  uint64_t dropped_count = profiler->dropped_count;
+  if (!NIL_P(profiler->pending_waits)) {
+    dropped_count +=
+        backtracie_sample_ring_dropped_count(profiler->pending_waits);
+  }
+  return ULL2NUM(dropped_count);
+}
+
+static VALUE counts_to_hash(const uint64_t *counts, uint32_t len) {
+  VALUE samples = rb_hash_new();
+  for (uint32_t stack_id = 0; stack_id < len; stack_id++) {
+    if (counts[stack_id] > 0) {
+      rb_hash_aset(samples, UINT2NUM(stack_id), ULL2NUM(counts[stack_id]));
+    }
+  }
+  return samples;
+}
+
+static uint64_t monotonic_time_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+#ifndef PRE_THREAD_EVENT_HOOKS
+static void on_thread_event(rb_event_flag_t event,
+                            const rb_internal_thread_event_data_t *event_data,
+                            void *data) {
+  if (event == RUBY_INTERNAL_THREAD_EVENT_READY) {
+    // Runs without the GVL, so must not touch anything but thread-locals
+    ready_at_ns = monotonic_time_ns();
+    ready_generation = current_generation;
+    return;
+  }
+
+  // Threads that get the GVL without having to wait for it don't report READY
+  uint64_t started_waiting_at_ns = ready_at_ns;
+  ready_at_ns = 0;
+  if (started_waiting_at_ns == 0 || ready_generation != current_generation) {
+    return;
+  }
+  record_wait((gvl_profiler_t *)data,
+              monotonic_time_ns() - started_waiting_at_ns);
+}
+
+// Runs with the GVL, but must not allocate nor raise; see the top of this file.
+static void record_wait(gvl_profiler_t *profiler, uint64_t wait_ns) {
+  VALUE thread = backtracie_current_thread_without_gvl();
+  if (NIL_P(thread) || !backtracie_sample_ring_push_thread(
+                           profiler->pending_waits, thread, wait_ns)) {
+    return;
+  }
+
+  // Flush well before running out of space
+  if (backtracie_sample_ring_size(profiler->pending_waits) >=
+      PENDING_WAITS_CAPA / 2) {
+    rb_postponed_job_register_one(0, flush_job, NULL);
+  }
+}
+#endif
+
+static void flush_job(void *unused) {
+  if (!RTEST(running_gvl_profiler)) {
+    return;
+  }
+  flush_pending_waits(get_gvl_profiler(running_gvl_profiler));
+}
+
+static void flush_pending_waits(gvl_profiler_t *profiler) {
+  if (NIL_P(profiler->pending_waits)) {
+    return;
+  }
+
+  backtracie_ring_sample_t waits[FLUSH_BATCH_SIZE];
+  uint32_t count;
+  while ((count = backtracie_sample_ring_peek(profiler->pending_waits, waits,
+                                              FLUSH_BATCH_SIZE)) > 0) {
+    for (uint32_t i = 0; i < count; i++) {
+      uint32_t stack_id;
+      if (!backtracie_stack_table_try_intern_stack(
+              profiler->stack_table, waits[i].frames, waits[i].frames_len,
+              &stack_id) ||
+          !reserve_counts(profiler, stack_id)) {
+        profiler->dropped_count++;
+        continue;
+      }
+
+      profiler->wait_counts[stack_id]++;
+      profiler->wait_times_ns[stack_id] += waits[i].value;
+      profiler->wait_count++;
+      profiler->wait_time_ns += waits[i].value;
+    }
+    backtracie_sample_ring_consume(profiler->pending_waits, count);
+  }
+}
+
+static bool reserve_counts(gvl_profiler_t *profiler, uint32_t stack_id) {
+  if (stack_id < profiler->counts_capa) {
+    return true;
+  }
+
+  uint32_t new_capa =
+      profiler->counts_capa == 0 ? 1024 : profiler->counts_capa;
+  while (stack_id >= new_capa) {
+    new_capa *= 2;
+  }
+  uint64_t *new_wait_counts =
+      realloc(profiler->wait_counts, sizeof(uint64_t) * new_capa);
+  if (new_wait_counts == NULL) {
+    return false;
+  }
+  profiler->wait_counts = new_wait_counts;
+  uint64_t *new_wait_times =
+      realloc(profiler->wait_times_ns, sizeof(uint64_t) * new_capa);
+  if (new_wait_times == NULL) {
+    return false;
+  }
+  profiler->wait_times_ns = new_wait_times;
+
+  size_t added = sizeof(uint64_t) * (new_capa - profiler->counts_capa);
+  memset(profiler->wait_counts + profiler->counts_capa, 0, added);
+  memset(profiler->wait_times_ns + profiler->counts_capa, 0, added);
+  profiler->counts_capa = new_capa;
+  return true;
+}
+
+static void gvl_profiler_mark(void *ptr) {
+  gvl_profiler_t *profiler = (gvl_profiler_t *)ptr;
+#ifdef PRE_GC_MARK_MOVABLE
+  rb_gc_mark(profiler->stack_table);
+  rb_gc_mark(profiler->pending_waits);
+#else
+  rb_gc_mark_movable(profiler->stack_table);
+  rb_gc_mark_movable(profiler->pending_waits);
+#endif
+}
+
+static void gvl_profiler_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  gvl_profiler_t *profiler = (gvl_profiler_t *)ptr;
+  profiler->stack_table = rb_gc_location(profiler->stack_table);
+  profiler->pending_waits = rb_gc_location(profiler->pending_waits);
+#endif
+}
+
+static void gvl_profiler_free(void *ptr) {
+  gvl_profiler_t *profiler = (gvl_profiler_t *)ptr;
+  free(profiler->wait_counts);
+  free(profiler->wait_times_ns);
+  xfree(profiler);
+}
+
+static size_t gvl_profiler_memsize(const void *ptr) {
+  const gvl_profiler_t *profiler = (const gvl_profiler_t *)ptr;
+  return sizeof(gvl_profiler_t) +
+         2 * sizeof(uint64_t) * profiler->counts_capa;
+}
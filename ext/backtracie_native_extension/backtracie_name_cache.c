@@ -0,0 +1,269 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// Rendering a qualified method name can be quite expensive (e.g. for anonymous
+// classes, we need to walk the superclass chain looking for something with a
+// name), and in practice the same few thousand frames show up over and over
+// again. This file implements a process-wide, fixed-size, direct-mapped cache
+// of rendered names, keyed on the parts of a minimal_location_t that the name
+// depends on: the method qualifier, the method name, and the iseq type.
+//
+// The cache keeps its keys alive, so it only keeps names for locations whose
+// method qualifiers would stay alive anyway (see
+// backtracie_method_qualifier_is_permanent), and whose names don't involve any
+// anonymous modules (which could get a name later). The others always miss,
+// so that sampling e.g. a singleton method doesn't keep its object around.
+//
+// The cache is only ever accessed while holding the GVL. Lookups do not
+// allocate any Ruby objects, so they can be used from any place where
+// backtracie_minimal_frame_name_cstr could be used before; each entry also
+// keeps a frozen String with its name, created on demand, so that Ruby-facing
+// callers (e.g. Backtracie::Location#qualified_method_name) can all share it.
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+#include "strbuilder.h"
+
+// Must be a power of two
+#define NAME_CACHE_SIZE 4096
+
+typedef struct {
+  bool in_use;
+  // Key
+  uint16_t key_bits;
+  VALUE method_qualifier;
+  // Either an ID or a VALUE, see minimal_location_t.method_name
+  uintptr_t method_name;
+  // Value; allocated with malloc
+  char *name;
+  size_t name_len;
+  // FNV-1a hash of name, for stack fingerprints
+  uint64_t name_hash;
+  // A frozen String with the name, created the first time one is asked for,
+  // or 0
+  VALUE name_value;
+} name_cache_entry_t;
+
+typedef struct {
+  name_cache_entry_t entries[NAME_CACHE_SIZE];
+  uint64_t hits;
+  uint64_t misses;
+} name_cache_t;
+
+static name_cache_t *name_cache = NULL;
+static VALUE name_cache_wrapper = Qnil;
+
+static name_cache_entry_t *name_cache_entry(const minimal_location_t *loc);
+static void name_cache_mark(void *ptr);
+static void name_cache_compact(void *ptr);
+static size_t name_cache_memsize(const void *ptr);
+static const rb_data_type_t name_cache_type = {
+    .wrap_struct_name = "backtracie_name_cache",
+    .function = {.dmark = name_cache_mark,
+                 // The cache lives for as long as the process does
+                 .dfree = RUBY_NEVER_FREE,
+                 .dsize = name_cache_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = name_cache_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+void backtracie_name_cache_init(void) {
+  name_cache = calloc(1, sizeof(name_cache_t));
+  // The wrapper exists only so that the GC lets us mark (and update) the
+  // VALUEs kept in the cache.
+  name_cache_wrapper = TypedData_Wrap_Struct(0, &name_cache_type, name_cache);
+  rb_global_variable(&name_cache_wrapper);
+}
+
+// Locations with the same name key get the same qualified method name, as long
+// as no anonymous module involved gets a name in the meantime.
+void backtracie_name_key(const minimal_location_t *loc,
+                         backtracie_name_key_t *key) {
+  key->key_bits = (uint16_t)(loc->method_qualifier_contents |
+                             (loc->method_name_contents << 2) |
+                             (loc->has_iseq_type << 3) |
+                             (loc->has_iseq_type ? (loc->iseq_type << 4) : 0));
+  key->method_qualifier = loc->method_qualifier.self;
+  key->method_name =
+      loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_CME_ID
+          ? (uintptr_t)loc->method_name.cme_method_id
+          : (uintptr_t)loc->method_name.base_label;
+}
+
+static size_t name_cache_index(uint16_t key_bits, VALUE method_qualifier,
+                               uintptr_t method_name) {
+  uint64_t hash = (uint64_t)method_qualifier * 0x9E3779B97F4A7C15ULL;
+  hash ^= (uint64_t)method_name + 0x632BE59BD9B4E019ULL + (hash << 6) +
+          (hash >> 2);
+  hash ^= key_bits;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  return (size_t)(hash & (NAME_CACHE_SIZE - 1));
+}
+
+static void name_cache_entry_clear(name_cache_entry_t *entry) {
+  free(entry->name);
+  memset(entry, 0, sizeof(name_cache_entry_t));
+}
+
+// Returns the qualified method name for the given location. The returned string
+// is owned by the cache, and is only valid until the next call to this
+// function.
+const char *backtracie_name_cache_lookup(const minimal_location_t *loc,
+                                         size_t *len_out) {
+  name_cache_entry_t *entry = name_cache_entry(loc);
+  if (len_out) {
+    *len_out = entry->name_len;
+  }
+  return entry->name;
+}
+
+VALUE backtracie_name_cache_lookup_value(const minimal_location_t *loc) {
+  name_cache_entry_t *entry = name_cache_entry(loc);
+  if (entry->name_value) {
+    return entry->name_value;
+  }
+  VALUE name_value = backtracie_interned_str(entry->name, entry->name_len);
+  // Creating the String may have triggered a compaction, which invalidates
+  // every entry (see name_cache_compact); if so, don't keep it around, as it
+  // wouldn't get marked
+  if (entry->in_use) {
+    entry->name_value = name_value;
+  }
+  return name_value;
+}
+
+uint64_t backtracie_name_cache_lookup_hash(const minimal_location_t *loc) {
+  return name_cache_entry(loc)->name_hash;
+}
+
+// Finds (or creates) the entry for the given location
+static name_cache_entry_t *name_cache_entry(const minimal_location_t *loc) {
+  backtracie_name_key_t key;
+  backtracie_name_key(loc, &key);
+  uint16_t key_bits = key.key_bits;
+  VALUE method_qualifier = key.method_qualifier;
+  uintptr_t method_name = key.method_name;
+
+  name_cache_entry_t *entry = &name_cache->entries[name_cache_index(
+      key_bits, method_qualifier, method_name)];
+  if (entry->in_use && entry->key_bits == key_bits &&
+      entry->method_qualifier == method_qualifier &&
+      entry->method_name == method_name) {
+    name_cache->hits++;
+  } else {
+    name_cache->misses++;
+
+    // Render on the stack, so that the name only needs one exactly-sized
+    // allocation (unless it's really long)
+    char buf[256];
+    strbuilder_t builder;
+    strbuilder_init_spill(&builder, buf, sizeof(buf));
+    backtracie_anonymous_modules_t anonymous_modules = {.count = 0};
+    backtracie_minimal_frame_render_name(loc, &builder, &anonymous_modules);
+    char *name = malloc(builder.attempted_size + 1);
+    if (name == NULL || builder.out_of_memory) {
+      free(name);
+      strbuilder_free_growable(&builder);
+      rb_memerror();
+    }
+    memcpy(name, builder.original_buf, builder.attempted_size + 1);
+    strbuilder_free_growable(&builder);
+
+    name_cache_entry_clear(entry);
+    entry->key_bits = key_bits;
+    entry->method_qualifier = method_qualifier;
+    entry->method_name = method_name;
+    entry->name = name;
+    entry->name_len = builder.attempted_size;
+    entry->name_hash = backtracie_fnv1a(BACKTRACIE_FNV1A_OFFSET_BASIS, name,
+                                        entry->name_len);
+    // Names that can't be cached are left around for the caller to read, but
+    // never hit on, and their keys don't get marked
+    entry->in_use = anonymous_modules.count == 0 &&
+                    backtracie_method_qualifier_is_permanent(method_qualifier);
+  }
+  return entry;
+}
+
+void backtracie_name_cache_stats(uint64_t *hits, uint64_t *misses) {
+  *hits = name_cache->hits;
+  *misses = name_cache->misses;
+}
+
+static void name_cache_mark(void *ptr) {
+  name_cache_t *cache = (name_cache_t *)ptr;
+  for (size_t i = 0; i < NAME_CACHE_SIZE; i++) {
+    name_cache_entry_t *entry = &cache->entries[i];
+    if (!entry->in_use) {
+      continue;
+    }
+#ifdef PRE_GC_MARK_MOVABLE
+    rb_gc_mark(entry->method_qualifier);
+    if (entry->key_bits & (BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL << 2)) {
+      rb_gc_mark((VALUE)entry->method_name);
+    }
+    if (entry->name_value) {
+      rb_gc_mark(entry->name_value);
+    }
+#else
+    rb_gc_mark_movable(entry->method_qualifier);
+    if (entry->key_bits & (BACKTRACIE_METHOD_NAME_CONTENTS_BASE_LABEL << 2)) {
+      rb_gc_mark_movable((VALUE)entry->method_name);
+    }
+    if (entry->name_value) {
+      rb_gc_mark_movable(entry->name_value);
+    }
+#endif
+  }
+}
+
+static void name_cache_compact(void *ptr) {
+  // The cache is indexed by the address of the method qualifier, so entries
+  // whose keys moved would be in the wrong place anyway. Compaction is rare
+  // enough that it's simpler to just start over. The names themselves only get
+  // freed once their entry is reused, as the last one returned by
+  // backtracie_name_cache_lookup may still be in use (e.g. if this compaction
+  // happened while copying it into a new String).
+  name_cache_t *cache = (name_cache_t *)ptr;
+  for (size_t i = 0; i < NAME_CACHE_SIZE; i++) {
+    cache->entries[i].in_use = false;
+  }
+}
+
+static size_t name_cache_memsize(const void *ptr) {
+  const name_cache_t *cache = (const name_cache_t *)ptr;
+  size_t size = sizeof(name_cache_t);
+  for (size_t i = 0; i < NAME_CACHE_SIZE; i++) {
+    if (cache->entries[i].name) {
+      size += cache->entries[i].name_len + 1;
+    }
+  }
+  return size;
+}
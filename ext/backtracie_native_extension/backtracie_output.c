@@ -0,0 +1,185 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// Helpers for the exporters, which can write either to an Integer file
+// descriptor, or to an IO (or any other object that responds to #write).
+
+#include "extconf.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "backtracie_private.h"
+
+typedef struct {
+  backtracie_symbols_t *symbols;
+  backtracie_export_function_t export;
+  void *export_data;
+  VALUE output;
+  int fd;
+
+  int result;
+  size_t bytes_written;
+  // Set (via rb_protect) if writing to output, or handling an interrupt,
+  // raised an exception
+  int exception_state;
+} export_request_t;
+
+typedef struct {
+  VALUE output;
+  const char *buf;
+  size_t len;
+} io_write_t;
+
+static void *export_without_gvl(void *ptr);
+static int write_to_fd(void *ptr, const char *buf, size_t len);
+static void *check_interrupts(void *ptr);
+static VALUE check_interrupts_body(VALUE unused);
+static int write_to_io(void *ptr, const char *buf, size_t len);
+static VALUE write_to_io_body(VALUE ptr);
+static VALUE gzip_writer_class(void);
+
+size_t backtracie_output_export(VALUE output, backtracie_symbols_t *symbols,
+                                 backtracie_export_function_t export,
+                                 void *export_data) {
+  export_request_t request = {
+      .symbols = symbols,
+      .export = export,
+      .export_data = export_data,
+      .output = output,
+  };
+
+  if (FIXNUM_P(output)) {
+    // The snapshot doesn't need the VM, so the whole export can happen while
+    // other threads run Ruby code (and the fd may well be a pipe being read by
+    // one of them, so we must not block on it while holding the GVL anyway)
+    request.fd = FIX2INT(output);
+    rb_thread_call_without_gvl(export_without_gvl, &request, RUBY_UBF_IO,
+                               NULL);
+  } else {
+    request.result =
+        export(symbols, export_data, write_to_io, &request,
+               &request.bytes_written);
+  }
+  backtracie_symbols_free(symbols);
+
+  if (request.exception_state != 0) {
+    rb_jump_tag(request.exception_state);
+  }
+  if (request.result == ENOMEM) {
+    rb_memerror();
+  }
+  if (request.result != 0) {
+    errno = request.result;
+    rb_sys_fail("write");
+  }
+  return request.bytes_written;
+}
+
+static void *export_without_gvl(void *ptr) {
+  export_request_t *request = (export_request_t *)ptr;
+  request->result =
+      request->export(request->symbols, request->export_data, write_to_fd,
+                      request, &request->bytes_written);
+  return NULL;
+}
+
+static int write_to_fd(void *ptr, const char *buf, size_t len) {
+  export_request_t *request = (export_request_t *)ptr;
+  while (len > 0) {
+    ssize_t result = write(request->fd, buf, len);
+    if (result >= 0) {
+      buf += result;
+      len -= result;
+      continue;
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // The fd is non-blocking (as are e.g. the ones from IO.pipe), so wait
+      // until there's room in it
+      struct pollfd pollfd = {.fd = request->fd, .events = POLLOUT};
+      if (poll(&pollfd, 1, -1) >= 0) {
+        continue;
+      }
+    }
+    if (errno != EINTR) {
+      return errno;
+    }
+    // We may have been interrupted so that the thread can be killed (or
+    // handle a signal, ...), which needs the GVL
+    rb_thread_call_with_gvl(check_interrupts, request);
+    if (request->exception_state != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void *check_interrupts(void *ptr) {
+  export_request_t *request = (export_request_t *)ptr;
+  rb_protect(check_interrupts_body, Qnil, &request->exception_state);
+  return NULL;
+}
+
+static VALUE check_interrupts_body(VALUE unused) {
+  rb_thread_check_ints();
+  return Qnil;
+}
+
+static int write_to_io(void *ptr, const char *buf, size_t len) {
+  export_request_t *request = (export_request_t *)ptr;
+  io_write_t io_write = {.output = request->output, .buf = buf, .len = len};
+  rb_protect(write_to_io_body, (VALUE)&io_write, &request->exception_state);
+  return request->exception_state != 0 ? -1 : 0;
+}
+
+static VALUE write_to_io_body(VALUE ptr) {
+  io_write_t *io_write = (io_write_t *)ptr;
+  return rb_io_write(io_write->output,
+                     rb_str_new(io_write->buf, io_write->len));
+}
+
+VALUE backtracie_output_gzip_open(VALUE output) {
+  if (FIXNUM_P(output)) {
+    // The caller still owns the fd, so make sure it doesn't get closed when
+    // the IO is garbage collected
+    output = rb_funcall(rb_cIO, rb_intern("for_fd"), 2, output,
+                        rb_str_new_cstr("wb"));
+    rb_funcall(output, rb_intern("autoclose="), 1, Qfalse);
+  }
+  return rb_funcall(gzip_writer_class(), rb_intern("new"), 1, output);
+}
+
+void backtracie_output_gzip_close(VALUE gzip_writer) {
+  // #finish writes out the gzip footer, but unlike #close, it leaves the
+  // underlying output open
+  VALUE output = rb_funcall(gzip_writer, rb_intern("finish"), 0);
+  if (rb_respond_to(output, rb_intern("flush"))) {
+    rb_funcall(output, rb_intern("flush"), 0);
+  }
+}
+
+static VALUE gzip_writer_class(void) {
+  rb_require("zlib");
+  return rb_const_get(rb_const_get(rb_cObject, rb_intern("Zlib")),
+                      rb_intern("GzipWriter"));
+}
@@ -0,0 +1,611 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements exporting stacks from a Backtracie::StackTable in the
+// pprof format, as described in
+// https://github.com/google/pprof/blob/main/proto/profile.proto
+//
+// A Profile is a protobuf message whose fields (samples, locations, functions,
+// strings, ...) can be written in any order, so we stream it out as we go:
+// whenever a sample refers to a frame we haven't written yet, we first write
+// the strings, Function and Location it needs, and then the sample itself.
+//
+// The ids used in the profile come from the stack table: each frame becomes a
+// Location (with id frame id + 1, since 0 is not a valid id), and each unique
+// (qualified method name, filename) pair becomes a Function.
+//
+// Exporting works off a snapshot of the stack table (see backtracie_symbols.c),
+// and doesn't need the GVL.
+
+#include "extconf.h"
+
+#include <errno.h>
+#include <ruby.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+#define FLUSH_THRESHOLD (64 * 1024)
+
+// Field numbers from profile.proto
+#define PROFILE_SAMPLE_TYPE 1
+#define PROFILE_SAMPLE 2
+#define PROFILE_LOCATION 4
+#define PROFILE_FUNCTION 5
+#define PROFILE_STRING_TABLE 6
+#define PROFILE_PERIOD_TYPE 11
+#define PROFILE_PERIOD 12
+#define VALUE_TYPE_TYPE 1
+#define VALUE_TYPE_UNIT 2
+#define SAMPLE_LOCATION_ID 1
+#define SAMPLE_VALUE 2
+#define LOCATION_ID 1
+#define LOCATION_LINE 4
+#define LINE_FUNCTION_ID 1
+#define LINE_LINE 2
+#define FUNCTION_ID 1
+#define FUNCTION_NAME 2
+#define FUNCTION_FILENAME 4
+
+#define WIRE_TYPE_VARINT 0
+#define WIRE_TYPE_LENGTH_DELIMITED 2
+
+// Where to go if something fails, with the error to return
+typedef struct {
+  jmp_buf jump;
+  int error;
+} abort_t;
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t capa;
+  abort_t *abort;
+} byte_buffer_t;
+
+// A set of unique strings (or other keys), each mapped to a sequential index.
+// Slots contain index + 1, so that 0 can mean "empty slot".
+typedef struct {
+  uint32_t *slots;
+  uint32_t capa;
+  uint32_t len;
+} index_table_t;
+
+typedef struct {
+  const backtracie_symbols_t *symbols;
+  const uint32_t *stack_ids;
+  const uint64_t *counts;
+  size_t len;
+  int64_t period_ns;
+  backtracie_write_function_t write;
+  void *write_data;
+  size_t bytes_written;
+  abort_t abort;
+
+  // What gets flushed to the output
+  byte_buffer_t buffer;
+  // For building nested messages, whose size must be known before writing them
+  byte_buffer_t message;
+  byte_buffer_t submessage;
+  // Packed location ids of the current sample
+  byte_buffer_t location_ids;
+
+  // The string table: strings_data contains all strings, one after the other;
+  // the string with index i starts at strings_offsets[i] and ends where the
+  // next one starts.
+  index_table_t strings;
+  byte_buffer_t strings_data;
+  size_t *strings_offsets;
+  size_t strings_offsets_capa;
+  // For each string of the snapshot, its index in the string table plus one;
+  // zero means not interned yet
+  uint32_t *symbols_strings;
+
+  // Functions: each is identified by its (name, filename) string indexes
+  index_table_t functions;
+  uint64_t *functions_keys;
+  size_t functions_keys_capa;
+
+  // For each frame id, whether its Location was already written
+  bool *locations_written;
+} pprof_export_t;
+
+typedef struct {
+  const uint32_t *stack_ids;
+  const uint64_t *counts;
+  size_t len;
+  int64_t period_ns;
+} pprof_args_t;
+
+static int export_pprof(const backtracie_symbols_t *symbols, void *export_data,
+                        backtracie_write_function_t write, void *write_data,
+                        size_t *bytes_written);
+static void write_pprof(pprof_export_t *state);
+static void write_location(pprof_export_t *state, uint32_t frame_id);
+static uint32_t intern_symbols_string(pprof_export_t *state, uint32_t index);
+static uint32_t intern_string(pprof_export_t *state, const char *str,
+                              size_t len);
+static uint32_t intern_function(pprof_export_t *state, uint32_t name,
+                                uint32_t filename);
+static void write_value_type(pprof_export_t *state, int field,
+                             const char *type, const char *unit);
+static void flush(pprof_export_t *state);
+static void buffer_reserve(byte_buffer_t *buffer, size_t extra);
+static void buffer_append(byte_buffer_t *buffer, const void *data, size_t len);
+static void put_varint(byte_buffer_t *buffer, uint64_t value);
+static void put_tag(byte_buffer_t *buffer, int field, int wire_type);
+static void put_varint_field(byte_buffer_t *buffer, int field, uint64_t value);
+static void put_bytes_field(byte_buffer_t *buffer, int field, const void *data,
+                            size_t len);
+static bool index_table_find(index_table_t *table, uint64_t hash,
+                             bool (*matches)(pprof_export_t *, uint32_t,
+                                             const void *),
+                             pprof_export_t *state, const void *key,
+                             uint32_t *slot_out);
+static void index_table_insert(index_table_t *table, uint32_t slot,
+                               uint64_t (*hash_of)(pprof_export_t *, uint32_t),
+                               pprof_export_t *state);
+static uint64_t string_hash(const char *str, size_t len);
+static uint64_t string_hash_of(pprof_export_t *state, uint32_t index);
+static bool string_matches(pprof_export_t *state, uint32_t index,
+                           const void *key);
+static uint64_t function_hash(uint64_t key);
+static uint64_t function_hash_of(pprof_export_t *state, uint32_t index);
+static bool function_matches(pprof_export_t *state, uint32_t index,
+                             const void *key);
+static void *checked_realloc(abort_t *abort, void *ptr, size_t size);
+static void fail(abort_t *abort, int error);
+
+typedef struct {
+  const char *str;
+  size_t len;
+} string_key_t;
+
+VALUE backtracie_write_pprof_with_options(VALUE table,
+                                          const uint32_t *stack_ids,
+                                          const uint64_t *counts, size_t len,
+                                          int64_t period_ns, VALUE output,
+                                          VALUE options) {
+  VALUE gzip = Qfalse;
+  if (!NIL_P(options)) {
+    ID gzip_id = rb_intern("gzip");
+    rb_get_kwargs(options, &gzip_id, 0, 1, &gzip);
+    if (gzip == Qundef) {
+      gzip = Qfalse;
+    }
+  }
+
+  if (!RTEST(gzip)) {
+    return SIZET2NUM(backtracie_stack_table_write_pprof(
+        table, stack_ids, counts, len, period_ns, output));
+  }
+
+  VALUE gzip_writer = backtracie_output_gzip_open(output);
+  size_t bytes_written = backtracie_stack_table_write_pprof(
+      table, stack_ids, counts, len, period_ns, gzip_writer);
+  backtracie_output_gzip_close(gzip_writer);
+  return SIZET2NUM(bytes_written);
+}
+
+size_t backtracie_stack_table_write_pprof(VALUE table,
+                                          const uint32_t *stack_ids,
+                                          const uint64_t *counts, size_t len,
+                                          int64_t period_ns, VALUE output) {
+  pprof_args_t args = {
+      .stack_ids = stack_ids,
+      .counts = counts,
+      .len = len,
+      .period_ns = period_ns,
+  };
+  return backtracie_output_export(
+      output, backtracie_stack_table_symbolize(table, stack_ids, counts, len),
+      export_pprof, &args);
+}
+
+static int export_pprof(const backtracie_symbols_t *symbols, void *export_data,
+                        backtracie_write_function_t write, void *write_data,
+                        size_t *bytes_written) {
+  pprof_args_t *args = (pprof_args_t *)export_data;
+  return backtracie_symbols_write_pprof(symbols, args->stack_ids, args->counts,
+                                        args->len, args->period_ns, write,
+                                        write_data, bytes_written);
+}
+
+int backtracie_symbols_write_pprof(const backtracie_symbols_t *symbols,
+                                   const uint32_t *stack_ids,
+                                   const uint64_t *counts, size_t len,
+                                   int64_t period_ns,
+                                   backtracie_write_function_t write,
+                                   void *write_data, size_t *bytes_written) {
+  // Lives on the heap, as it gets modified after setjmp
+  pprof_export_t *state = calloc(1, sizeof(pprof_export_t));
+  if (state == NULL) {
+    return ENOMEM;
+  }
+  state->symbols = symbols;
+  state->stack_ids = stack_ids;
+  state->counts = counts;
+  state->len = len;
+  state->period_ns = period_ns;
+  state->write = write;
+  state->write_data = write_data;
+  state->buffer.abort = &state->abort;
+  state->message.abort = &state->abort;
+  state->submessage.abort = &state->abort;
+  state->location_ids.abort = &state->abort;
+  state->strings_data.abort = &state->abort;
+
+  if (setjmp(state->abort.jump) == 0) {
+    write_pprof(state);
+  }
+
+  int error = state->abort.error;
+  *bytes_written = state->bytes_written;
+  free(state->buffer.data);
+  free(state->message.data);
+  free(state->submessage.data);
+  free(state->location_ids.data);
+  free(state->strings.slots);
+  free(state->strings_data.data);
+  free(state->strings_offsets);
+  free(state->symbols_strings);
+  free(state->functions.slots);
+  free(state->functions_keys);
+  free(state->locations_written);
+  free(state);
+  return error;
+}
+
+static void write_pprof(pprof_export_t *state) {
+  const backtracie_symbols_t *symbols = state->symbols;
+
+  state->locations_written = checked_realloc(
+      &state->abort, NULL, sizeof(bool) * (symbols->frame_count + 1));
+  memset(state->locations_written, 0,
+         sizeof(bool) * (symbols->frame_count + 1));
+  state->symbols_strings = checked_realloc(
+      &state->abort, NULL, sizeof(uint32_t) * symbols->string_count);
+  memset(state->symbols_strings, 0, sizeof(uint32_t) * symbols->string_count);
+
+  // The first entry in the string table must always be the empty string
+  intern_string(state, "", 0);
+  write_value_type(state, PROFILE_SAMPLE_TYPE, "samples", "count");
+  if (state->period_ns > 0) {
+    write_value_type(state, PROFILE_PERIOD_TYPE, "wall", "nanoseconds");
+    put_varint_field(&state->buffer, PROFILE_PERIOD, state->period_ns);
+  }
+
+  for (size_t i = 0; i < state->len; i++) {
+    uint32_t stack_id = state->stack_ids[i];
+    if (stack_id == BACKTRACIE_EMPTY_STACK_ID || state->counts[i] == 0) {
+      continue;
+    }
+    BACKTRACIE_ASSERT(stack_id < symbols->stack_count &&
+                      symbols->stack_depths[stack_id] > 0);
+
+    // Location ids in a sample start from the innermost frame, which is just
+    // the order in which stacks are stored
+    state->location_ids.len = 0;
+    for (uint32_t current = stack_id; current != BACKTRACIE_EMPTY_STACK_ID;
+         current = symbols->stack_parents[current]) {
+      uint32_t frame_id = symbols->stack_frames[current];
+      if (!state->locations_written[frame_id]) {
+        write_location(state, frame_id);
+      }
+      put_varint(&state->location_ids, (uint64_t)frame_id + 1);
+    }
+
+    state->submessage.len = 0;
+    put_bytes_field(&state->submessage, SAMPLE_LOCATION_ID,
+                    state->location_ids.data, state->location_ids.len);
+    state->message.len = 0;
+    put_varint(&state->message, state->counts[i]);
+    put_bytes_field(&state->submessage, SAMPLE_VALUE, state->message.data,
+                    state->message.len);
+    put_bytes_field(&state->buffer, PROFILE_SAMPLE, state->submessage.data,
+                    state->submessage.len);
+
+    if (state->buffer.len >= FLUSH_THRESHOLD) {
+      flush(state);
+    }
+  }
+  flush(state);
+}
+
+// Writes the Location for the given frame, as well as the Function and
+// strings it refers to, if they were not written yet
+static void write_location(pprof_export_t *state, uint32_t frame_id) {
+  const backtracie_symbols_t *symbols = state->symbols;
+  BACKTRACIE_ASSERT(frame_id < symbols->frame_count);
+  int64_t line_number = symbols->frame_line_numbers[frame_id];
+
+  uint32_t filename =
+      intern_symbols_string(state, symbols->frame_filenames[frame_id]);
+  uint32_t name = intern_symbols_string(state, symbols->frame_names[frame_id]);
+
+  uint32_t function_id = intern_function(state, name, filename) + 1;
+
+  state->message.len = 0;
+  put_varint_field(&state->message, LINE_FUNCTION_ID, function_id);
+  put_varint_field(&state->message, LINE_LINE, line_number);
+  state->submessage.len = 0;
+  put_varint_field(&state->submessage, LOCATION_ID, (uint64_t)frame_id + 1);
+  put_bytes_field(&state->submessage, LOCATION_LINE, state->message.data,
+                  state->message.len);
+  put_bytes_field(&state->buffer, PROFILE_LOCATION, state->submessage.data,
+                  state->submessage.len);
+
+  state->locations_written[frame_id] = true;
+}
+
+// Like intern_string, but for the string with the given index in the snapshot.
+// Different snapshot strings may still have the same contents (e.g. the
+// filenames of code that was loaded twice), so they do need interning.
+static uint32_t intern_symbols_string(pprof_export_t *state, uint32_t index) {
+  if (state->symbols_strings[index] == 0) {
+    size_t len;
+    const char *str = backtracie_symbols_string(state->symbols, index, &len);
+    state->symbols_strings[index] = intern_string(state, str, len) + 1;
+  }
+  return state->symbols_strings[index] - 1;
+}
+
+// Returns the index of the given string in the string table, writing it out
+// if it's not there yet
+static uint32_t intern_string(pprof_export_t *state, const char *str,
+                              size_t len) {
+  string_key_t key = {.str = str, .len = len};
+  uint32_t slot;
+  if (index_table_find(&state->strings, string_hash(str, len), string_matches,
+                       state, &key, &slot)) {
+    return state->strings.slots[slot] - 1;
+  }
+
+  uint32_t index = state->strings.len;
+  if (index + 2 > state->strings_offsets_capa) {
+    state->strings_offsets_capa = state->strings_offsets_capa == 0
+                                      ? 1024
+                                      : state->strings_offsets_capa * 2;
+    state->strings_offsets =
+        checked_realloc(&state->abort, state->strings_offsets,
+                        sizeof(size_t) * state->strings_offsets_capa);
+  }
+  state->strings_offsets[index] = state->strings_data.len;
+  buffer_append(&state->strings_data, str, len);
+  state->strings_offsets[index + 1] = state->strings_data.len;
+
+  index_table_insert(&state->strings, slot, string_hash_of, state);
+  put_bytes_field(&state->buffer, PROFILE_STRING_TABLE, str, len);
+  return index;
+}
+
+// Returns the index of the function with the given name and filename, writing
+// it out if it's not there yet
+static uint32_t intern_function(pprof_export_t *state, uint32_t name,
+                                uint32_t filename) {
+  uint64_t key = ((uint64_t)name << 32) | filename;
+  uint32_t slot;
+  if (index_table_find(&state->functions, function_hash(key), function_matches,
+                       state, &key, &slot)) {
+    return state->functions.slots[slot] - 1;
+  }
+
+  uint32_t index = state->functions.len;
+  if (index + 1 > state->functions_keys_capa) {
+    state->functions_keys_capa =
+        state->functions_keys_capa == 0 ? 1024 : state->functions_keys_capa * 2;
+    state->functions_keys =
+        checked_realloc(&state->abort, state->functions_keys,
+                        sizeof(uint64_t) * state->functions_keys_capa);
+  }
+  state->functions_keys[index] = key;
+  index_table_insert(&state->functions, slot, function_hash_of, state);
+
+  state->message.len = 0;
+  put_varint_field(&state->message, FUNCTION_ID, (uint64_t)index + 1);
+  put_varint_field(&state->message, FUNCTION_NAME, name);
+  put_varint_field(&state->message, FUNCTION_FILENAME, filename);
+  put_bytes_field(&state->buffer, PROFILE_FUNCTION, state->message.data,
+                  state->message.len);
+  return index;
+}
+
+static void write_value_type(pprof_export_t *state, int field,
+                             const char *type, const char *unit) {
+  uint32_t type_index = intern_string(state, type, strlen(type));
+  uint32_t unit_index = intern_string(state, unit, strlen(unit));
+
+  state->message.len = 0;
+  put_varint_field(&state->message, VALUE_TYPE_TYPE, type_index);
+  put_varint_field(&state->message, VALUE_TYPE_UNIT, unit_index);
+  put_bytes_field(&state->buffer, field, state->message.data,
+                  state->message.len);
+}
+
+static void flush(pprof_export_t *state) {
+  if (state->buffer.len == 0) {
+    return;
+  }
+  int error = state->write(state->write_data, (const char *)state->buffer.data,
+                           state->buffer.len);
+  if (error != 0) {
+    fail(&state->abort, error);
+  }
+  state->bytes_written += state->buffer.len;
+  state->buffer.len = 0;
+}
+
+static void buffer_reserve(byte_buffer_t *buffer, size_t extra) {
+  if (buffer->len + extra <= buffer->capa) {
+    return;
+  }
+  size_t new_capa = buffer->capa == 0 ? 256 : buffer->capa * 2;
+  while (buffer->len + extra > new_capa) {
+    new_capa *= 2;
+  }
+  buffer->data = checked_realloc(buffer->abort, buffer->data, new_capa);
+  buffer->capa = new_capa;
+}
+
+static void buffer_append(byte_buffer_t *buffer, const void *data,
+                          size_t len) {
+  buffer_reserve(buffer, len);
+  if (len > 0) {
+    memcpy(buffer->data + buffer->len, data, len);
+  }
+  buffer->len += len;
+}
+
+static void put_varint(byte_buffer_t *buffer, uint64_t value) {
+  buffer_reserve(buffer, 10);
+  do {
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    buffer->data[buffer->len++] = value != 0 ? (byte | 0x80) : byte;
+  } while (value != 0);
+}
+
+static void put_tag(byte_buffer_t *buffer, int field, int wire_type) {
+  put_varint(buffer, ((uint64_t)field << 3) | wire_type);
+}
+
+static void put_varint_field(byte_buffer_t *buffer, int field, uint64_t value) {
+  put_tag(buffer, field, WIRE_TYPE_VARINT);
+  put_varint(buffer, value);
+}
+
+static void put_bytes_field(byte_buffer_t *buffer, int field, const void *data,
+                            size_t len) {
+  put_tag(buffer, field, WIRE_TYPE_LENGTH_DELIMITED);
+  put_varint(buffer, len);
+  buffer_append(buffer, data, len);
+}
+
+// Looks for key in the table; returns true and sets *slot_out to its slot if
+// found, or returns false and sets *slot_out to the empty slot where it should
+// be inserted.
+static bool index_table_find(index_table_t *table, uint64_t hash,
+                             bool (*matches)(pprof_export_t *, uint32_t,
+                                             const void *),
+                             pprof_export_t *state, const void *key,
+                             uint32_t *slot_out) {
+  if (table->capa == 0) {
+    table->capa = 1024;
+    table->slots =
+        checked_realloc(&state->abort, NULL, sizeof(uint32_t) * table->capa);
+    memset(table->slots, 0, sizeof(uint32_t) * table->capa);
+  }
+
+  uint32_t mask = table->capa - 1;
+  uint32_t slot = hash & mask;
+  while (table->slots[slot] != 0) {
+    if (matches(state, table->slots[slot] - 1, key)) {
+      *slot_out = slot;
+      return true;
+    }
+    slot = (slot + 1) & mask;
+  }
+  *slot_out = slot;
+  return false;
+}
+
+// Adds the next index to the table, at the slot returned by index_table_find
+static void index_table_insert(index_table_t *table, uint32_t slot,
+                               uint64_t (*hash_of)(pprof_export_t *, uint32_t),
+                               pprof_export_t *state) {
+  table->slots[slot] = table->len + 1;
+  table->len++;
+
+  // Keep the table at most half full
+  if (table->len * 2 > table->capa) {
+    uint32_t new_capa = table->capa * 2;
+    uint32_t *new_slots =
+        checked_realloc(&state->abort, NULL, sizeof(uint32_t) * new_capa);
+    memset(new_slots, 0, sizeof(uint32_t) * new_capa);
+    for (uint32_t index = 0; index < table->len; index++) {
+      uint32_t new_slot = hash_of(state, index) & (new_capa - 1);
+      while (new_slots[new_slot] != 0) {
+        new_slot = (new_slot + 1) & (new_capa - 1);
+      }
+      new_slots[new_slot] = index + 1;
+    }
+    free(table->slots);
+    table->slots = new_slots;
+    table->capa = new_capa;
+  }
+}
+
+// FNV-1a
+static uint64_t string_hash(const char *str, size_t len) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t)str[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+static uint64_t string_hash_of(pprof_export_t *state, uint32_t index) {
+  size_t offset = state->strings_offsets[index];
+  return string_hash((const char *)state->strings_data.data + offset,
+                     state->strings_offsets[index + 1] - offset);
+}
+
+static bool string_matches(pprof_export_t *state, uint32_t index,
+                           const void *key) {
+  const string_key_t *string_key = (const string_key_t *)key;
+  size_t offset = state->strings_offsets[index];
+  size_t len = state->strings_offsets[index + 1] - offset;
+  return len == string_key->len &&
+         (len == 0 || memcmp(state->strings_data.data + offset,
+                             string_key->str, len) == 0);
+}
+
+static uint64_t function_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xFF51AFD7ED558CCDULL;
+  key ^= key >> 33;
+  return key;
+}
+
+static uint64_t function_hash_of(pprof_export_t *state, uint32_t index) {
+  return function_hash(state->functions_keys[index]);
+}
+
+static bool function_matches(pprof_export_t *state, uint32_t index,
+                             const void *key) {
+  return state->functions_keys[index] == *(const uint64_t *)key;
+}
+
+static void *checked_realloc(abort_t *abort, void *ptr, size_t size) {
+  void *result = realloc(ptr, size);
+  if (result == NULL) {
+    fail(abort, ENOMEM);
+  }
+  return result;
+}
+
+static void fail(abort_t *abort, int error) {
+  abort->error = error;
+  longjmp(abort->jump, 1);
+}
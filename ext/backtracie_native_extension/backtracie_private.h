@@ -3,6 +3,10 @@
 
 #include <ruby.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "public/backtracie.h"
+#include "strbuilder.h"
 
 // Need to define an assert macro - we might have just used RUBY_ASSERT, but
 // that's not exported in Ruby < 2.7.
@@ -15,6 +19,236 @@
   } while (0)
 #define BACKTRACIE_ASSERT_FAIL(msg) BACKTRACIE_ASSERT_MSG(0, msg)
 
+// 64-bit FNV-1a, which stack fingerprints are built from; see
+// backtracie_fingerprint.c. Start with BACKTRACIE_FNV1A_OFFSET_BASIS as hash,
+// and pass the result of each call to the next one to hash more data.
+#define BACKTRACIE_FNV1A_OFFSET_BASIS 0xCBF29CE484222325ULL
+static inline uint64_t backtracie_fnv1a(uint64_t hash, const void *data,
+                                        size_t len) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+// Returns a frozen String with the given contents. Where Ruby has a public API
+// for it, that's the deduplicated (fstring) String that every other frozen
+// String with the same contents also gets.
+static inline VALUE backtracie_interned_str(const char *ptr, size_t len) {
+#ifdef PRE_INTERNED_STR
+  return rb_obj_freeze(rb_str_new(ptr, len));
+#else
+  return rb_interned_str(ptr, len);
+#endif
+}
+
+// Returns str itself if it's already frozen (as the Strings kept by iseqs and
+// symbols are), and otherwise a frozen (and, if possible, deduplicated) copy.
+static inline VALUE backtracie_frozen_str(VALUE str) {
+  if (OBJ_FROZEN(str)) {
+    return str;
+  }
+#ifdef PRE_INTERNED_STR
+  return rb_str_new_frozen(str);
+#else
+  return rb_str_to_interned_str(str);
+#endif
+}
+
 bool backtracie_is_thread_alive(VALUE thread);
+// Makes sure that pending postponed jobs get run by the thread currently
+// holding the GVL, even if called from a thread that isn't running Ruby code.
+// Safe to call without the GVL.
+void backtracie_interrupt_running_thread_for_postponed_jobs(void);
+#ifndef PRE_THREAD_EVENT_HOOKS
+// Returns the Thread running on the current native thread, if it's holding
+// the GVL, or Qnil otherwise. Doesn't trust the current execution context
+// blindly, so it's safe to call from a thread event hook.
+VALUE backtracie_current_thread_without_gvl(void);
+#endif
+// For use as the ensure function of rb_ensure, to undo an rb_gc_disable();
+// takes what rb_gc_disable() returned
+static inline VALUE backtracie_restore_gc(VALUE gc_was_disabled) {
+  if (!RTEST(gc_was_disabled)) {
+    rb_gc_enable();
+  }
+  return Qnil;
+}
+
+// Calls the given function for every live thread of the main Ractor, in the
+// same order as Thread.list, but without allocating. The function must not
+// release the GVL.
+void backtracie_each_thread(void (*function)(VALUE thread, void *data),
+                            void *data);
 void backtracie_init_c_test_helpers(VALUE backtracie_module);
+
+// How many anonymous modules/classes were looked at while rendering a
+// qualified method name
+typedef struct {
+  int count;
+} backtracie_anonymous_modules_t;
+
+// Caches keyed on the address of an object they don't keep alive (such as the
+// line number cache) can only trust an entry for as long as that object can't
+// have been freed, or moved, and its address reused. Old objects only go away
+// in a major GC (compaction always comes with one), but young ones can go away
+// in any GC; so an entry's epoch records whichever of these GCs it needs to
+// have not happened since it was written. Implemented in backtracie_frames.c.
+//
+// These get checked from places that must not allocate Ruby objects, so
+// backtracie_gc_epoch_init must be called before anything else.
+typedef struct {
+  size_t gc_count;
+  size_t major_gc_count;
+  bool old;
+} backtracie_gc_epoch_t;
+void backtracie_gc_epoch_init(void);
+void backtracie_gc_epoch_for(VALUE object, backtracie_gc_epoch_t *epoch);
+bool backtracie_gc_epoch_is_current(const backtracie_gc_epoch_t *epoch);
+
+// Number of hits/misses on the line number cache; see cached_calc_lineno in
+// backtracie_frames.c
+void backtracie_line_number_cache_stats(uint64_t *hits, uint64_t *misses);
+
+// Finds a single frame on the stack of the given thread: the first frame after
+// skipping start valid frames or, if excluded_path_prefixes (an Array of
+// Strings) is not nil, the first Ruby frame from there on whose absolute path
+// does not start with any of them. Stops walking the stack as soon as it's
+// found.
+//
+// Returns the number of frames written to frames: 0 if there's no such frame,
+// 1 if it's a Ruby frame, and 2 if it's a cfunc, in which case frames[1] is
+// the Ruby frame it takes its path and line number from. Implemented in
+// backtracie_frames.c.
+int backtracie_find_caller_frame(VALUE thread, int start,
+                                 VALUE excluded_path_prefixes,
+                                 raw_location frames[2]);
+
+// Converts a raw_location into a minimal_location_t. Implemented in
+// backtracie_frames.c.
+void backtracie_raw_location_to_minimal_location(const raw_location *raw_loc,
+                                                 minimal_location_t *min_loc);
+
+// Like backtracie_frame_name_rbstr, backtracie_frame_filename_rbstr and
+// backtracie_frame_label_rbstr, but return frozen Strings which may be shared
+// with other callers, rather than new ones: the Strings the iseq already keeps
+// for paths and labels, and cached ones for qualified method names.
+// Implemented in backtracie_frames.c.
+VALUE backtracie_frame_name_value(const raw_location *loc);
+VALUE backtracie_frame_filename_value(const raw_location *loc, bool absolute);
+VALUE backtracie_frame_label_value(const raw_location *loc, bool base);
+
+// Renders the qualified method name for the given location, without going
+// through the name cache. Implemented in backtracie_frames.c.
+void backtracie_minimal_frame_render_name(
+    const minimal_location_t *loc, strbuilder_t *strout,
+    backtracie_anonymous_modules_t *anonymous_modules);
+
+// Returns true if the given method qualifier (see
+// minimal_location_t.method_qualifier) lives for as long as the process does,
+// in practice: the main object, named modules and classes, and their include
+// and singleton classes. Anything else (e.g. an anonymous class, or the
+// singleton class of an object) can get garbage collected. Implemented in
+// backtracie_frames.c.
+bool backtracie_method_qualifier_is_permanent(VALUE method_qualifier);
+
+// Process-wide cache of rendered qualified method names; see
+// backtracie_name_cache.c
+typedef struct {
+  uint16_t key_bits;
+  VALUE method_qualifier;
+  // Either an ID or a VALUE, see minimal_location_t.method_name
+  uintptr_t method_name;
+} backtracie_name_key_t;
+void backtracie_name_key(const minimal_location_t *loc,
+                         backtracie_name_key_t *key);
+void backtracie_name_cache_init(void);
+const char *backtracie_name_cache_lookup(const minimal_location_t *loc,
+                                         size_t *len_out);
+// Like backtracie_name_cache_lookup, but returns a frozen String, which is
+// itself cached: every location with the same name gets the same String
+VALUE backtracie_name_cache_lookup_value(const minimal_location_t *loc);
+// Like backtracie_name_cache_lookup, but returns the (cached) FNV-1a hash of
+// the name instead
+uint64_t backtracie_name_cache_lookup_hash(const minimal_location_t *loc);
+void backtracie_name_cache_stats(uint64_t *hits, uint64_t *misses);
+
+// See backtracie_fingerprint.c
+void backtracie_fingerprint_init(VALUE backtracie_module);
+
+// See backtracie_stack_table.c
+void backtracie_stack_table_init(VALUE backtracie_module);
+
+// A snapshot of some of the stacks in a stack table, as returned by
+// backtracie_stack_table_symbolize; see backtracie_symbols.c. Uses the same
+// stack and frame ids as the table. Strings are NULL-terminated, and string
+// 0 is always the empty string.
+struct backtracie_symbols {
+  // Indexed by stack id. Stacks that are not in the snapshot have a depth of
+  // zero, as does the empty stack.
+  uint32_t stack_count;
+  uint32_t *stack_frames;
+  uint32_t *stack_parents;
+  uint32_t *stack_depths;
+  // Indexed by frame id; only frames of stacks in the snapshot are filled in.
+  // Frames without a filename get string 0.
+  uint32_t frame_count;
+  uint32_t *frame_names;
+  uint32_t *frame_filenames;
+  uint32_t *frame_line_numbers;
+  // String i goes from strings[string_offsets[i]] to
+  // strings[string_offsets[i + 1] - 1], which is its NULL terminator
+  char *strings;
+  size_t *string_offsets;
+  uint32_t string_count;
+};
+
+static inline const char *
+backtracie_symbols_string(const backtracie_symbols_t *symbols, uint32_t index,
+                          size_t *len_out) {
+  size_t offset = symbols->string_offsets[index];
+  *len_out = symbols->string_offsets[index + 1] - offset - 1;
+  return symbols->strings + offset;
+}
+
+// Runs the given export (e.g. backtracie_symbols_write_collapsed), with the
+// given snapshot, writing to output, which is either an Integer file
+// descriptor, or an IO (or any other object that responds to #write). When
+// it's a file descriptor, the export runs without the GVL. Frees the snapshot
+// once done, and raises if the export failed; otherwise returns the number of
+// bytes written.
+typedef int (*backtracie_export_function_t)(
+    const backtracie_symbols_t *symbols, void *export_data,
+    backtracie_write_function_t write, void *write_data,
+    size_t *bytes_written);
+size_t backtracie_output_export(VALUE output, backtracie_symbols_t *symbols,
+                                 backtracie_export_function_t export,
+                                 void *export_data);
+// Returns a Zlib::GzipWriter that compresses everything written to it into
+// output; backtracie_output_gzip_close must be called once done with it
+VALUE backtracie_output_gzip_open(VALUE output);
+void backtracie_output_gzip_close(VALUE gzip_writer);
+
+// See backtracie_pprof.c. Implements the Ruby-facing write_pprof methods, which
+// accept a gzip: keyword argument in options; returns the number of bytes of
+// (uncompressed) profile written, as an Integer.
+VALUE backtracie_write_pprof_with_options(VALUE table,
+                                          const uint32_t *stack_ids,
+                                          const uint64_t *counts, size_t len,
+                                          int64_t period_ns, VALUE output,
+                                          VALUE options);
+
+// See backtracie_sample_ring.c
+void backtracie_sample_ring_init(VALUE backtracie_module);
+
+// See backtracie_sampler.c
+void backtracie_sampler_init(VALUE backtracie_module);
+
+// See backtracie_allocation_sampler.c
+void backtracie_allocation_sampler_init(VALUE backtracie_module);
+
+// See backtracie_gvl_profiler.c
+void backtracie_gvl_profiler_init(VALUE backtracie_module);
 #endif
@@ -0,0 +1,406 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements Backtracie::SampleRing; see the "Sample ring API"
+// section of public/backtracie.h for what it does.
+//
+// head and tail count how many samples were ever pushed and consumed; the
+// producer is the only one writing head, and the consumer the only one writing
+// tail, so all they need to agree on is ordering: each side publishes its
+// counter with release semantics once it's done with the slot, and reads the
+// other side's counter with acquire semantics before touching one.
+//
+// The GC only runs with the GVL held, so the producer can't be pushing
+// samples while the ring is being marked; the consumer may still be consuming
+// them, which at worst makes the GC keep a few objects alive for longer.
+//
+// Memory is allocated with plain malloc, as in the stack table, and all of it
+// upfront, so the producer side never needs to allocate.
+
+#include "extconf.h"
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+#define DEFAULT_CAPACITY 1024
+#define DEFAULT_MAX_DEPTH 128
+#define MAX_MAX_DEPTH 1024
+#define DRAIN_BATCH_SIZE 64
+
+typedef struct {
+  int frames_len;
+  uint64_t value;
+} slot_t;
+
+typedef struct {
+  uint32_t capacity;
+  int max_depth;
+  slot_t *slots;
+  // max_depth frames for every slot
+  minimal_location_t *frames;
+  // Used by the producer to capture thread stacks
+  raw_location *scratch_frames;
+  uint64_t dropped_count;
+
+  uint64_t head;
+  uint64_t tail;
+} sample_ring_t;
+
+static VALUE backtracie_module = Qnil;
+static VALUE sample_ring_class = Qnil;
+static ID ensure_object_is_thread_id;
+static ID capacity_id;
+static ID max_depth_id;
+
+static void sample_ring_mark(void *ptr);
+static void sample_ring_free(void *ptr);
+static size_t sample_ring_memsize(const void *ptr);
+// Pinning the VALUEs in the ring (rather than having a dcompact function) is
+// what allows the consumer to read them without the GVL.
+static const rb_data_type_t sample_ring_type = {
+    .wrap_struct_name = "backtracie_sample_ring",
+    .function = {.dmark = sample_ring_mark,
+                 .dfree = sample_ring_free,
+                 .dsize = sample_ring_memsize,
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE sample_ring_alloc(VALUE klass);
+static sample_ring_t *get_sample_ring(VALUE ring);
+static sample_ring_t *get_sample_ring_without_gvl(VALUE ring);
+static void setup_sample_ring(sample_ring_t *ring, uint32_t capacity,
+                              int max_depth);
+static minimal_location_t *slot_frames(sample_ring_t *ring, uint64_t index);
+static slot_t *reserve_slot(sample_ring_t *ring);
+static void publish_slot(sample_ring_t *ring);
+static VALUE sample_ring_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE sample_ring_capture(int argc, VALUE *argv, VALUE self);
+static VALUE sample_ring_drain(int argc, VALUE *argv, VALUE self);
+static VALUE sample_ring_size(VALUE self);
+static VALUE sample_ring_capacity(VALUE self);
+static VALUE sample_ring_max_depth(VALUE self);
+static VALUE sample_ring_dropped_count(VALUE self);
+
+void backtracie_sample_ring_init(VALUE module) {
+  backtracie_module = module;
+  ensure_object_is_thread_id = rb_intern("ensure_object_is_thread");
+  capacity_id = rb_intern("capacity");
+  max_depth_id = rb_intern("max_depth");
+
+  sample_ring_class =
+      rb_define_class_under(backtracie_module, "SampleRing", rb_cObject);
+  rb_global_variable(&sample_ring_class);
+  rb_define_alloc_func(sample_ring_class, sample_ring_alloc);
+
+  rb_define_method(sample_ring_class, "initialize", sample_ring_initialize,
+                   -1);
+  rb_define_method(sample_ring_class, "capture", sample_ring_capture, -1);
+  rb_define_method(sample_ring_class, "drain", sample_ring_drain, -1);
+  rb_define_method(sample_ring_class, "size", sample_ring_size, 0);
+  rb_define_method(sample_ring_class, "capacity", sample_ring_capacity, 0);
+  rb_define_method(sample_ring_class, "max_depth", sample_ring_max_depth, 0);
+  rb_define_method(sample_ring_class, "dropped_count",
+                   sample_ring_dropped_count, 0);
+}
+
+VALUE backtracie_sample_ring_new(uint32_t capacity, int max_depth) {
+  VALUE ring = sample_ring_alloc(sample_ring_class);
+  setup_sample_ring(get_sample_ring_without_gvl(ring), capacity, max_depth);
+  return ring;
+}
+
+bool backtracie_sample_ring_push(VALUE ring, const minimal_location_t *frames,
+                                 int len, uint64_t value) {
+  sample_ring_t *ring_data = get_sample_ring(ring);
+  slot_t *slot = reserve_slot(ring_data);
+  if (slot == NULL) {
+    return false;
+  }
+
+  if (len > ring_data->max_depth) {
+    len = ring_data->max_depth;
+  }
+  memcpy(slot_frames(ring_data, ring_data->head), frames,
+         sizeof(minimal_location_t) * len);
+  slot->frames_len = len;
+  slot->value = value;
+  publish_slot(ring_data);
+  return true;
+}
+
+bool backtracie_sample_ring_push_thread(VALUE ring, VALUE thread,
+                                        uint64_t value) {
+  sample_ring_t *ring_data = get_sample_ring(ring);
+  slot_t *slot = reserve_slot(ring_data);
+  if (slot == NULL) {
+    return false;
+  }
+
+  int len;
+  if (!backtracie_capture_frames_for_thread(thread, 0, ring_data->max_depth,
+                                            ring_data->scratch_frames, &len)) {
+    return false;
+  }
+  minimal_location_t *frames = slot_frames(ring_data, ring_data->head);
+  for (int i = 0; i < len; i++) {
+    backtracie_raw_location_to_minimal_location(&ring_data->scratch_frames[i],
+                                                &frames[i]);
+  }
+  slot->frames_len = len;
+  slot->value = value;
+  publish_slot(ring_data);
+  return true;
+}
+
+uint32_t backtracie_sample_ring_peek(VALUE ring, backtracie_ring_sample_t *out,
+                                     uint32_t max) {
+  sample_ring_t *ring_data = get_sample_ring_without_gvl(ring);
+  uint64_t tail = ring_data->tail;
+  uint64_t head = __atomic_load_n(&ring_data->head, __ATOMIC_ACQUIRE);
+
+  uint32_t count = 0;
+  for (uint64_t index = tail; index < head && count < max; index++, count++) {
+    const slot_t *slot = &ring_data->slots[index % ring_data->capacity];
+    out[count].frames = slot_frames(ring_data, index);
+    out[count].frames_len = slot->frames_len;
+    out[count].value = slot->value;
+  }
+  return count;
+}
+
+void backtracie_sample_ring_consume(VALUE ring, uint32_t count) {
+  sample_ring_t *ring_data = get_sample_ring_without_gvl(ring);
+  uint64_t head = __atomic_load_n(&ring_data->head, __ATOMIC_ACQUIRE);
+  BACKTRACIE_ASSERT(ring_data->tail + count <= head);
+  __atomic_store_n(&ring_data->tail, ring_data->tail + count,
+                   __ATOMIC_RELEASE);
+}
+
+uint32_t backtracie_sample_ring_size(VALUE ring) {
+  sample_ring_t *ring_data = get_sample_ring_without_gvl(ring);
+  uint64_t tail = __atomic_load_n(&ring_data->tail, __ATOMIC_ACQUIRE);
+  uint64_t head = __atomic_load_n(&ring_data->head, __ATOMIC_ACQUIRE);
+  return (uint32_t)(head - tail);
+}
+
+uint64_t backtracie_sample_ring_dropped_count(VALUE ring) {
+  return get_sample_ring(ring)->dropped_count;
+}
+
+static VALUE sample_ring_alloc(VALUE klass) {
+  sample_ring_t *ring;
+  return TypedData_Make_Struct(klass, sample_ring_t, &sample_ring_type, ring);
+}
+
+static sample_ring_t *get_sample_ring(VALUE ring) {
+  sample_ring_t *ring_data;
+  TypedData_Get_Struct(ring, sample_ring_t, &sample_ring_type, ring_data);
+  if (ring_data->slots == NULL) {
+    rb_raise(rb_eRuntimeError, "Backtracie::SampleRing is not initialized");
+  }
+  return ring_data;
+}
+
+// Type checks can raise, which can't be done without the GVL
+static sample_ring_t *get_sample_ring_without_gvl(VALUE ring) {
+  return (sample_ring_t *)RTYPEDDATA_DATA(ring);
+}
+
+static void setup_sample_ring(sample_ring_t *ring, uint32_t capacity,
+                              int max_depth) {
+  if (ring->slots != NULL) {
+    rb_raise(rb_eRuntimeError, "Backtracie::SampleRing is already initialized");
+  }
+  if (capacity == 0 || capacity > INT32_MAX) {
+    rb_raise(rb_eArgError, "capacity must be between 1 and %d", INT32_MAX);
+  }
+  if (max_depth <= 0 || max_depth > MAX_MAX_DEPTH) {
+    rb_raise(rb_eArgError, "max_depth must be between 1 and %d",
+             MAX_MAX_DEPTH);
+  }
+
+  slot_t *slots = calloc(capacity, sizeof(slot_t));
+  minimal_location_t *frames =
+      malloc(sizeof(minimal_location_t) * capacity * (size_t)max_depth);
+  raw_location *scratch_frames = malloc(sizeof(raw_location) * max_depth);
+  if (slots == NULL || frames == NULL || scratch_frames == NULL) {
+    free(slots);
+    free(frames);
+    free(scratch_frames);
+    rb_raise(rb_eNoMemError,
+             "Failed to allocate memory for Backtracie::SampleRing");
+  }
+
+  ring->capacity = capacity;
+  ring->max_depth = max_depth;
+  ring->frames = frames;
+  ring->scratch_frames = scratch_frames;
+  ring->slots = slots;
+}
+
+static minimal_location_t *slot_frames(sample_ring_t *ring, uint64_t index) {
+  return &ring->frames[(index % ring->capacity) * ring->max_depth];
+}
+
+// Producer side; returns the slot at head, or NULL if the ring is full
+static slot_t *reserve_slot(sample_ring_t *ring) {
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (ring->head - tail >= ring->capacity) {
+    ring->dropped_count++;
+    return NULL;
+  }
+  return &ring->slots[ring->head % ring->capacity];
+}
+
+static void publish_slot(sample_ring_t *ring) {
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static VALUE sample_ring_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE options;
+  rb_scan_args(argc, argv, ":", &options);
+
+  ID keyword_ids[] = {capacity_id, max_depth_id};
+  VALUE keyword_values[] = {Qundef, Qundef};
+  if (!NIL_P(options)) {
+    rb_get_kwargs(options, keyword_ids, 0, 2, keyword_values);
+  }
+  int capacity = keyword_values[0] == Qundef ? DEFAULT_CAPACITY
+                                             : NUM2INT(keyword_values[0]);
+  int max_depth = keyword_values[1] == Qundef ? DEFAULT_MAX_DEPTH
+                                              : NUM2INT(keyword_values[1]);
+  if (capacity <= 0) {
+    rb_raise(rb_eArgError, "capacity must be positive");
+  }
+
+  sample_ring_t *ring;
+  TypedData_Get_Struct(self, sample_ring_t, &sample_ring_type, ring);
+  setup_sample_ring(ring, (uint32_t)capacity, max_depth);
+  return self;
+}
+
+// Captures the stack of the given thread into the ring; returns false if the
+// ring is full (which counts as a dropped sample), or the thread is not alive
+static VALUE sample_ring_capture(int argc, VALUE *argv, VALUE self) {
+  VALUE thread, value;
+  rb_scan_args(argc, argv, "11", &thread, &value);
+
+  rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
+
+  return backtracie_sample_ring_push_thread(
+             self, thread, NIL_P(value) ? 1 : NUM2ULL(value))
+             ? Qtrue
+             : Qfalse;
+}
+
+// Removes up to max (or all) samples from the ring, interning their stacks
+// into the given stack table; returns an array of [stack id, value] pairs, from
+// oldest to newest.
+//
+// Each batch gets interned in full before it's removed from the ring, so if
+// interning raises, the whole batch stays in the ring for the next drain
+// (interning its first samples again just returns the same stack ids).
+static VALUE sample_ring_drain(int argc, VALUE *argv, VALUE self) {
+  VALUE stack_table, max;
+  rb_scan_args(argc, argv, "11", &stack_table, &max);
+
+  uint32_t remaining =
+      NIL_P(max) ? backtracie_sample_ring_size(self) : NUM2UINT(max);
+  VALUE result = rb_ary_new();
+  backtracie_ring_sample_t samples[DRAIN_BATCH_SIZE];
+  uint32_t stack_ids[DRAIN_BATCH_SIZE];
+
+  while (remaining > 0) {
+    uint32_t count = backtracie_sample_ring_peek(
+        self, samples,
+        remaining < DRAIN_BATCH_SIZE ? remaining : DRAIN_BATCH_SIZE);
+    if (count == 0) {
+      break;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      stack_ids[i] = backtracie_stack_table_intern_stack(
+          stack_table, samples[i].frames, samples[i].frames_len);
+    }
+    // The values were copied out by peek, so they're still there afterwards
+    backtracie_sample_ring_consume(self, count);
+    for (uint32_t i = 0; i < count; i++) {
+      rb_ary_push(result, rb_assoc_new(UINT2NUM(stack_ids[i]),
+                                       ULL2NUM(samples[i].value)));
+    }
+    remaining -= count;
+  }
+
+  return result;
+}
+
+static VALUE sample_ring_size(VALUE self) {
+  get_sample_ring(self);
+  return UINT2NUM(backtracie_sample_ring_size(self));
+}
+
+static VALUE sample_ring_capacity(VALUE self) {
+  return UINT2NUM(get_sample_ring(self)->capacity);
+}
+
+static VALUE sample_ring_max_depth(VALUE self) {
+  return INT2NUM(get_sample_ring(self)->max_depth);
+}
+
+static VALUE sample_ring_dropped_count(VALUE self) {
+  return ULL2NUM(backtracie_sample_ring_dropped_count(self));
+}
+
+static void sample_ring_mark(void *ptr) {
+  sample_ring_t *ring = (sample_ring_t *)ptr;
+  if (ring->slots == NULL) {
+    return;
+  }
+
+  uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  for (uint64_t index = tail; index < ring->head; index++) {
+    const minimal_location_t *frames = slot_frames(ring, index);
+    int frames_len = ring->slots[index % ring->capacity].frames_len;
+    for (int i = 0; i < frames_len; i++) {
+      backtracie_minimal_frame_mark(&frames[i]);
+    }
+  }
+}
+
+static void sample_ring_free(void *ptr) {
+  sample_ring_t *ring = (sample_ring_t *)ptr;
+  free(ring->slots);
+  free(ring->frames);
+  free(ring->scratch_frames);
+  xfree(ring);
+}
+
+static size_t sample_ring_memsize(const void *ptr) {
+  const sample_ring_t *ring = (const sample_ring_t *)ptr;
+  return sizeof(sample_ring_t) + sizeof(slot_t) * ring->capacity +
+         sizeof(minimal_location_t) * ring->capacity * ring->max_depth +
+         sizeof(raw_location) * ring->max_depth;
+}
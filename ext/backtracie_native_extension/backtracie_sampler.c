@@ -0,0 +1,523 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements Backtracie::Sampler, a sampling profiler that
+// periodically captures the stacks of all live threads into a
+// Backtracie::StackTable, counting how many times each stack was seen.
+//
+// The sampler starts a timer thread, which spends its whole life outside of
+// the GVL, waking up at the configured frequency to register a postponed job.
+// The VM then runs that job on whatever thread is running Ruby code, as soon as
+// it reaches a safe point; the job is where the actual sampling happens.
+// While no thread is running Ruby code, the job doesn't get to run, so
+// periods where the whole process is idle do not get sampled.
+//
+// Postponed jobs are deduplicated by function (not by data), so only one
+// sampler can be running at any given time.
+//
+// The timer thread can end without the sampler getting stopped: it can get
+// killed, and it doesn't survive a fork. The sampler is only considered to be
+// running for as long as its timer thread is alive.
+
+#include "extconf.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <ruby.h>
+#include <ruby/debug.h>
+#include <ruby/thread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+#define DEFAULT_FREQUENCY_HZ 100
+#define MAX_FREQUENCY_HZ 1000
+
+// The clock the timer thread's deadlines are based on
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+#define TIMER_CLOCK CLOCK_MONOTONIC
+#else
+#define TIMER_CLOCK CLOCK_REALTIME
+#endif
+
+typedef struct {
+  VALUE stack_table;
+  VALUE timer_thread;
+  int frequency_hz;
+
+  // Number of samples taken for each stack id
+  uint64_t *stack_counts;
+  uint32_t stack_counts_capa;
+  uint64_t sample_count;
+  uint64_t tick_count;
+  // Total time spent inside sample_job
+  uint64_t sampling_time_ns;
+
+  // Everything from here on is shared with the timer thread, and must only be
+  // touched while holding the mutex
+  pthread_mutex_t mutex;
+  pthread_cond_t stop_requested_cond;
+  bool stop_requested;
+  // Set when Ruby needs the timer thread back (e.g. to handle an interrupt),
+  // which makes it stop waiting, without stopping the sampler
+  bool wake_requested;
+} sampler_t;
+
+static VALUE backtracie_module = Qnil;
+static ID frequency_id;
+static ID join_id;
+
+// The sampler that is currently running (if any). Keeping it here also keeps
+// it from being garbage collected while the timer thread is using it.
+static VALUE running_sampler = Qnil;
+
+static void sampler_mark(void *ptr);
+static void sampler_compact(void *ptr);
+static void sampler_free(void *ptr);
+static size_t sampler_memsize(const void *ptr);
+static const rb_data_type_t sampler_type = {
+    .wrap_struct_name = "backtracie_sampler",
+    .function = {.dmark = sampler_mark,
+                 .dfree = sampler_free,
+                 .dsize = sampler_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = sampler_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE sampler_alloc(VALUE klass);
+static sampler_t *get_sampler(VALUE sampler);
+static void init_timer_sync(sampler_t *sampler);
+static void after_fork_in_child(void);
+static void forget_running_sampler_if_dead(void);
+static VALUE sampler_initialize(int argc, VALUE *argv, VALUE self);
+static VALUE sampler_start(VALUE self);
+static VALUE sampler_stop(VALUE self);
+static VALUE sampler_is_running(VALUE self);
+static VALUE sampler_stack_table(VALUE self);
+static VALUE sampler_samples(VALUE self);
+static VALUE sampler_write_collapsed(VALUE self, VALUE output);
+static VALUE sampler_write_pprof(int argc, VALUE *argv, VALUE self);
+static VALUE sampler_sample_count(VALUE self);
+static VALUE sampler_tick_count(VALUE self);
+static VALUE sampler_sampling_time(VALUE self);
+static uint64_t monotonic_time_ns(void);
+static VALUE timer_thread_loop(void *ptr);
+static void *timer_thread_wait(void *ptr);
+static void timer_thread_unblock(void *ptr);
+static void sample_job(void *unused);
+static void sample_thread(VALUE thread, void *data);
+
+void backtracie_sampler_init(VALUE module) {
+  backtracie_module = module;
+  frequency_id = rb_intern("frequency");
+  join_id = rb_intern("join");
+  rb_global_variable(&running_sampler);
+  pthread_atfork(NULL, NULL, after_fork_in_child);
+
+  VALUE sampler_class =
+      rb_define_class_under(backtracie_module, "Sampler", rb_cObject);
+  rb_define_alloc_func(sampler_class, sampler_alloc);
+
+  rb_define_method(sampler_class, "initialize", sampler_initialize, -1);
+  rb_define_method(sampler_class, "start", sampler_start, 0);
+  rb_define_method(sampler_class, "stop", sampler_stop, 0);
+  rb_define_method(sampler_class, "running?", sampler_is_running, 0);
+  rb_define_method(sampler_class, "stack_table", sampler_stack_table, 0);
+  rb_define_method(sampler_class, "samples", sampler_samples, 0);
+  rb_define_method(sampler_class, "write_collapsed", sampler_write_collapsed,
+                   1);
+  rb_define_method(sampler_class, "write_pprof", sampler_write_pprof, -1);
+  rb_define_method(sampler_class, "sample_count", sampler_sample_count, 0);
+  rb_define_method(sampler_class, "tick_count", sampler_tick_count, 0);
+  rb_define_method(sampler_class, "sampling_time", sampler_sampling_time, 0);
+}
+
+static VALUE sampler_alloc(VALUE klass) {
+  sampler_t *sampler;
+  VALUE self =
+      TypedData_Make_Struct(klass, sampler_t, &sampler_type, sampler);
+  sampler->stack_table = Qnil;
+  sampler->timer_thread = Qnil;
+  sampler->frequency_hz = DEFAULT_FREQUENCY_HZ;
+  init_timer_sync(sampler);
+  return self;
+}
+
+static sampler_t *get_sampler(VALUE self) {
+  sampler_t *sampler;
+  TypedData_Get_Struct(self, sampler_t, &sampler_type, sampler);
+  if (NIL_P(sampler->stack_table)) {
+    rb_raise(rb_eRuntimeError, "Backtracie::Sampler is not initialized");
+  }
+  return sampler;
+}
+
+static void init_timer_sync(sampler_t *sampler) {
+  pthread_mutex_init(&sampler->mutex, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+  pthread_condattr_setclock(&attr, TIMER_CLOCK);
+#endif
+  pthread_cond_init(&sampler->stop_requested_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// Only the thread that forked survives in the child, so the timer thread is
+// gone, possibly while holding the mutex or waiting on the condition variable;
+// either would make them unusable (and hang on destruction), so they get
+// initialized again. Runs right after fork, so must not call into Ruby.
+static void after_fork_in_child(void) {
+  if (!RTEST(running_sampler)) {
+    return;
+  }
+  sampler_t *sampler = (sampler_t *)DATA_PTR(running_sampler);
+  init_timer_sync(sampler);
+  sampler->stop_requested = false;
+  sampler->wake_requested = false;
+  sampler->timer_thread = Qnil;
+  running_sampler = Qnil;
+}
+
+static void forget_running_sampler_if_dead(void) {
+  if (!RTEST(running_sampler)) {
+    return;
+  }
+  sampler_t *sampler = get_sampler(running_sampler);
+  if (!backtracie_is_thread_alive(sampler->timer_thread)) {
+    sampler->timer_thread = Qnil;
+    running_sampler = Qnil;
+  }
+}
+
+static VALUE sampler_initialize(int argc, VALUE *argv, VALUE self) {
+  sampler_t *sampler;
+  TypedData_Get_Struct(self, sampler_t, &sampler_type, sampler);
+  VALUE options;
+  VALUE frequency = Qundef;
+
+  rb_scan_args(argc, argv, ":", &options);
+  if (!NIL_P(options)) {
+    rb_get_kwargs(options, &frequency_id, 0, 1, &frequency);
+  }
+
+  if (frequency != Qundef) {
+    int frequency_hz = NUM2INT(frequency);
+    if (frequency_hz <= 0 || frequency_hz > MAX_FREQUENCY_HZ) {
+      rb_raise(rb_eArgError, "frequency must be between 1 and %d Hz",
+               MAX_FREQUENCY_HZ);
+    }
+    sampler->frequency_hz = frequency_hz;
+  }
+  sampler->stack_table = backtracie_stack_table_new();
+
+  return self;
+}
+
+static VALUE sampler_start(VALUE self) {
+  sampler_t *sampler = get_sampler(self);
+
+  forget_running_sampler_if_dead();
+  if (running_sampler == self) {
+    return self;
+  }
+  if (RTEST(running_sampler)) {
+    rb_raise(rb_eRuntimeError, "Another Backtracie::Sampler is already running");
+  }
+
+  sampler->stop_requested = false;
+  running_sampler = self;
+  sampler->timer_thread = rb_thread_create(timer_thread_loop, sampler);
+
+  return self;
+}
+
+static VALUE sampler_stop(VALUE self) {
+  sampler_t *sampler = get_sampler(self);
+
+  forget_running_sampler_if_dead();
+  if (running_sampler != self) {
+    return self;
+  }
+
+  pthread_mutex_lock(&sampler->mutex);
+  sampler->stop_requested = true;
+  pthread_cond_signal(&sampler->stop_requested_cond);
+  pthread_mutex_unlock(&sampler->mutex);
+
+  rb_funcall(sampler->timer_thread, join_id, 0);
+  sampler->timer_thread = Qnil;
+  running_sampler = Qnil;
+
+  return self;
+}
+
+static VALUE sampler_is_running(VALUE self) {
+  return running_sampler == self &&
+                 backtracie_is_thread_alive(get_sampler(self)->timer_thread)
+             ? Qtrue
+             : Qfalse;
+}
+
+static VALUE sampler_stack_table(VALUE self) {
+  return get_sampler(self)->stack_table;
+}
+
+// Returns a hash of stack id => number of samples with that stack
+static VALUE sampler_samples(VALUE self) {
+  sampler_t *sampler = get_sampler(self);
+  VALUE samples = rb_hash_new();
+
+  for (uint32_t stack_id = 0; stack_id < sampler->stack_counts_capa;
+       stack_id++) {
+    if (sampler->stack_counts[stack_id] > 0) {
+      rb_hash_aset(samples, UINT2NUM(stack_id),
+                   ULL2NUM(sampler->stack_counts[stack_id]));
+    }
+  }
+
+  return samples;
+}
+
+// Like StackTable#write_collapsed(sampler.samples, output), but without
+// building the intermediate hash
+static VALUE sampler_write_collapsed(VALUE self, VALUE output) {
+  sampler_t *sampler = get_sampler(self);
+  uint32_t len = sampler->stack_counts_capa;
+  VALUE stack_ids_buffer, counts_buffer;
+  uint32_t *stack_ids = ALLOCV_N(uint32_t, stack_ids_buffer, len);
+  uint64_t *counts = ALLOCV_N(uint64_t, counts_buffer, len);
+
+  for (uint32_t stack_id = 0; stack_id < len; stack_id++) {
+    stack_ids[stack_id] = stack_id;
+  }
+  // Writing to output may run Ruby code, and thus take more samples, so work
+  // on a copy of the counts
+  if (len > 0) {
+    memcpy(counts, sampler->stack_counts, sizeof(uint64_t) * len);
+  }
+
+  size_t bytes_written = backtracie_stack_table_write_collapsed(
+      sampler->stack_table, stack_ids, counts, len, output);
+
+  ALLOCV_END(stack_ids_buffer);
+  ALLOCV_END(counts_buffer);
+  return SIZET2NUM(bytes_written);
+}
+
+// Like StackTable#write_pprof(sampler.samples, output, gzip: ...), but also
+// records the sampling period in the profile
+static VALUE sampler_write_pprof(int argc, VALUE *argv, VALUE self) {
+  VALUE output, options;
+  rb_scan_args(argc, argv, "1:", &output, &options);
+
+  sampler_t *sampler = get_sampler(self);
+  uint32_t len = sampler->stack_counts_capa;
+  VALUE stack_ids_buffer, counts_buffer;
+  uint32_t *stack_ids = ALLOCV_N(uint32_t, stack_ids_buffer, len);
+  uint64_t *counts = ALLOCV_N(uint64_t, counts_buffer, len);
+
+  for (uint32_t stack_id = 0; stack_id < len; stack_id++) {
+    stack_ids[stack_id] = stack_id;
+  }
+  if (len > 0) {
+    memcpy(counts, sampler->stack_counts, sizeof(uint64_t) * len);
+  }
+
+  VALUE bytes_written = backtracie_write_pprof_with_options(
+      sampler->stack_table, stack_ids, counts, len,
+      1000000000L / sampler->frequency_hz, output, options);
+
+  ALLOCV_END(stack_ids_buffer);
+  ALLOCV_END(counts_buffer);
+  return bytes_written;
+}
+
+static VALUE sampler_sample_count(VALUE self) {
+  return ULL2NUM(get_sampler(self)->sample_count);
+}
+
+static VALUE sampler_tick_count(VALUE self) {
+  return ULL2NUM(get_sampler(self)->tick_count);
+}
+
+// Returns the total time (in seconds) spent sampling
+static VALUE sampler_sampling_time(VALUE self) {
+  return DBL2NUM(get_sampler(self)->sampling_time_ns / 1e9);
+}
+
+static uint64_t monotonic_time_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static VALUE timer_thread_loop(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+  bool stop_requested = false;
+
+  while (!stop_requested) {
+    // We only come back here if the timer thread got interrupted; Ruby handles
+    // the interrupt before returning (and unwinds the thread if it's getting
+    // killed), and otherwise we go back to waiting.
+    rb_thread_call_without_gvl(timer_thread_wait, sampler, timer_thread_unblock,
+                               sampler);
+
+    pthread_mutex_lock(&sampler->mutex);
+    stop_requested = sampler->stop_requested;
+    pthread_mutex_unlock(&sampler->mutex);
+  }
+
+  return Qnil;
+}
+
+// Runs without the GVL; must not touch any Ruby objects.
+static void *timer_thread_wait(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+  long interval_ns = 1000000000L / sampler->frequency_hz;
+  struct timespec deadline;
+  clock_gettime(TIMER_CLOCK, &deadline);
+
+  pthread_mutex_lock(&sampler->mutex);
+  while (!sampler->stop_requested && !sampler->wake_requested) {
+    deadline.tv_nsec += interval_ns;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+      deadline.tv_nsec %= 1000000000L;
+    }
+
+    int result = 0;
+    while (!sampler->stop_requested && !sampler->wake_requested &&
+           result != ETIMEDOUT) {
+      result = pthread_cond_timedwait(&sampler->stop_requested_cond,
+                                      &sampler->mutex, &deadline);
+    }
+
+    if (result == ETIMEDOUT) {
+      rb_postponed_job_register_one(0, sample_job, NULL);
+      backtracie_interrupt_running_thread_for_postponed_jobs();
+    }
+  }
+  // Only cleared once we're done waiting, so that a wake up that happens
+  // before we start waiting doesn't get lost
+  sampler->wake_requested = false;
+  pthread_mutex_unlock(&sampler->mutex);
+
+  return NULL;
+}
+
+static void timer_thread_unblock(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+
+  pthread_mutex_lock(&sampler->mutex);
+  sampler->wake_requested = true;
+  pthread_cond_signal(&sampler->stop_requested_cond);
+  pthread_mutex_unlock(&sampler->mutex);
+}
+
+static void sample_job(void *unused) {
+  // The sampler may have been stopped after this job was registered
+  if (!RTEST(running_sampler)) {
+    return;
+  }
+  sampler_t *sampler = get_sampler(running_sampler);
+  uint64_t start_ns = monotonic_time_ns();
+  sampler->tick_count++;
+
+  // Not using Thread.list, as allocating from here means that, with a high
+  // enough frequency, the job can end up triggering a GC every time it runs
+  backtracie_each_thread(sample_thread, sampler);
+
+  sampler->sampling_time_ns += monotonic_time_ns() - start_ns;
+}
+
+static void sample_thread(VALUE thread, void *data) {
+  sampler_t *sampler = (sampler_t *)data;
+  if (thread == sampler->timer_thread) {
+    return;
+  }
+
+  uint32_t stack_id;
+  if (!backtracie_try_capture_stack_for_thread(sampler->stack_table, thread, 0,
+                                           &stack_id)) {
+    return;
+  }
+
+  if (stack_id >= sampler->stack_counts_capa) {
+    uint32_t new_capa =
+        sampler->stack_counts_capa == 0 ? 1024 : sampler->stack_counts_capa;
+    while (stack_id >= new_capa) {
+      new_capa *= 2;
+    }
+    uint64_t *new_counts =
+        realloc(sampler->stack_counts, sizeof(uint64_t) * new_capa);
+    if (new_counts == NULL) {
+      return; // Drop the sample; we're in no position to raise from here
+    }
+    memset(new_counts + sampler->stack_counts_capa, 0,
+           sizeof(uint64_t) * (new_capa - sampler->stack_counts_capa));
+    sampler->stack_counts = new_counts;
+    sampler->stack_counts_capa = new_capa;
+  }
+
+  sampler->stack_counts[stack_id]++;
+  sampler->sample_count++;
+}
+
+static void sampler_mark(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+#ifdef PRE_GC_MARK_MOVABLE
+  rb_gc_mark(sampler->stack_table);
+  rb_gc_mark(sampler->timer_thread);
+#else
+  rb_gc_mark_movable(sampler->stack_table);
+  rb_gc_mark_movable(sampler->timer_thread);
+#endif
+}
+
+static void sampler_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  sampler_t *sampler = (sampler_t *)ptr;
+  sampler->stack_table = rb_gc_location(sampler->stack_table);
+  sampler->timer_thread = rb_gc_location(sampler->timer_thread);
+#endif
+}
+
+static void sampler_free(void *ptr) {
+  sampler_t *sampler = (sampler_t *)ptr;
+  pthread_mutex_destroy(&sampler->mutex);
+  pthread_cond_destroy(&sampler->stop_requested_cond);
+  free(sampler->stack_counts);
+  xfree(sampler);
+}
+
+static size_t sampler_memsize(const void *ptr) {
+  const sampler_t *sampler = (const sampler_t *)ptr;
+  return sizeof(sampler_t) + sizeof(uint64_t) * sampler->stack_counts_capa;
+}
@@ -0,0 +1,756 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements Backtracie::StackTable; see the "Stack table API"
+// section of public/backtracie.h for what it does.
+//
+// Frames and stacks live in plain arrays, indexed by their IDs. To find the ID
+// of a frame or stack, each array has an open-addressing hash table (with
+// linear probing) on the side, whose slots contain ID + 1 (so that 0 can mean
+// "empty slot").
+//
+// Memory is allocated with plain malloc, rather than xmalloc, so that interning
+// a stack never triggers a GC (which could otherwise move things around while
+// we're in the middle of it). Interning doesn't raise by itself either, but
+// reports a stack_table_result_t instead, leaving the table consistent: the
+// samplers capture stacks from event hooks and postponed jobs, where raising
+// isn't an option, and drop the sample instead. Only the functions called from
+// Ruby turn failures into exceptions, with raise_on_failure.
+
+#include "extconf.h"
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+
+#define INITIAL_CAPACITY 256 // Must be a power of two
+
+typedef struct {
+  uint32_t parent_stack_id;
+  uint32_t frame_id;
+  uint32_t depth;
+} stack_node_t;
+
+typedef struct {
+  minimal_location_t *frames;
+  uint32_t frames_len;
+  uint32_t frames_capa;
+  uint32_t *frames_index;
+  uint32_t frames_index_capa;
+
+  // stacks[BACKTRACIE_EMPTY_STACK_ID] is the root of the trie; it's never
+  // added to stacks_index
+  stack_node_t *stacks;
+  uint32_t stacks_len;
+  uint32_t stacks_capa;
+  uint32_t *stacks_index;
+  uint32_t stacks_index_capa;
+
+  // Reused across captures, to avoid allocating every time
+  raw_location *scratch_frames;
+  int scratch_frames_capa;
+} stack_table_t;
+
+typedef enum {
+  TABLE_OK,
+  TABLE_THREAD_NOT_ALIVE,
+  TABLE_OUT_OF_MEMORY,
+  TABLE_FULL,
+} stack_table_result_t;
+
+static VALUE backtracie_module = Qnil;
+static VALUE stack_table_class = Qnil;
+static ID ensure_object_is_thread_id;
+static ID max_depth_id;
+static ID negative_p_id;
+
+static void stack_table_mark(void *ptr);
+static void stack_table_compact(void *ptr);
+static void stack_table_free(void *ptr);
+static size_t stack_table_memsize(const void *ptr);
+static const rb_data_type_t stack_table_type = {
+    .wrap_struct_name = "backtracie_stack_table",
+    .function = {.dmark = stack_table_mark,
+                 .dfree = stack_table_free,
+                 .dsize = stack_table_memsize,
+#ifndef PRE_GC_MARK_MOVABLE
+                 .dcompact = stack_table_compact,
+#endif
+                 .reserved = {0}},
+    .parent = NULL,
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE stack_table_alloc(VALUE klass);
+static stack_table_t *get_stack_table(VALUE table);
+static void *checked_realloc(void *ptr, size_t size);
+static void raise_on_failure(stack_table_result_t result);
+static uint64_t hash_mix(uint64_t hash, uint64_t value);
+static uint64_t hash_finish(uint64_t hash);
+static uint32_t frame_flags(const minimal_location_t *loc);
+static uintptr_t frame_method_name(const minimal_location_t *loc);
+static uint64_t frame_hash(const minimal_location_t *loc);
+static bool frames_equal(const minimal_location_t *a,
+                         const minimal_location_t *b);
+static uint64_t stack_hash(uint32_t parent_stack_id, uint32_t frame_id);
+static bool rebuild_frames_index(stack_table_t *table, uint32_t capa);
+static bool rebuild_stacks_index(stack_table_t *table, uint32_t capa);
+static bool reserve_frame(stack_table_t *table);
+static bool reserve_stack_node(stack_table_t *table);
+static stack_table_result_t intern_frame(stack_table_t *table,
+                                         const minimal_location_t *loc,
+                                         uint32_t *frame_id);
+static stack_table_result_t intern_stack_node(stack_table_t *table,
+                                              uint32_t parent_stack_id,
+                                              uint32_t frame_id,
+                                              uint32_t *stack_id);
+static stack_table_result_t intern_call(stack_table_t *table,
+                                        uint32_t stack_id,
+                                        const minimal_location_t *loc,
+                                        uint32_t *call_stack_id);
+static stack_table_result_t intern_stack(stack_table_t *table,
+                                         const minimal_location_t *frames,
+                                         int len, uint32_t *stack_id);
+static stack_table_result_t capture_stack(stack_table_t *table, VALUE thread,
+                                          int max_depth, uint32_t *stack_id);
+static const stack_node_t *get_stack_node(stack_table_t *table,
+                                          uint32_t stack_id);
+static VALUE stack_table_capture(int argc, VALUE *argv, VALUE self);
+static VALUE stack_table_stack_frames(VALUE self, VALUE stack_id);
+static VALUE stack_table_frame_qualified_method_name(VALUE self,
+                                                     VALUE frame_id);
+static VALUE stack_table_frame_lineno(VALUE self, VALUE frame_id);
+static VALUE stack_table_frame_count(VALUE self);
+static VALUE stack_table_stack_count(VALUE self);
+static VALUE stack_table_write_collapsed(VALUE self, VALUE samples,
+                                         VALUE output);
+static VALUE stack_table_write_pprof(int argc, VALUE *argv, VALUE self);
+static int collect_sample(VALUE stack_id, VALUE count, VALUE ptr);
+static void check_not_negative(VALUE value, const char *what);
+
+void backtracie_stack_table_init(VALUE module) {
+  backtracie_module = module;
+  ensure_object_is_thread_id = rb_intern("ensure_object_is_thread");
+  max_depth_id = rb_intern("max_depth");
+  negative_p_id = rb_intern("negative?");
+
+  stack_table_class =
+      rb_define_class_under(backtracie_module, "StackTable", rb_cObject);
+  rb_global_variable(&stack_table_class);
+  rb_define_alloc_func(stack_table_class, stack_table_alloc);
+
+  rb_define_method(stack_table_class, "capture", stack_table_capture, -1);
+  rb_define_method(stack_table_class, "stack_frames", stack_table_stack_frames,
+                   1);
+  rb_define_method(stack_table_class, "frame_qualified_method_name",
+                   stack_table_frame_qualified_method_name, 1);
+  rb_define_method(stack_table_class, "frame_lineno", stack_table_frame_lineno,
+                   1);
+  rb_define_method(stack_table_class, "frame_count", stack_table_frame_count,
+                   0);
+  rb_define_method(stack_table_class, "stack_count", stack_table_stack_count,
+                   0);
+  rb_define_method(stack_table_class, "write_collapsed",
+                   stack_table_write_collapsed, 2);
+  rb_define_method(stack_table_class, "write_pprof", stack_table_write_pprof,
+                   -1);
+}
+
+VALUE backtracie_stack_table_new(void) {
+  return stack_table_alloc(stack_table_class);
+}
+
+uint32_t backtracie_stack_table_intern_frame(VALUE table,
+                                             const minimal_location_t *loc) {
+  uint32_t frame_id = 0;
+  raise_on_failure(intern_frame(get_stack_table(table), loc, &frame_id));
+  return frame_id;
+}
+
+uint32_t backtracie_stack_table_intern_stack(VALUE table,
+                                             const minimal_location_t *frames,
+                                             int len) {
+  uint32_t stack_id = BACKTRACIE_EMPTY_STACK_ID;
+  raise_on_failure(
+      intern_stack(get_stack_table(table), frames, len, &stack_id));
+  return stack_id;
+}
+
+bool backtracie_stack_table_try_intern_stack(VALUE table,
+                                             const minimal_location_t *frames,
+                                             int len, uint32_t *stack_id) {
+  return intern_stack(get_stack_table(table), frames, len, stack_id) ==
+         TABLE_OK;
+}
+
+bool backtracie_capture_stack_for_thread(VALUE table, VALUE thread,
+                                         int max_depth, uint32_t *stack_id) {
+  stack_table_result_t result =
+      capture_stack(get_stack_table(table), thread, max_depth, stack_id);
+  raise_on_failure(result);
+  return result == TABLE_OK;
+}
+
+bool backtracie_try_capture_stack_for_thread(VALUE table, VALUE thread,
+                                             int max_depth,
+                                             uint32_t *stack_id) {
+  return capture_stack(get_stack_table(table), thread, max_depth, stack_id) ==
+         TABLE_OK;
+}
+
+const minimal_location_t *backtracie_stack_table_frame(VALUE table,
+                                                       uint32_t frame_id) {
+  stack_table_t *table_data = get_stack_table(table);
+  if (frame_id >= table_data->frames_len) {
+    rb_raise(rb_eIndexError, "invalid frame id %u", frame_id);
+  }
+  return &table_data->frames[frame_id];
+}
+
+uint32_t backtracie_stack_table_stack_frame(VALUE table, uint32_t stack_id) {
+  return get_stack_node(get_stack_table(table), stack_id)->frame_id;
+}
+
+uint32_t backtracie_stack_table_stack_parent(VALUE table, uint32_t stack_id) {
+  return get_stack_node(get_stack_table(table), stack_id)->parent_stack_id;
+}
+
+uint32_t backtracie_stack_table_stack_depth(VALUE table, uint32_t stack_id) {
+  stack_table_t *table_data = get_stack_table(table);
+  if (stack_id >= table_data->stacks_len) {
+    rb_raise(rb_eIndexError, "invalid stack id %u", stack_id);
+  }
+  return table_data->stacks[stack_id].depth;
+}
+
+uint32_t backtracie_stack_table_frame_count(VALUE table) {
+  return get_stack_table(table)->frames_len;
+}
+
+uint32_t backtracie_stack_table_stack_count(VALUE table) {
+  return get_stack_table(table)->stacks_len;
+}
+
+static VALUE stack_table_alloc(VALUE klass) {
+  stack_table_t *table_data;
+  VALUE table = TypedData_Make_Struct(klass, stack_table_t, &stack_table_type,
+                                      table_data);
+
+  table_data->frames =
+      checked_realloc(NULL, sizeof(minimal_location_t) * INITIAL_CAPACITY);
+  table_data->frames_capa = INITIAL_CAPACITY;
+  if (!rebuild_frames_index(table_data, INITIAL_CAPACITY * 2)) {
+    rb_memerror();
+  }
+
+  table_data->stacks =
+      checked_realloc(NULL, sizeof(stack_node_t) * INITIAL_CAPACITY);
+  table_data->stacks_capa = INITIAL_CAPACITY;
+  table_data->stacks[BACKTRACIE_EMPTY_STACK_ID] = (stack_node_t){
+      .parent_stack_id = BACKTRACIE_EMPTY_STACK_ID,
+      .frame_id = UINT32_MAX,
+      .depth = 0,
+  };
+  table_data->stacks_len = 1;
+  if (!rebuild_stacks_index(table_data, INITIAL_CAPACITY * 2)) {
+    rb_memerror();
+  }
+
+  return table;
+}
+
+static stack_table_t *get_stack_table(VALUE table) {
+  stack_table_t *table_data;
+  TypedData_Get_Struct(table, stack_table_t, &stack_table_type, table_data);
+  return table_data;
+}
+
+static void *checked_realloc(void *ptr, size_t size) {
+  void *result = realloc(ptr, size);
+  if (result == NULL) {
+    rb_memerror();
+  }
+  return result;
+}
+
+static void raise_on_failure(stack_table_result_t result) {
+  switch (result) {
+  case TABLE_OK:
+  case TABLE_THREAD_NOT_ALIVE:
+    return;
+  case TABLE_OUT_OF_MEMORY:
+    rb_memerror();
+  case TABLE_FULL:
+    rb_raise(rb_eRuntimeError, "stack table is full");
+  }
+}
+
+static uint64_t hash_mix(uint64_t hash, uint64_t value) {
+  return hash ^ (value + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2));
+}
+
+static uint64_t hash_finish(uint64_t hash) {
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static uint32_t frame_flags(const minimal_location_t *loc) {
+  return loc->is_ruby_frame | (loc->method_qualifier_contents << 1) |
+         (loc->method_name_contents << 3) | (loc->has_iseq_type << 4) |
+         (loc->has_iseq_type ? (loc->iseq_type << 5) : 0);
+}
+
+static uintptr_t frame_method_name(const minimal_location_t *loc) {
+  return loc->method_name_contents == BACKTRACIE_METHOD_NAME_CONTENTS_CME_ID
+             ? (uintptr_t)loc->method_name.cme_method_id
+             : (uintptr_t)loc->method_name.base_label;
+}
+
+static uint64_t frame_hash(const minimal_location_t *loc) {
+  uint64_t hash = hash_mix(0, frame_flags(loc));
+  hash = hash_mix(hash, loc->line_number);
+  hash = hash_mix(hash, frame_method_name(loc));
+  hash = hash_mix(hash, loc->filename);
+  hash = hash_mix(hash, loc->method_qualifier.self);
+  return hash_finish(hash);
+}
+
+static bool frames_equal(const minimal_location_t *a,
+                         const minimal_location_t *b) {
+  return frame_flags(a) == frame_flags(b) &&
+         a->line_number == b->line_number &&
+         frame_method_name(a) == frame_method_name(b) &&
+         a->filename == b->filename &&
+         a->method_qualifier.self == b->method_qualifier.self;
+}
+
+static uint64_t stack_hash(uint32_t parent_stack_id, uint32_t frame_id) {
+  return hash_finish(hash_mix(hash_mix(0, parent_stack_id), frame_id));
+}
+
+// Rehashes all frames into an index with the given capacity, allocating a new
+// one if that's not the current capacity. Returns false (keeping the current
+// index) if that can't be allocated.
+static bool rebuild_frames_index(stack_table_t *table, uint32_t capa) {
+  if (capa != table->frames_index_capa) {
+    uint32_t *new_index = malloc(sizeof(uint32_t) * capa);
+    if (new_index == NULL) {
+      return false;
+    }
+    free(table->frames_index);
+    table->frames_index = new_index;
+    table->frames_index_capa = capa;
+  }
+  memset(table->frames_index, 0, sizeof(uint32_t) * capa);
+
+  for (uint32_t frame_id = 0; frame_id < table->frames_len; frame_id++) {
+    uint32_t slot = frame_hash(&table->frames[frame_id]) & (capa - 1);
+    while (table->frames_index[slot] != 0) {
+      slot = (slot + 1) & (capa - 1);
+    }
+    table->frames_index[slot] = frame_id + 1;
+  }
+  return true;
+}
+
+static bool rebuild_stacks_index(stack_table_t *table, uint32_t capa) {
+  if (capa != table->stacks_index_capa) {
+    uint32_t *new_index = malloc(sizeof(uint32_t) * capa);
+    if (new_index == NULL) {
+      return false;
+    }
+    free(table->stacks_index);
+    table->stacks_index = new_index;
+    table->stacks_index_capa = capa;
+  }
+  memset(table->stacks_index, 0, sizeof(uint32_t) * capa);
+
+  for (uint32_t stack_id = 1; stack_id < table->stacks_len; stack_id++) {
+    const stack_node_t *node = &table->stacks[stack_id];
+    uint32_t slot =
+        stack_hash(node->parent_stack_id, node->frame_id) & (capa - 1);
+    while (table->stacks_index[slot] != 0) {
+      slot = (slot + 1) & (capa - 1);
+    }
+    table->stacks_index[slot] = stack_id + 1;
+  }
+  return true;
+}
+
+// Grows the frames array and index when they can't take one more frame, so
+// that adding it doesn't leave the index more than half full
+static bool reserve_frame(stack_table_t *table) {
+  if (table->frames_len == table->frames_capa) {
+    minimal_location_t *new_frames = realloc(
+        table->frames, sizeof(minimal_location_t) * table->frames_capa * 2);
+    if (new_frames == NULL) {
+      return false;
+    }
+    table->frames = new_frames;
+    table->frames_capa *= 2;
+  }
+  return (table->frames_len + 1) * 2 <= table->frames_index_capa ||
+         rebuild_frames_index(table, table->frames_index_capa * 2);
+}
+
+static bool reserve_stack_node(stack_table_t *table) {
+  if (table->stacks_len == table->stacks_capa) {
+    stack_node_t *new_stacks =
+        realloc(table->stacks, sizeof(stack_node_t) * table->stacks_capa * 2);
+    if (new_stacks == NULL) {
+      return false;
+    }
+    table->stacks = new_stacks;
+    table->stacks_capa *= 2;
+  }
+  return (table->stacks_len + 1) * 2 <= table->stacks_index_capa ||
+         rebuild_stacks_index(table, table->stacks_index_capa * 2);
+}
+
+static stack_table_result_t intern_frame(stack_table_t *table,
+                                         const minimal_location_t *loc,
+                                         uint32_t *frame_id) {
+  uint32_t mask = table->frames_index_capa - 1;
+  uint32_t slot = frame_hash(loc) & mask;
+  while (table->frames_index[slot] != 0) {
+    uint32_t existing_frame_id = table->frames_index[slot] - 1;
+    if (frames_equal(&table->frames[existing_frame_id], loc)) {
+      *frame_id = existing_frame_id;
+      return TABLE_OK;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (table->frames_len == UINT32_MAX - 1) {
+    return TABLE_FULL;
+  }
+  if (!reserve_frame(table)) {
+    return TABLE_OUT_OF_MEMORY;
+  }
+  if (mask != table->frames_index_capa - 1) {
+    // The index got rebuilt, so look for an empty slot again
+    mask = table->frames_index_capa - 1;
+    slot = frame_hash(loc) & mask;
+    while (table->frames_index[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+  }
+
+  *frame_id = table->frames_len;
+  table->frames[*frame_id] = *loc;
+  table->frames_index[slot] = *frame_id + 1;
+  table->frames_len++;
+  return TABLE_OK;
+}
+
+static stack_table_result_t intern_stack_node(stack_table_t *table,
+                                              uint32_t parent_stack_id,
+                                              uint32_t frame_id,
+                                              uint32_t *stack_id) {
+  uint32_t mask = table->stacks_index_capa - 1;
+  uint32_t slot = stack_hash(parent_stack_id, frame_id) & mask;
+  while (table->stacks_index[slot] != 0) {
+    uint32_t existing_stack_id = table->stacks_index[slot] - 1;
+    const stack_node_t *node = &table->stacks[existing_stack_id];
+    if (node->parent_stack_id == parent_stack_id &&
+        node->frame_id == frame_id) {
+      *stack_id = existing_stack_id;
+      return TABLE_OK;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (table->stacks_len == UINT32_MAX - 1) {
+    return TABLE_FULL;
+  }
+  if (!reserve_stack_node(table)) {
+    return TABLE_OUT_OF_MEMORY;
+  }
+  if (mask != table->stacks_index_capa - 1) {
+    mask = table->stacks_index_capa - 1;
+    slot = stack_hash(parent_stack_id, frame_id) & mask;
+    while (table->stacks_index[slot] != 0) {
+      slot = (slot + 1) & mask;
+    }
+  }
+
+  *stack_id = table->stacks_len;
+  table->stacks[*stack_id] = (stack_node_t){
+      .parent_stack_id = parent_stack_id,
+      .frame_id = frame_id,
+      .depth = table->stacks[parent_stack_id].depth + 1,
+  };
+  table->stacks_index[slot] = *stack_id + 1;
+  table->stacks_len++;
+  return TABLE_OK;
+}
+
+// Interns the given stack with loc added as its new innermost frame
+static stack_table_result_t intern_call(stack_table_t *table,
+                                        uint32_t stack_id,
+                                        const minimal_location_t *loc,
+                                        uint32_t *call_stack_id) {
+  uint32_t frame_id;
+  stack_table_result_t result = intern_frame(table, loc, &frame_id);
+  if (result != TABLE_OK) {
+    return result;
+  }
+  return intern_stack_node(table, stack_id, frame_id, call_stack_id);
+}
+
+// If this fails partway, the outer frames that did get interned stay in the
+// table, which is harmless: they're valid stacks, just not referenced yet.
+static stack_table_result_t intern_stack(stack_table_t *table,
+                                         const minimal_location_t *frames,
+                                         int len, uint32_t *stack_id) {
+  uint32_t current_stack_id = BACKTRACIE_EMPTY_STACK_ID;
+  for (int i = len - 1; i >= 0; i--) {
+    stack_table_result_t result =
+        intern_call(table, current_stack_id, &frames[i], &current_stack_id);
+    if (result != TABLE_OK) {
+      return result;
+    }
+  }
+  *stack_id = current_stack_id;
+  return TABLE_OK;
+}
+
+static stack_table_result_t capture_stack(stack_table_t *table, VALUE thread,
+                                          int max_depth, uint32_t *stack_id) {
+  int frame_count = backtracie_frame_count_for_thread(thread);
+  if (max_depth > 0 && max_depth < frame_count) {
+    frame_count = max_depth;
+  }
+  if (frame_count > table->scratch_frames_capa) {
+    raw_location *new_scratch_frames =
+        realloc(table->scratch_frames, sizeof(raw_location) * frame_count);
+    if (new_scratch_frames == NULL) {
+      return TABLE_OUT_OF_MEMORY;
+    }
+    table->scratch_frames = new_scratch_frames;
+    table->scratch_frames_capa = frame_count;
+  }
+
+  int len;
+  if (!backtracie_capture_frames_for_thread(thread, 0, frame_count,
+                                            table->scratch_frames, &len)) {
+    return TABLE_THREAD_NOT_ALIVE;
+  }
+
+  uint32_t current_stack_id = BACKTRACIE_EMPTY_STACK_ID;
+  for (int i = len - 1; i >= 0; i--) {
+    minimal_location_t loc;
+    backtracie_raw_location_to_minimal_location(&table->scratch_frames[i],
+                                                &loc);
+    stack_table_result_t result =
+        intern_call(table, current_stack_id, &loc, &current_stack_id);
+    if (result != TABLE_OK) {
+      return result;
+    }
+  }
+  *stack_id = current_stack_id;
+  return TABLE_OK;
+}
+
+static const stack_node_t *get_stack_node(stack_table_t *table,
+                                          uint32_t stack_id) {
+  if (stack_id == BACKTRACIE_EMPTY_STACK_ID || stack_id >= table->stacks_len) {
+    rb_raise(rb_eIndexError, "invalid non-empty stack id %u", stack_id);
+  }
+  return &table->stacks[stack_id];
+}
+
+static void stack_table_mark(void *ptr) {
+  stack_table_t *table = (stack_table_t *)ptr;
+  for (uint32_t i = 0; i < table->frames_len; i++) {
+    backtracie_minimal_frame_mark_movable(&table->frames[i]);
+  }
+}
+
+static void stack_table_compact(void *ptr) {
+#ifndef PRE_GC_MARK_MOVABLE
+  stack_table_t *table = (stack_table_t *)ptr;
+  for (uint32_t i = 0; i < table->frames_len; i++) {
+    backtracie_minimal_frame_compact(&table->frames[i]);
+  }
+  // Frames are hashed by the addresses of their VALUEs, so the frame IDs need
+  // to be rehashed. Stacks are hashed by IDs only, and those don't change.
+  rebuild_frames_index(table, table->frames_index_capa);
+#endif
+}
+
+static void stack_table_free(void *ptr) {
+  stack_table_t *table = (stack_table_t *)ptr;
+  free(table->frames);
+  free(table->frames_index);
+  free(table->stacks);
+  free(table->stacks_index);
+  free(table->scratch_frames);
+  xfree(table);
+}
+
+static size_t stack_table_memsize(const void *ptr) {
+  const stack_table_t *table = (const stack_table_t *)ptr;
+  return sizeof(stack_table_t) +
+         sizeof(minimal_location_t) * table->frames_capa +
+         sizeof(uint32_t) * table->frames_index_capa +
+         sizeof(stack_node_t) * table->stacks_capa +
+         sizeof(uint32_t) * table->stacks_index_capa +
+         sizeof(raw_location) * table->scratch_frames_capa;
+}
+
+static VALUE stack_table_capture(int argc, VALUE *argv, VALUE self) {
+  VALUE thread, options;
+  rb_scan_args(argc, argv, "1:", &thread, &options);
+
+  VALUE max_depth = Qundef;
+  if (!NIL_P(options)) {
+    rb_get_kwargs(options, &max_depth_id, 0, 1, &max_depth);
+  }
+  int max_depth_frames = 0;
+  if (max_depth != Qundef && !NIL_P(max_depth)) {
+    max_depth_frames = NUM2INT(max_depth);
+    if (max_depth_frames <= 0) {
+      rb_raise(rb_eArgError, "max_depth must be positive");
+    }
+  }
+
+  rb_funcall(backtracie_module, ensure_object_is_thread_id, 1, thread);
+
+  uint32_t stack_id;
+  if (!backtracie_capture_stack_for_thread(self, thread, max_depth_frames,
+                                           &stack_id)) {
+    return Qnil;
+  }
+  return UINT2NUM(stack_id);
+}
+
+static VALUE stack_table_stack_frames(VALUE self, VALUE stack_id) {
+  stack_table_t *table = get_stack_table(self);
+  uint32_t current_stack_id = NUM2UINT(stack_id);
+  if (current_stack_id >= table->stacks_len) {
+    rb_raise(rb_eIndexError, "invalid stack id %u", current_stack_id);
+  }
+
+  VALUE frame_ids = rb_ary_new_capa(table->stacks[current_stack_id].depth);
+  while (current_stack_id != BACKTRACIE_EMPTY_STACK_ID) {
+    const stack_node_t *node = &table->stacks[current_stack_id];
+    rb_ary_push(frame_ids, UINT2NUM(node->frame_id));
+    current_stack_id = node->parent_stack_id;
+  }
+  return frame_ids;
+}
+
+static VALUE stack_table_frame_qualified_method_name(VALUE self,
+                                                     VALUE frame_id) {
+  return backtracie_name_cache_lookup_value(
+      backtracie_stack_table_frame(self, NUM2UINT(frame_id)));
+}
+
+static VALUE stack_table_frame_lineno(VALUE self, VALUE frame_id) {
+  return UINT2NUM(
+      backtracie_stack_table_frame(self, NUM2UINT(frame_id))->line_number);
+}
+
+static VALUE stack_table_frame_count(VALUE self) {
+  return UINT2NUM(backtracie_stack_table_frame_count(self));
+}
+
+static VALUE stack_table_stack_count(VALUE self) {
+  return UINT2NUM(backtracie_stack_table_stack_count(self));
+}
+
+typedef struct {
+  uint32_t *stack_ids;
+  uint64_t *counts;
+  size_t len;
+} collected_samples_t;
+
+// Writes a hash of stack id => sample count (such as the one returned by
+// Backtracie::Sampler#samples) to output; see
+// backtracie_stack_table_write_collapsed
+static VALUE stack_table_write_collapsed(VALUE self, VALUE samples,
+                                         VALUE output) {
+  Check_Type(samples, T_HASH);
+  long len = RHASH_SIZE(samples);
+  VALUE stack_ids_buffer, counts_buffer;
+  collected_samples_t collected = {
+      .stack_ids = ALLOCV_N(uint32_t, stack_ids_buffer, len),
+      .counts = ALLOCV_N(uint64_t, counts_buffer, len),
+      .len = 0,
+  };
+
+  rb_hash_foreach(samples, collect_sample, (VALUE)&collected);
+  size_t bytes_written = backtracie_stack_table_write_collapsed(
+      self, collected.stack_ids, collected.counts, collected.len, output);
+
+  ALLOCV_END(stack_ids_buffer);
+  ALLOCV_END(counts_buffer);
+  return SIZET2NUM(bytes_written);
+}
+
+// Like write_collapsed, but writes a pprof profile instead; accepts a
+// gzip: true keyword argument to compress it. See
+// backtracie_stack_table_write_pprof
+static VALUE stack_table_write_pprof(int argc, VALUE *argv, VALUE self) {
+  VALUE samples, output, options;
+  rb_scan_args(argc, argv, "2:", &samples, &output, &options);
+
+  Check_Type(samples, T_HASH);
+  long len = RHASH_SIZE(samples);
+  VALUE stack_ids_buffer, counts_buffer;
+  collected_samples_t collected = {
+      .stack_ids = ALLOCV_N(uint32_t, stack_ids_buffer, len),
+      .counts = ALLOCV_N(uint64_t, counts_buffer, len),
+      .len = 0,
+  };
+
+  rb_hash_foreach(samples, collect_sample, (VALUE)&collected);
+  VALUE bytes_written = backtracie_write_pprof_with_options(
+      self, collected.stack_ids, collected.counts, collected.len, 0, output,
+      options);
+
+  ALLOCV_END(stack_ids_buffer);
+  ALLOCV_END(counts_buffer);
+  return bytes_written;
+}
+
+static int collect_sample(VALUE stack_id, VALUE count, VALUE ptr) {
+  collected_samples_t *collected = (collected_samples_t *)ptr;
+  collected->stack_ids[collected->len] = NUM2UINT(stack_id);
+  collected->counts[collected->len] = NUM2ULL(count);
+  check_not_negative(stack_id, "stack id");
+  check_not_negative(count, "sample count");
+  collected->len++;
+  return ST_CONTINUE;
+}
+
+// NUM2UINT and NUM2ULL accept negative numbers, wrapping them around
+static void check_not_negative(VALUE value, const char *what) {
+  if (RTEST(rb_funcall(value, negative_p_id, 0))) {
+    rb_raise(rb_eArgError, "negative %s (%" PRIsVALUE ")", what, value);
+  }
+}
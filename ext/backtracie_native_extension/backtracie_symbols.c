@@ -0,0 +1,338 @@
+// backtracie: Ruby gem for beautiful backtraces
+// Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+//
+// This file is part of backtracie.
+//
+// backtracie is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// backtracie is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+// This file implements the first phase of exporting stacks: taking a snapshot
+// of everything the exporters need from a stack table, while holding the GVL.
+//
+// The snapshot only covers the stacks being exported. For each of their frames,
+// it keeps its line number, its qualified method name and its filename; the
+// latter two are interned by the Ruby objects they come from (the method
+// qualifier and method name, or the filename String), rather than by their
+// contents, so that looking them up doesn't need to look at the strings
+// themselves. Nothing here allocates Ruby objects, so these can't move while
+// the snapshot is being taken.
+
+#include "extconf.h"
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backtracie_private.h"
+#include "public/backtracie.h"
+#include "strbuilder.h"
+
+// Used as the key_bits of filenames in the interning table, as it doesn't fit
+// in the 16 bits used by actual name keys
+#define FILENAME_KEY_BITS UINT32_MAX
+
+typedef struct {
+  uint32_t key_bits;
+  VALUE method_qualifier;
+  uintptr_t method_name;
+  uint32_t string;
+} intern_entry_t;
+
+typedef struct {
+  VALUE table;
+  const uint32_t *stack_ids;
+  const uint64_t *counts;
+  size_t len;
+  backtracie_symbols_t *symbols;
+  bool done;
+
+  // All of the snapshot's strings get built one after the other in this arena,
+  // which becomes symbols->strings once done
+  strbuilder_t strings;
+  uint32_t string_offsets_capa;
+
+  // Frames of the snapshot that still need symbolizing
+  uint32_t *pending_frames;
+  uint32_t pending_frames_len;
+
+  // Open addressing hash table of intern_entry_t, with each slot containing
+  // the entry's index + 1, so that 0 can mean "empty slot"
+  intern_entry_t *entries;
+  uint32_t entries_len;
+  uint32_t entries_capa;
+  uint32_t *slots;
+  uint32_t slots_capa;
+} symbolize_state_t;
+
+static VALUE symbolize_body(VALUE ptr);
+static VALUE symbolize_cleanup(VALUE ptr);
+static void add_stack(symbolize_state_t *state, uint32_t stack_id);
+static void symbolize_frame(symbolize_state_t *state, uint32_t frame_id);
+static uint32_t intern(symbolize_state_t *state, uint32_t key_bits,
+                       VALUE method_qualifier, uintptr_t method_name,
+                       const minimal_location_t *loc);
+static uint32_t end_string(symbolize_state_t *state);
+static uint64_t intern_hash(uint32_t key_bits, VALUE method_qualifier,
+                            uintptr_t method_name);
+static void grow_slots(symbolize_state_t *state);
+static void *checked_realloc(void *ptr, size_t size);
+static void *checked_calloc(size_t count, size_t size);
+
+backtracie_symbols_t *
+backtracie_stack_table_symbolize(VALUE table, const uint32_t *stack_ids,
+                                 const uint64_t *counts, size_t len) {
+  uint32_t stack_count = backtracie_stack_table_stack_count(table);
+  for (size_t i = 0; i < len; i++) {
+    if ((counts == NULL || counts[i] != 0) && stack_ids[i] >= stack_count) {
+      rb_raise(rb_eIndexError, "invalid stack id %u", stack_ids[i]);
+    }
+  }
+
+  symbolize_state_t state = {
+      .table = table,
+      .stack_ids = stack_ids,
+      .counts = counts,
+      .len = len,
+  };
+  strbuilder_init_growable(&state.strings, 4096);
+  rb_ensure(symbolize_body, (VALUE)&state, symbolize_cleanup, (VALUE)&state);
+  return state.symbols;
+}
+
+void backtracie_symbols_free(backtracie_symbols_t *symbols) {
+  if (symbols == NULL) {
+    return;
+  }
+  free(symbols->stack_frames);
+  free(symbols->stack_parents);
+  free(symbols->stack_depths);
+  free(symbols->frame_names);
+  free(symbols->frame_filenames);
+  free(symbols->frame_line_numbers);
+  free(symbols->strings);
+  free(symbols->string_offsets);
+  free(symbols);
+}
+
+static VALUE symbolize_body(VALUE ptr) {
+  symbolize_state_t *state = (symbolize_state_t *)ptr;
+
+  backtracie_symbols_t *symbols =
+      checked_calloc(1, sizeof(backtracie_symbols_t));
+  state->symbols = symbols;
+  symbols->stack_count = backtracie_stack_table_stack_count(state->table);
+  symbols->frame_count = backtracie_stack_table_frame_count(state->table);
+  // calloc'd memory only gets paged in once it's touched, so these are cheap
+  // even when exporting only a few stacks out of a big table
+  symbols->stack_frames =
+      checked_calloc(symbols->stack_count, sizeof(uint32_t));
+  symbols->stack_parents =
+      checked_calloc(symbols->stack_count, sizeof(uint32_t));
+  symbols->stack_depths =
+      checked_calloc(symbols->stack_count, sizeof(uint32_t));
+  symbols->frame_names = checked_calloc(symbols->frame_count, sizeof(uint32_t));
+  symbols->frame_filenames =
+      checked_calloc(symbols->frame_count, sizeof(uint32_t));
+  symbols->frame_line_numbers =
+      checked_calloc(symbols->frame_count, sizeof(uint32_t));
+  state->pending_frames =
+      checked_calloc(symbols->frame_count, sizeof(uint32_t));
+
+  symbols->string_offsets = checked_realloc(NULL, sizeof(size_t) * 256);
+  state->string_offsets_capa = 256;
+  symbols->string_offsets[0] = 0;
+  end_string(state);
+
+  for (size_t i = 0; i < state->len; i++) {
+    if (state->counts == NULL || state->counts[i] != 0) {
+      add_stack(state, state->stack_ids[i]);
+    }
+  }
+  for (uint32_t i = 0; i < state->pending_frames_len; i++) {
+    symbolize_frame(state, state->pending_frames[i]);
+  }
+
+  symbols->strings = state->strings.original_buf;
+  state->done = true;
+  return Qnil;
+}
+
+static VALUE symbolize_cleanup(VALUE ptr) {
+  symbolize_state_t *state = (symbolize_state_t *)ptr;
+  free(state->pending_frames);
+  free(state->entries);
+  free(state->slots);
+  if (!state->done) {
+    strbuilder_free_growable(&state->strings);
+    backtracie_symbols_free(state->symbols);
+    state->symbols = NULL;
+  }
+  return Qnil;
+}
+
+// Copies the given stack, and the ones it's built on, into the snapshot, and
+// queues up their frames for symbolizing
+static void add_stack(symbolize_state_t *state, uint32_t stack_id) {
+  backtracie_symbols_t *symbols = state->symbols;
+  // Stacks share their prefixes, so we can stop as soon as we get to one
+  // that's already there
+  while (stack_id != BACKTRACIE_EMPTY_STACK_ID &&
+         symbols->stack_depths[stack_id] == 0) {
+    uint32_t frame_id =
+        backtracie_stack_table_stack_frame(state->table, stack_id);
+    uint32_t parent_id =
+        backtracie_stack_table_stack_parent(state->table, stack_id);
+    symbols->stack_frames[stack_id] = frame_id;
+    symbols->stack_parents[stack_id] = parent_id;
+    symbols->stack_depths[stack_id] =
+        backtracie_stack_table_stack_depth(state->table, stack_id);
+
+    // Names are never string 0, so that doubles as "not queued up yet"
+    if (symbols->frame_names[frame_id] == 0) {
+      symbols->frame_names[frame_id] = UINT32_MAX;
+      state->pending_frames[state->pending_frames_len++] = frame_id;
+    }
+    stack_id = parent_id;
+  }
+}
+
+static void symbolize_frame(symbolize_state_t *state, uint32_t frame_id) {
+  backtracie_symbols_t *symbols = state->symbols;
+  const minimal_location_t *loc =
+      backtracie_stack_table_frame(state->table, frame_id);
+
+  symbols->frame_line_numbers[frame_id] = loc->line_number;
+  symbols->frame_filenames[frame_id] =
+      RTEST(loc->filename)
+          ? intern(state, FILENAME_KEY_BITS, loc->filename, 0, NULL)
+          : 0;
+
+  backtracie_name_key_t key;
+  backtracie_name_key(loc, &key);
+  symbols->frame_names[frame_id] = intern(
+      state, key.key_bits, key.method_qualifier, key.method_name, loc);
+}
+
+// Returns the string for the given key, adding it if needed: the filename of
+// method_qualifier if key_bits is FILENAME_KEY_BITS, or the qualified method
+// name of loc otherwise
+static uint32_t intern(symbolize_state_t *state, uint32_t key_bits,
+                       VALUE method_qualifier, uintptr_t method_name,
+                       const minimal_location_t *loc) {
+  // Keep the table at most half full
+  if ((state->entries_len + 1) * 2 > state->slots_capa) {
+    grow_slots(state);
+  }
+
+  uint32_t mask = state->slots_capa - 1;
+  uint32_t slot = intern_hash(key_bits, method_qualifier, method_name) & mask;
+  while (state->slots[slot] != 0) {
+    const intern_entry_t *entry = &state->entries[state->slots[slot] - 1];
+    if (entry->key_bits == key_bits &&
+        entry->method_qualifier == method_qualifier &&
+        entry->method_name == method_name) {
+      return entry->string;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  if (key_bits == FILENAME_KEY_BITS) {
+    strbuilder_append_value(&state->strings, method_qualifier);
+  } else {
+    size_t len;
+    const char *name = backtracie_name_cache_lookup(loc, &len);
+    strbuilder_append_len(&state->strings, name, len);
+  }
+  uint32_t string = end_string(state);
+
+  if (state->entries_len == state->entries_capa) {
+    state->entries_capa =
+        state->entries_capa == 0 ? 256 : state->entries_capa * 2;
+    state->entries = checked_realloc(
+        state->entries, sizeof(intern_entry_t) * state->entries_capa);
+  }
+  state->entries[state->entries_len] = (intern_entry_t){
+      .key_bits = key_bits,
+      .method_qualifier = method_qualifier,
+      .method_name = method_name,
+      .string = string,
+  };
+  state->slots[slot] = ++state->entries_len;
+  return string;
+}
+
+// Ends the string being built in the arena, and returns its index
+static uint32_t end_string(symbolize_state_t *state) {
+  backtracie_symbols_t *symbols = state->symbols;
+
+  if (symbols->string_count + 2 > state->string_offsets_capa) {
+    state->string_offsets_capa *= 2;
+    symbols->string_offsets = checked_realloc(
+        symbols->string_offsets, sizeof(size_t) * state->string_offsets_capa);
+  }
+
+  uint32_t index = symbols->string_count++;
+  symbols->string_offsets[index + 1] = strbuilder_arena_next(&state->strings);
+  if (state->strings.out_of_memory) {
+    rb_memerror();
+  }
+  return index;
+}
+
+static uint64_t intern_hash(uint32_t key_bits, VALUE method_qualifier,
+                            uintptr_t method_name) {
+  uint64_t hash = (uint64_t)method_qualifier * 0x9E3779B97F4A7C15ULL;
+  hash ^= (uint64_t)method_name + 0x632BE59BD9B4E019ULL + (hash << 6) +
+          (hash >> 2);
+  hash ^= key_bits;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static void grow_slots(symbolize_state_t *state) {
+  uint32_t new_capa = state->slots_capa == 0 ? 512 : state->slots_capa * 2;
+  uint32_t *new_slots = checked_calloc(new_capa, sizeof(uint32_t));
+  for (uint32_t index = 0; index < state->entries_len; index++) {
+    const intern_entry_t *entry = &state->entries[index];
+    uint32_t slot = intern_hash(entry->key_bits, entry->method_qualifier,
+                                entry->method_name) &
+                    (new_capa - 1);
+    while (new_slots[slot] != 0) {
+      slot = (slot + 1) & (new_capa - 1);
+    }
+    new_slots[slot] = index + 1;
+  }
+  free(state->slots);
+  state->slots = new_slots;
+  state->slots_capa = new_capa;
+}
+
+static void *checked_realloc(void *ptr, size_t size) {
+  void *result = realloc(ptr, size);
+  if (result == NULL) {
+    rb_memerror();
+  }
+  return result;
+}
+
+static void *checked_calloc(size_t count, size_t size) {
+  // calloc(0, ...) may return NULL
+  void *result = calloc(count > 0 ? count : 1, size);
+  if (result == NULL) {
+    rb_memerror();
+  }
+  return result;
+}
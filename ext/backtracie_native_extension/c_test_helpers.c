@@ -1,8 +1,11 @@
 #include "backtracie_private.h"
 #include "public/backtracie.h"
 
+#include <pthread.h>
 #include <ruby.h>
 #include <ruby/thread.h>
+#include <stdlib.h>
+#include <string.h>
 
 static VALUE backtracie_backtrace_from_thread(VALUE self);
 static VALUE backtracie_backtrace_from_thread_cthread(void *ctx);
@@ -10,6 +13,36 @@ static VALUE stdlib_backtrace_from_thread(VALUE self);
 static VALUE stdlib_backtrace_from_thread_cthread(void *ctx);
 static VALUE backtracie_backtrace_from_empty_thread(VALUE self);
 static VALUE backtracie_backtrace_from_empty_thread_cthread(void *ctx);
+static VALUE frame_names_from_single_captures(VALUE self, VALUE thread);
+static VALUE frame_names_from_bulk_capture(VALUE self, VALUE thread,
+                                           VALUE start, VALUE max);
+static VALUE frame_names_without_name_cache(VALUE self, VALUE thread);
+static VALUE drain_sample_ring_from_native_thread(VALUE self, VALUE ring);
+static void *drain_sample_ring_without_gvl(void *ptr);
+static void *drain_sample_ring(void *ptr);
+static VALUE write_collapsed_from_native_thread(VALUE self, VALUE table,
+                                                VALUE stack_id, VALUE count);
+static void *write_collapsed_without_gvl(void *ptr);
+static void *write_collapsed(void *ptr);
+static int append_output(void *ptr, const char *buf, size_t len);
+static VALUE strbuilder_rstring_from_parts(VALUE self, VALUE parts,
+                                           VALUE capa);
+
+typedef struct {
+  VALUE ring;
+  uint64_t samples;
+  uint64_t frames;
+  uint64_t value_sum;
+} sample_ring_drain_t;
+
+typedef struct {
+  backtracie_symbols_t *symbols;
+  uint32_t stack_id;
+  uint64_t count;
+  int result;
+  char *output;
+  size_t output_len;
+} collapsed_write_t;
 
 void backtracie_init_c_test_helpers(VALUE backtracie_module) {
   VALUE test_helpers_mod =
@@ -22,6 +55,22 @@ void backtracie_init_c_test_helpers(VALUE backtracie_module) {
   rb_define_singleton_method(test_helpers_mod,
                              "backtracie_backtrace_from_empty_thread",
                              backtracie_backtrace_from_empty_thread, 0);
+  rb_define_singleton_method(test_helpers_mod,
+                             "frame_names_from_single_captures",
+                             frame_names_from_single_captures, 1);
+  rb_define_singleton_method(test_helpers_mod, "frame_names_from_bulk_capture",
+                             frame_names_from_bulk_capture, 3);
+  rb_define_singleton_method(test_helpers_mod,
+                             "frame_names_without_name_cache",
+                             frame_names_without_name_cache, 1);
+  rb_define_singleton_method(test_helpers_mod,
+                             "drain_sample_ring_from_native_thread",
+                             drain_sample_ring_from_native_thread, 1);
+  rb_define_singleton_method(test_helpers_mod,
+                             "write_collapsed_from_native_thread",
+                             write_collapsed_from_native_thread, 3);
+  rb_define_singleton_method(test_helpers_mod, "strbuilder_rstring_from_parts",
+                             strbuilder_rstring_from_parts, 2);
 }
 
 static VALUE backtracie_backtrace_from_thread(VALUE self) {
@@ -60,3 +109,149 @@ static VALUE backtracie_backtrace_from_empty_thread_cthread(void *ctx) {
   rb_thread_sleep(-1);
   return Qnil;
 }
+
+static VALUE frame_names_from_single_captures(VALUE self, VALUE thread) {
+  VALUE names = rb_ary_new();
+  int frame_count = backtracie_frame_count_for_thread(thread);
+  for (int i = 0; i < frame_count; i++) {
+    raw_location loc;
+    if (backtracie_capture_frame_for_thread(thread, i, &loc)) {
+      rb_ary_push(names, backtracie_frame_name_rbstr(&loc));
+    }
+  }
+  return names;
+}
+
+static VALUE frame_names_from_bulk_capture(VALUE self, VALUE thread,
+                                           VALUE start, VALUE max) {
+  VALUE frame_wrapper = backtracie_frame_wrapper_new(NUM2INT(max));
+  raw_location *frames = backtracie_frame_wrapper_frames(frame_wrapper);
+  int *frames_len = backtracie_frame_wrapper_len(frame_wrapper);
+  backtracie_capture_frames_for_thread(thread, NUM2INT(start), NUM2INT(max),
+                                       frames, frames_len);
+
+  VALUE names = rb_ary_new_capa(*frames_len);
+  for (int i = 0; i < *frames_len; i++) {
+    rb_ary_push(names, backtracie_frame_name_rbstr(&frames[i]));
+  }
+  RB_GC_GUARD(frame_wrapper);
+  return names;
+}
+
+// Like frame_names_from_single_captures, but renders each name from scratch
+// straight into a String, starting out with a tiny one so it has to grow
+static VALUE frame_names_without_name_cache(VALUE self, VALUE thread) {
+  VALUE names = rb_ary_new();
+  int frame_count = backtracie_frame_count_for_thread(thread);
+  for (int i = 0; i < frame_count; i++) {
+    raw_location raw_loc;
+    if (backtracie_capture_frame_for_thread(thread, i, &raw_loc)) {
+      minimal_location_t loc;
+      backtracie_raw_location_to_minimal_location(&raw_loc, &loc);
+      strbuilder_t builder;
+      strbuilder_init_rstring(&builder, 1);
+      backtracie_anonymous_modules_t anonymous_modules = {.count = 0};
+      backtracie_minimal_frame_render_name(&loc, &builder, &anonymous_modules);
+      rb_ary_push(names, strbuilder_finish_rstring(&builder));
+    }
+  }
+  return names;
+}
+
+// Drains the given ring from a separate native thread, while the current
+// thread waits without the GVL. Returns [samples, frames, sum of values].
+static VALUE drain_sample_ring_from_native_thread(VALUE self, VALUE ring) {
+  sample_ring_drain_t drain = {.ring = ring};
+  rb_thread_call_without_gvl(drain_sample_ring_without_gvl, &drain, NULL,
+                             NULL);
+  RB_GC_GUARD(ring);
+  return rb_ary_new_from_args(3, ULL2NUM(drain.samples),
+                              ULL2NUM(drain.frames),
+                              ULL2NUM(drain.value_sum));
+}
+
+static void *drain_sample_ring_without_gvl(void *ptr) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, drain_sample_ring, ptr) == 0) {
+    pthread_join(thread, NULL);
+  }
+  return NULL;
+}
+
+static void *drain_sample_ring(void *ptr) {
+  sample_ring_drain_t *drain = (sample_ring_drain_t *)ptr;
+  backtracie_ring_sample_t samples[16];
+  uint32_t count;
+  while ((count = backtracie_sample_ring_peek(drain->ring, samples, 16)) > 0) {
+    for (uint32_t i = 0; i < count; i++) {
+      drain->samples++;
+      drain->frames += samples[i].frames_len;
+      drain->value_sum += samples[i].value;
+    }
+    backtracie_sample_ring_consume(drain->ring, count);
+  }
+  return NULL;
+}
+
+// Snapshots the given stack of the table, and then writes it in collapsed
+// format from a separate native thread, while the current thread waits without
+// the GVL. Returns the output.
+static VALUE write_collapsed_from_native_thread(VALUE self, VALUE table,
+                                                VALUE stack_id, VALUE count) {
+  uint32_t stack_ids[1] = {NUM2UINT(stack_id)};
+  uint64_t counts[1] = {NUM2ULL(count)};
+  collapsed_write_t write = {
+      .symbols = backtracie_stack_table_symbolize(table, stack_ids, counts, 1),
+      .stack_id = stack_ids[0],
+      .count = counts[0],
+  };
+  rb_thread_call_without_gvl(write_collapsed_without_gvl, &write, NULL, NULL);
+  backtracie_symbols_free(write.symbols);
+
+  VALUE output = write.result == 0 ? rb_str_new(write.output, write.output_len)
+                                   : Qnil;
+  free(write.output);
+  return output;
+}
+
+static void *write_collapsed_without_gvl(void *ptr) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, write_collapsed, ptr) == 0) {
+    pthread_join(thread, NULL);
+  }
+  return NULL;
+}
+
+static void *write_collapsed(void *ptr) {
+  collapsed_write_t *write = (collapsed_write_t *)ptr;
+  size_t bytes_written;
+  write->result = backtracie_symbols_write_collapsed(
+      write->symbols, &write->stack_id, &write->count, 1, append_output, write,
+      &bytes_written);
+  return NULL;
+}
+
+static int append_output(void *ptr, const char *buf, size_t len) {
+  collapsed_write_t *write = (collapsed_write_t *)ptr;
+  char *output = realloc(write->output, write->output_len + len);
+  if (output == NULL) {
+    return -1;
+  }
+  memcpy(output + write->output_len, buf, len);
+  write->output = output;
+  write->output_len += len;
+  return 0;
+}
+
+// Appends every String in parts to a strbuilder building straight into a
+// String that starts out with room for capa bytes, and returns that String
+static VALUE strbuilder_rstring_from_parts(VALUE self, VALUE parts,
+                                           VALUE capa) {
+  Check_Type(parts, T_ARRAY);
+  strbuilder_t builder;
+  strbuilder_init_rstring(&builder, NUM2SIZET(capa));
+  for (long i = 0; i < RARRAY_LEN(parts); i++) {
+    strbuilder_append_value(&builder, RARRAY_AREF(parts, i));
+  }
+  return strbuilder_finish_rstring(&builder);
+}
@@ -44,8 +44,22 @@ $CFLAGS << ' ' << '-std=gnu99' if RUBY_VERSION < '2.4'
 
 $CFLAGS << ' ' << '-DPRE_RB_ISEQ_TYPE' if RUBY_VERSION < '3.2'
 
+# Ruby 3.2 stopped keeping the attached object of singleton classes in their
+# instance variable table, and added the GVL instrumentation API
+if RUBY_VERSION < '3.2'
+  $CFLAGS << ' ' << '-DPRE_RB_CLASS_ATTACHED_OBJECT'
+  $CFLAGS << ' ' << '-DPRE_THREAD_EVENT_HOOKS'
+end
+
 $CFLAGS << ' ' << '-DPRE_GC_MARK_MOVABLE' if RUBY_VERSION < '2.7'
 
+# Ruby 3.0 made the current execution context thread-local (and introduced ractors), and added a public API for
+# deduplicated frozen strings (rb_interned_str and friends)
+if RUBY_VERSION < '3.0'
+  $CFLAGS << ' ' << '-DPRE_RACTOR'
+  $CFLAGS << ' ' << '-DPRE_INTERNED_STR'
+end
+
 # Older Rubies don't have the MJIT header, see below for details
 $defs << '-DPRE_MJIT_RUBY' if RUBY_VERSION < '2.6'
 
@@ -59,6 +73,9 @@ if RUBY_VERSION < '2.4'
   $CFLAGS << ' ' << '-DPRE_VM_ENV_RENAMES' # Flag that it's a really old Ruby, and a few constants were since renamed
 end
 
+# Lets the sampler's timer thread wait on CLOCK_MONOTONIC (not available on macOS, which keeps using the wall clock)
+have_func('pthread_condattr_setclock', 'pthread.h')
+
 $CFLAGS << ' ' << '-DBACKTRACIE_EXPORTS'
 append_cflags ['-fvisibility=hidden']
 create_header
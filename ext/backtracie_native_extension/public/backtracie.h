@@ -104,6 +104,35 @@ BACKTRACIE_API int backtracie_frame_count_for_thread(VALUE thread);
 BACKTRACIE_API
 bool backtracie_capture_frame_for_thread(VALUE thread, int frame_index,
                                          raw_location *loc);
+// Captures the frames of the Ruby call stack of the given thread in one pass.
+// This is equivalent to (but cheaper than) calling
+// backtracie_capture_frame_for_thread() for every index and keeping only the
+// valid frames:
+//   - the first start valid frames (counting from the most recently called
+//     one) are skipped,
+//   - at most max valid frames are written to out, which must have room for
+//     at least max raw_locations,
+//   - *out_len is set to the number of frames written.
+// Passing backtracie_frame_count_for_thread(thread) as max is always enough to
+// capture the whole stack.
+//
+// Returns false (and sets *out_len to zero) if the thread is not alive, and
+// true otherwise.
+BACKTRACIE_API
+bool backtracie_capture_frames_for_thread(VALUE thread, int start, int max,
+                                          raw_location *out, int *out_len);
+// Like backtracie_frame_count_for_thread and
+// backtracie_capture_frames_for_thread, but for the stack of the given Fiber,
+// which can be suspended (or even running on another thread). Fibers that
+// haven't been started yet, or have already finished, have no frames, and
+// backtracie_capture_frames_for_fiber returns false for them.
+//
+// Raises an ArgumentError if the given object is not a Fiber. Fibers are not
+// supported on Ruby < 2.5, where these always return 0 and false.
+BACKTRACIE_API int backtracie_frame_count_for_fiber(VALUE fiber);
+BACKTRACIE_API
+bool backtracie_capture_frames_for_fiber(VALUE fiber, int start, int max,
+                                         raw_location *out, int *out_len);
 // Get the "qualified method name" for the frame. This is a string that best
 // describes what method is being called, intended for human interpretation.
 // Writes a NULL-term'd string of at most buflen chars (including NULL
@@ -176,6 +205,78 @@ raw_location *backtracie_frame_wrapper_frames(VALUE wrapper);
 // contained list of frames (up to capa)
 BACKTRACIE_API
 int *backtracie_frame_wrapper_len(VALUE wrapper);
+// Returns how many frames the wrapper has room for
+BACKTRACIE_API
+size_t backtracie_frame_wrapper_capa(VALUE wrapper);
+// Sets the len of the wrapper to zero, so that it no longer marks the frames it
+// contains, but keeps its memory around for reuse
+BACKTRACIE_API
+void backtracie_frame_wrapper_clear(VALUE wrapper);
+// Grows the wrapper so that it has room for at least capa frames, keeping the
+// frames it already contains. Capacity grows geometrically, so reserving a
+// slightly larger capa each time is cheap. Note that this may move the frames,
+// so any pointer previously returned by backtracie_frame_wrapper_frames must
+// not be used afterwards.
+BACKTRACIE_API
+void backtracie_frame_wrapper_reserve(VALUE wrapper, size_t capa);
+
+// Where the frames of each thread captured by backtracie_capture_all_threads
+// ended up in the frame wrapper
+typedef struct {
+  VALUE thread;
+  // Index of the thread's first (most recently called) frame in the wrapper
+  int frames_start;
+  int frames_len;
+} backtracie_thread_stack_t;
+
+// Captures the stacks of all live threads in a single pass over the VM's
+// thread list, appending all of their frames to the given frame wrapper (which
+// grows as needed), and describing where each thread's frames ended up in
+// out, which must have room for capa entries. Threads beyond the first capa
+// are counted, but not captured; so calling this with a capa of zero is a
+// cheap way of getting the number of threads.
+//
+// Returns the number of live threads. As long as the GVL is not released in
+// between, calling this again returns the same threads, in the same order
+// (which is the same as Thread.list).
+//
+// Only threads of the main Ractor are captured. The threads in out are kept
+// alive by the VM for as long as they are live, but need to be marked if they
+// are to be kept around for longer than that.
+BACKTRACIE_API
+int backtracie_capture_all_threads(VALUE frame_wrapper,
+                                   backtracie_thread_stack_t *out, int capa);
+
+// Where the frames of each fiber captured by
+// backtracie_capture_all_fibers_for_thread ended up in the frame wrapper
+typedef struct {
+  VALUE fiber;
+  // Index of the fiber's first (most recently called) frame in the wrapper
+  int frames_start;
+  int frames_len;
+} backtracie_fiber_stack_t;
+
+// Like backtracie_capture_all_threads, but captures all of the fibers that
+// belong to the given thread and have a stack (i.e. that were started and have
+// not finished yet), including the one the thread is currently running,
+// without resuming any of them. Returns the number of such fibers.
+//
+// Ruby doesn't keep a list of the fibers of a thread, so this needs to go
+// through the whole Ruby heap, with the GC disabled while it does so; the cost
+// is proportional to the size of the heap, not to the number of fibers. So
+// that the heap only needs to be walked once, rather than once to count the
+// fibers and once more to capture them, *out (which may start out as NULL,
+// with a *capa of 0) gets grown with xrealloc as needed, and *capa updated;
+// the caller must xfree it, even if this raises.
+// Ruby only creates the Fiber object for a thread's root fiber when it's asked
+// for (e.g. by Fiber.current), so until then, the root fiber won't be found.
+// The order of the fibers is not meaningful. Note that fibers that are not
+// referenced by anything else may be freed by the next GC, so the fibers in out
+// need to be marked (or the GC kept disabled) for as long as they are used.
+BACKTRACIE_API
+int backtracie_capture_all_fibers_for_thread(VALUE thread, VALUE frame_wrapper,
+                                             backtracie_fiber_stack_t **out,
+                                             int *capa);
 
 // ========= "Minimal" API ========
 // This part of the API defines a "minimal" version of raw_location, called
@@ -265,4 +366,278 @@ size_t backtracie_minimal_frame_name_cstr(const minimal_location_t *loc,
 BACKTRACIE_API
 size_t backtracie_minimal_frame_filename_cstr(const minimal_location_t *loc,
                                               char *buf, size_t buflen);
+
+// Like backtracie_frame_mark & co., but for a minimal_location_t. These take
+// care of working out which union members hold VALUEs, so callers need not
+// look at method_name_contents or method_qualifier_contents themselves.
+BACKTRACIE_API
+void backtracie_minimal_frame_mark(const minimal_location_t *loc);
+BACKTRACIE_API
+void backtracie_minimal_frame_mark_movable(const minimal_location_t *loc);
+BACKTRACIE_API
+void backtracie_minimal_frame_compact(minimal_location_t *loc);
+
+// Like backtracie_frame_wrapper_new & co., but for an array of
+// minimal_location_t. The wrapper marks (and updates, when compacting) the
+// frames it contains, which does not keep their iseqs alive; this makes it a
+// good fit for keeping lots of frames around. The same RB_GC_GUARD() caveat as
+// for backtracie_frame_wrapper_new applies.
+BACKTRACIE_API
+VALUE backtracie_minimal_frame_wrapper_new(size_t capa);
+BACKTRACIE_API
+minimal_location_t *backtracie_minimal_frame_wrapper_frames(VALUE wrapper);
+BACKTRACIE_API
+int *backtracie_minimal_frame_wrapper_len(VALUE wrapper);
+
+// ========= Fingerprint API ========
+// A fingerprint is a 64-bit hash identifying a stack, e.g. for grouping errors
+// that happened in the same place. It's built (using FNV-1a) from the qualified
+// method name and absolute path of each frame, in order, and optionally from
+// their line numbers; none of these include addresses, so the same code
+// running on the same Ruby version gets the same fingerprint in every process.
+//
+// Computing a fingerprint needs the GVL, but doesn't allocate any Ruby
+// objects: names don't get rendered again for frames seen before, as each
+// frame's hash is cached along with its qualified method name.
+
+// Returns the fingerprint of the given frames. Line numbers are only included
+// if include_line_numbers is true.
+BACKTRACIE_API
+uint64_t backtracie_frames_fingerprint(const raw_location *frames,
+                                       int frames_len,
+                                       bool include_line_numbers);
+// Like backtracie_frames_fingerprint, but for an array of minimal_location_t;
+// the same frames get the same fingerprint either way
+BACKTRACIE_API
+uint64_t backtracie_minimal_frames_fingerprint(const minimal_location_t *frames,
+                                               int frames_len,
+                                               bool include_line_numbers);
+
+// ========= Stack table API ========
+// A stack table interns frames and stacks, giving each unique one a small
+// integer ID. This is meant for keeping lots of samples around: a sample need
+// only store the ID of its stack, and identical stacks share the same ID.
+//
+// Stacks are stored as a prefix trie rooted at the outermost frame; each stack
+// is identified by its innermost frame and the stack of its caller (its
+// "parent"), so stacks with a common prefix share storage too. The empty stack
+// always has ID BACKTRACIE_EMPTY_STACK_ID.
+//
+// Frames are interned by the contents of their minimal_location_t (see above).
+//
+// The stack table is a Ruby object which marks (and updates, when compacting)
+// the VALUEs in the frames it contains, so you only need to keep the table
+// itself alive. IDs are never reused for as long as the table is alive.
+// Interning doesn't allocate any Ruby objects. It can raise NoMemoryError (or
+// RuntimeError, if the table is full), except for the functions with "try" in
+// their names.
+#define BACKTRACIE_EMPTY_STACK_ID 0u
+
+// Returns a new, empty, Backtracie::StackTable.
+BACKTRACIE_API
+VALUE backtracie_stack_table_new(void);
+// Returns the frame ID of the given frame, adding it to the table if needed.
+BACKTRACIE_API
+uint32_t backtracie_stack_table_intern_frame(VALUE table,
+                                             const minimal_location_t *loc);
+// Returns the stack ID of the given stack, adding it to the table if needed.
+// As with backtracie_capture_frames_for_thread, frames[0] is the innermost
+// (most recently called) frame.
+BACKTRACIE_API
+uint32_t backtracie_stack_table_intern_stack(VALUE table,
+                                             const minimal_location_t *frames,
+                                             int len);
+// Like backtracie_stack_table_intern_stack, but never raises: returns false
+// (leaving *stack_id untouched) if the stack can't be added to the table, as
+// it's out of memory, or full. See backtracie_try_capture_stack_for_thread.
+BACKTRACIE_API
+bool backtracie_stack_table_try_intern_stack(VALUE table,
+                                             const minimal_location_t *frames,
+                                             int len, uint32_t *stack_id);
+// Captures the Ruby call stack of the given thread and interns it into the
+// table, writing its stack ID to *stack_id. This is the stack table
+// counterpart of backtracie_capture_frames_for_thread.
+//
+// If max_depth is greater than zero, only the max_depth most recently called
+// frames are captured (and the rest of the stack is not walked); otherwise,
+// the whole stack is.
+//
+// Returns false (leaving *stack_id untouched) if the thread is not alive, and
+// true otherwise.
+BACKTRACIE_API
+bool backtracie_capture_stack_for_thread(VALUE table, VALUE thread,
+                                         int max_depth, uint32_t *stack_id);
+// Like backtracie_capture_stack_for_thread, but never raises: if the stack
+// can't be added to the table (as it's out of memory, or full), this returns
+// false too. This is meant for places where raising is not an option, such as
+// event hooks and postponed jobs, which should drop the sample instead.
+BACKTRACIE_API
+bool backtracie_try_capture_stack_for_thread(VALUE table, VALUE thread,
+                                             int max_depth,
+                                             uint32_t *stack_id);
+// Returns the frame with the given ID. The returned pointer is only valid until
+// something else gets added to the table.
+BACKTRACIE_API
+const minimal_location_t *backtracie_stack_table_frame(VALUE table,
+                                                       uint32_t frame_id);
+// Returns the frame ID of the innermost frame of the given (non-empty) stack.
+BACKTRACIE_API
+uint32_t backtracie_stack_table_stack_frame(VALUE table, uint32_t stack_id);
+// Returns the stack ID of the given (non-empty) stack without its innermost
+// frame.
+BACKTRACIE_API
+uint32_t backtracie_stack_table_stack_parent(VALUE table, uint32_t stack_id);
+// Returns the number of frames in the given stack.
+BACKTRACIE_API
+uint32_t backtracie_stack_table_stack_depth(VALUE table, uint32_t stack_id);
+// Returns the number of unique frames/stacks in the table. Valid IDs go from
+// 0 to these values minus one.
+BACKTRACIE_API
+uint32_t backtracie_stack_table_frame_count(VALUE table);
+BACKTRACIE_API
+uint32_t backtracie_stack_table_stack_count(VALUE table);
+
+// Writes the given stacks, along with their sample counts, in the "collapsed"
+// format used by flamegraph tools: one "frame;frame;frame count" line per
+// stack, starting from the outermost frame. Empty stacks and stacks with a
+// zero count are skipped.
+//
+// output can be an Integer file descriptor, or an IO (or any other object that
+// responds to #write). Returns the number of bytes written.
+BACKTRACIE_API
+size_t backtracie_stack_table_write_collapsed(VALUE table,
+                                              const uint32_t *stack_ids,
+                                              const uint64_t *counts,
+                                              size_t len, VALUE output);
+
+// Writes the given stacks, along with their sample counts, as an (uncompressed)
+// pprof profile, see https://github.com/google/pprof/tree/main/proto. Each
+// frame becomes a Location, with id frame id + 1. If period_ns is greater than
+// zero, it gets recorded as the profile's sampling period. Empty stacks and
+// stacks with a zero count are skipped.
+//
+// output can be an Integer file descriptor, or an IO (or any other object that
+// responds to #write). Returns the number of bytes written.
+BACKTRACIE_API
+size_t backtracie_stack_table_write_pprof(VALUE table,
+                                          const uint32_t *stack_ids,
+                                          const uint64_t *counts, size_t len,
+                                          int64_t period_ns, VALUE output);
+
+// ========= Symbols API ========
+// Exporting stacks is done in two phases, so that most of the work can happen
+// without holding the GVL (e.g. on a spare core, rather than in the threads
+// serving requests):
+//
+//   1. backtracie_stack_table_symbolize, with the GVL, resolves the few things
+//      that need the VM (method and class names, paths, ...) for the frames of
+//      the given stacks, and copies them, along with the stacks themselves,
+//      into a plain-C snapshot, with each distinct string copied only once.
+//   2. backtracie_symbols_write_collapsed/backtracie_symbols_write_pprof then
+//      format and write out the stacks from the snapshot. They don't need the
+//      GVL, so they can be called from rb_thread_call_without_gvl or from a
+//      C thread, while Ruby code keeps running (and adding to the table).
+//
+// backtracie_stack_table_write_collapsed and backtracie_stack_table_write_pprof
+// do both, and write without the GVL when output is a file descriptor.
+
+typedef struct backtracie_symbols backtracie_symbols_t;
+
+// Gets called with each chunk of output; returns 0 on success, or any other
+// value to stop the export, which the export then returns.
+typedef int (*backtracie_write_function_t)(void *data, const char *buf,
+                                           size_t len);
+
+// Must be called with the GVL. Returns a snapshot of the given stacks, which
+// must be freed with backtracie_symbols_free. If counts is not NULL, stacks
+// with a zero count are left out, as exporting skips them anyway. The snapshot
+// doesn't reference the table, or any Ruby objects. Raises NoMemoryError, or
+// IndexError for an unknown stack id.
+BACKTRACIE_API
+backtracie_symbols_t *
+backtracie_stack_table_symbolize(VALUE table, const uint32_t *stack_ids,
+                                 const uint64_t *counts, size_t len);
+BACKTRACIE_API
+void backtracie_symbols_free(backtracie_symbols_t *symbols);
+// Don't need the GVL. Like backtracie_stack_table_write_collapsed and
+// backtracie_stack_table_write_pprof, but every stack id must have been passed
+// to backtracie_stack_table_symbolize when creating the snapshot, and output
+// is handed to write. These set *bytes_written to the number of bytes written,
+// and return 0, ENOMEM if they ran out of memory, or whatever write returned
+// if it failed.
+BACKTRACIE_API
+int backtracie_symbols_write_collapsed(const backtracie_symbols_t *symbols,
+                                       const uint32_t *stack_ids,
+                                       const uint64_t *counts, size_t len,
+                                       backtracie_write_function_t write,
+                                       void *write_data, size_t *bytes_written);
+BACKTRACIE_API
+int backtracie_symbols_write_pprof(const backtracie_symbols_t *symbols,
+                                   const uint32_t *stack_ids,
+                                   const uint64_t *counts, size_t len,
+                                   int64_t period_ns,
+                                   backtracie_write_function_t write,
+                                   void *write_data, size_t *bytes_written);
+
+// ========= Sample ring API ========
+// A sample ring is a fixed-capacity, single-producer/single-consumer queue of
+// captured stacks, each with a producer-defined 64-bit value attached (e.g. a
+// weight, or a timestamp). It's meant for moving samples out of a capture
+// context, such as a postponed job, a tracepoint or a thread event hook, where
+// Ruby objects can't be allocated, to whatever aggregates them.
+//
+// Every slot has room for a stack of up to max_depth frames; deeper stacks are
+// truncated, keeping the innermost frames. When the ring is full, new samples
+// are dropped (and counted) rather than overwriting old ones.
+//
+// The producer must hold the GVL (which also makes sure there's only ever one
+// of them). The consumer doesn't need to: samples can be drained from a
+// background Ruby thread, or from a C thread. The ring is a Ruby object which
+// marks the VALUEs in the samples it contains, and pins them so that they
+// don't get moved by GC compaction while they're in the ring; a consumer
+// without the GVL can thus safely read them (e.g. to use them as hash keys),
+// but not call into Ruby with them.
+
+typedef struct {
+  // frames[0] is the innermost (most recently called) frame
+  const minimal_location_t *frames;
+  int frames_len;
+  uint64_t value;
+} backtracie_ring_sample_t;
+
+// Returns a new, empty, Backtracie::SampleRing, with room for capacity
+// samples of up to max_depth frames each. Raises ArgumentError if either is
+// zero (or too large).
+BACKTRACIE_API
+VALUE backtracie_sample_ring_new(uint32_t capacity, int max_depth);
+// Producer side; must be called with the GVL. Adds a sample with a copy of the
+// given stack to the ring. Returns false if the ring is full.
+BACKTRACIE_API
+bool backtracie_sample_ring_push(VALUE ring, const minimal_location_t *frames,
+                                 int len, uint64_t value);
+// Producer side; must be called with the GVL. Like backtracie_sample_ring_push,
+// but captures the stack of the given thread directly into the ring, without
+// needing a buffer of its own. Returns false if the ring is full, or the thread
+// is not alive. Neither allocates nor raises, so it's safe to call from
+// anywhere the GVL is held.
+BACKTRACIE_API
+bool backtracie_sample_ring_push_thread(VALUE ring, VALUE thread,
+                                        uint64_t value);
+// Consumer side; doesn't need the GVL. Fills in out with up to max of the
+// oldest samples in the ring, without removing them, and returns how many it
+// did. The samples stay valid (and their VALUEs alive) until consumed.
+BACKTRACIE_API
+uint32_t backtracie_sample_ring_peek(VALUE ring, backtracie_ring_sample_t *out,
+                                     uint32_t max);
+// Consumer side; doesn't need the GVL. Removes the count oldest samples from
+// the ring, which must have been returned by backtracie_sample_ring_peek.
+BACKTRACIE_API
+void backtracie_sample_ring_consume(VALUE ring, uint32_t count);
+// Returns the number of samples currently in the ring. Doesn't need the GVL.
+BACKTRACIE_API
+uint32_t backtracie_sample_ring_size(VALUE ring);
+// Returns the number of samples dropped because the ring was full (samples of
+// threads that are not alive don't count, as there's nothing to drop).
+BACKTRACIE_API
+uint64_t backtracie_sample_ring_dropped_count(VALUE ring);
 #endif
@@ -2,122 +2,227 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "backtracie_private.h"
 #include "strbuilder.h"
 
-void strbuilder_init(strbuilder_t *str, char *buf, size_t bufsize) {
+static void strbuilder_init_backend(strbuilder_t *str, char *buf,
+                                    size_t bufsize,
+                                    strbuilder_backend_t backend) {
   str->original_buf = buf;
-  str->original_bufsize = bufsize;
+  str->original_bufsize = buf == NULL ? 0 : bufsize;
   str->curr_ptr = str->original_buf;
   str->attempted_size = 0;
   if (str->original_bufsize > 0) {
     str->original_buf[0] = '\0';
   }
-  str->growable = false;
+  str->backend = backend;
+  str->out_of_memory = false;
+  str->initial_buf = NULL;
+  str->rstring = Qnil;
+}
+
+void strbuilder_init(strbuilder_t *str, char *buf, size_t bufsize) {
+  strbuilder_init_backend(str, buf, bufsize, STRBUILDER_FIXED);
 }
 
 void strbuilder_init_growable(strbuilder_t *str, size_t initial_bufsize) {
-  str->original_bufsize = initial_bufsize;
-  str->original_buf = malloc(str->original_bufsize);
+  strbuilder_init_backend(str, malloc(initial_bufsize), initial_bufsize,
+                          STRBUILDER_MALLOC);
+  str->out_of_memory = str->original_buf == NULL;
+}
+
+void strbuilder_init_spill(strbuilder_t *str, char *buf, size_t bufsize) {
+  strbuilder_init_backend(str, buf, bufsize, STRBUILDER_SPILL);
+  str->initial_buf = buf;
+}
+
+void strbuilder_init_rstring(strbuilder_t *str, size_t capa) {
+  VALUE rstring = rb_str_buf_new(capa);
+  // Strings always have room for a NULL terminator past their capacity
+  strbuilder_init_backend(str, RSTRING_PTR(rstring),
+                          rb_str_capacity(rstring) + 1, STRBUILDER_RSTRING);
+  str->rstring = rstring;
+}
+
+// The number of bytes actually in the buffer, which may be less than
+// attempted_size if the string got truncated
+static size_t strbuilder_len(const strbuilder_t *str) {
+  if (str->attempted_size < str->original_bufsize) {
+    return str->attempted_size;
+  }
+  return str->original_bufsize > 0 ? str->original_bufsize - 1 : 0;
+}
+
+// Empties the string, keeping the (possibly grown) buffer for reuse
+void strbuilder_reset(strbuilder_t *str) {
   str->curr_ptr = str->original_buf;
   str->attempted_size = 0;
   if (str->original_bufsize > 0) {
     str->original_buf[0] = '\0';
   }
-  str->growable = true;
 }
 
 void strbuilder_free_growable(strbuilder_t *str) {
-  BACKTRACIE_ASSERT(str->growable);
-  free(str->original_buf);
+  BACKTRACIE_ASSERT(str->backend == STRBUILDER_MALLOC ||
+                    str->backend == STRBUILDER_SPILL);
+  if (str->original_buf != str->initial_buf) {
+    free(str->original_buf);
+  }
 }
 
-static void strbuilder_grow(strbuilder_t *str) {
+// Makes room for a string of (at least) len bytes plus its NULL terminator,
+// growing the buffer geometrically. Returns false if the buffer can't grow
+// that much, in which case the string should get truncated.
+static bool strbuilder_reserve(strbuilder_t *str, size_t len) {
+  if (len < str->original_bufsize) {
+    return true;
+  }
+  if (str->backend == STRBUILDER_FIXED || str->out_of_memory) {
+    return false;
+  }
+
   ptrdiff_t offset = str->curr_ptr - str->original_buf;
-  str->original_bufsize = str->original_bufsize * 2;
-  str->original_buf = realloc(str->original_buf, str->original_bufsize);
+  size_t new_bufsize =
+      str->original_bufsize < 64 ? 128 : str->original_bufsize * 2;
+  if (new_bufsize < len + 1) {
+    new_bufsize = len + 1;
+  }
+  char *new_buf = NULL;
+  switch (str->backend) {
+  case STRBUILDER_MALLOC:
+    new_buf = realloc(str->original_buf, new_bufsize);
+    break;
+  case STRBUILDER_SPILL:
+    if (str->original_buf != str->initial_buf) {
+      new_buf = realloc(str->original_buf, new_bufsize);
+    } else if ((new_buf = malloc(new_bufsize)) != NULL) {
+      memcpy(new_buf, str->original_buf, offset);
+    }
+    break;
+  case STRBUILDER_RSTRING:
+    // Resizing only keeps the contents up to the current length
+    rb_str_set_len(str->rstring, offset);
+    rb_str_resize(str->rstring, new_bufsize - 1);
+    new_buf = RSTRING_PTR(str->rstring);
+    break;
+  default:
+    BACKTRACIE_ASSERT_FAIL("unknown strbuilder backend");
+  }
+
+  if (new_buf == NULL) {
+    str->out_of_memory = true;
+    return false;
+  }
+  str->original_buf = new_buf;
+  str->original_bufsize = new_bufsize;
   str->curr_ptr = str->original_buf + offset;
+  return true;
+}
+
+// Once a string gets truncated, curr_ptr points one-past-the-end of the
+// buffer, so that nothing else gets appended to it.
+static bool strbuilder_truncated(const strbuilder_t *str) {
+  return str->curr_ptr == str->original_buf + str->original_bufsize;
 }
 
 void strbuilder_appendf(strbuilder_t *str, const char *fmt, ...) {
-  va_list fmtargs;
+  if (strbuilder_truncated(str)) {
+    return;
+  }
+
+  va_list fmtargs, fmtargs_copy;
   va_start(fmtargs, fmt);
+  va_copy(fmtargs_copy, fmtargs);
 
-retry:;
   // The size left in the buffer
   size_t max_writesize =
       str->original_bufsize - (str->curr_ptr - str->original_buf);
   // vsnprintf returns the number of bytes it _would_ have written, not
   // including the null terminator.
-  size_t attempted_writesize_wo_nullterm =
-      vsnprintf(str->curr_ptr, max_writesize, fmt, fmtargs);
-  if (attempted_writesize_wo_nullterm >= max_writesize) {
-    // Can we grow & retry?
-    if (str->growable) {
-      strbuilder_grow(str);
-      goto retry;
+  int result = vsnprintf(str->curr_ptr, max_writesize, fmt, fmtargs);
+  size_t len = result < 0 ? 0 : (size_t)result;
+  if (len >= max_writesize) {
+    // Now that we know exactly how much room is needed, make sure there's
+    // enough of it, and format again; the first attempt is the only one that
+    // can come up short
+    if (strbuilder_reserve(str, str->curr_ptr - str->original_buf + len)) {
+      vsnprintf(str->curr_ptr, len + 1, fmt, fmtargs_copy);
+      str->curr_ptr += len;
+    } else {
+      // No further things can be appended to this buffer.
+      str->curr_ptr = str->original_buf + str->original_bufsize;
     }
-    // If the string (including nullterm) would have exceeded the bufsize,
-    // point str->curr_ptr to one-past-the-end of the buffer.
-    // This will make subsequent calls to vsnprintf() receive zero for
-    // max_writesize, no further things can be appended to this buffer.
-    str->curr_ptr = str->original_buf + str->original_bufsize;
   } else {
-    // If there's still room in the buffer, advance the curr_ptr.
-    str->curr_ptr = str->curr_ptr + attempted_writesize_wo_nullterm;
+    str->curr_ptr += len;
   }
-  str->attempted_size += attempted_writesize_wo_nullterm;
+  str->attempted_size += len;
+
+  va_end(fmtargs_copy);
   va_end(fmtargs);
 }
 
-void strbuilder_append(strbuilder_t *str, const char *cat) {
-retry:;
-  size_t max_writesize =
-      str->original_bufsize - (str->curr_ptr - str->original_buf);
-  size_t attempted_writesize_wo_nullterm =
-      strlcat(str->curr_ptr, cat, max_writesize);
-  if (attempted_writesize_wo_nullterm >= max_writesize) {
-    if (str->growable) {
-      strbuilder_grow(str);
-      goto retry;
-    }
-    str->curr_ptr = str->original_buf + str->original_bufsize;
-  } else {
-    str->curr_ptr = str->curr_ptr + attempted_writesize_wo_nullterm;
+void strbuilder_append_len(strbuilder_t *str, const char *cat, size_t len) {
+  str->attempted_size += len;
+  if (strbuilder_truncated(str)) {
+    return;
   }
-  str->attempted_size += attempted_writesize_wo_nullterm;
-}
-
-void strbuilder_append_value(strbuilder_t *str, VALUE val) {
-  BACKTRACIE_ASSERT(RB_TYPE_P(val, T_STRING));
 
-  const char *val_ptr = RSTRING_PTR(val);
-  size_t val_len = RSTRING_LEN(val);
-
-retry:;
-  size_t max_writesize =
-      str->original_bufsize - (str->curr_ptr - str->original_buf);
-  size_t chars_to_copy = val_len;
-  if (chars_to_copy + 1 > max_writesize) {
-    if (str->growable) {
-      strbuilder_grow(str);
-      goto retry;
-    }
-    chars_to_copy = max_writesize - 1; // leave room for NULL terminator.
+  size_t used = str->curr_ptr - str->original_buf;
+  size_t to_copy = len;
+  if (!strbuilder_reserve(str, used + len)) {
+    // Copy whatever fits, leaving room for the NULL terminator (if there's
+    // room for anything at all)
+    to_copy = str->original_bufsize > used + 1 ? str->original_bufsize - used - 1
+                                               : 0;
   }
-  memcpy(str->curr_ptr, val_ptr, chars_to_copy);
-  str->curr_ptr[chars_to_copy] = '\0';
-  str->attempted_size += val_len;
-  if (val_len + 1 > max_writesize) {
-    str->curr_ptr = str->original_buf + str->original_bufsize;
-  } else {
-    str->curr_ptr += val_len;
+  if (used < str->original_bufsize) {
+    memcpy(str->curr_ptr, cat, to_copy);
+    str->curr_ptr[to_copy] = '\0';
   }
+  str->curr_ptr = to_copy < len ? str->original_buf + str->original_bufsize
+                                : str->curr_ptr + len;
+}
+
+void strbuilder_append(strbuilder_t *str, const char *cat) {
+  strbuilder_append_len(str, cat, strlen(cat));
+}
 
+void strbuilder_append_value(strbuilder_t *str, VALUE val) {
+  BACKTRACIE_ASSERT(RB_TYPE_P(val, T_STRING));
+  strbuilder_append_len(str, RSTRING_PTR(val), RSTRING_LEN(val));
   RB_GC_GUARD(val);
 }
 
 VALUE strbuilder_to_value(strbuilder_t *str) {
-  return rb_str_new2(str->original_buf);
+  return rb_str_new(str->original_buf, strbuilder_len(str));
+}
+
+VALUE strbuilder_finish_rstring(strbuilder_t *str) {
+  BACKTRACIE_ASSERT(str->backend == STRBUILDER_RSTRING);
+  VALUE rstring = str->rstring;
+  // Resizing only keeps the contents up to the current length (e.g. when the
+  // string becomes embedded), so set that first; it also gives back the extra
+  // capacity, if there's a lot of it
+  rb_str_set_len(rstring, strbuilder_len(str));
+  rb_str_resize(rstring, strbuilder_len(str));
+  str->rstring = Qnil;
+  return rstring;
+}
+
+size_t strbuilder_arena_next(strbuilder_t *str) {
+  BACKTRACIE_ASSERT(str->backend != STRBUILDER_RSTRING);
+  str->attempted_size++;
+  if (strbuilder_truncated(str)) {
+    return str->attempted_size;
+  }
+
+  // Move past the NULL terminator, and make sure the next string starts out
+  // with room for its own, as otherwise it'd look like it was truncated
+  str->curr_ptr++;
+  if (strbuilder_reserve(str, str->curr_ptr - str->original_buf)) {
+    str->curr_ptr[0] = '\0';
+  }
+  return str->attempted_size;
 }
@@ -5,19 +5,58 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+// Where a strbuilder_t keeps the string it's building
+typedef enum {
+  // A caller-provided buffer; whatever doesn't fit gets truncated
+  STRBUILDER_FIXED,
+  // A malloc'd buffer, which grows as needed
+  STRBUILDER_MALLOC,
+  // A caller-provided buffer (e.g. on the stack) until the string outgrows
+  // it, and a malloc'd buffer from then on
+  STRBUILDER_SPILL,
+  // The buffer of a Ruby String, which grows as needed
+  STRBUILDER_RSTRING,
+} strbuilder_backend_t;
+
 typedef struct {
   char *original_buf;
   char *curr_ptr;
   size_t original_bufsize;
   size_t attempted_size;
-  bool growable;
+  strbuilder_backend_t backend;
+  // Set if growing the buffer failed; the string gets truncated from then on,
+  // as if the buffer was a fixed one
+  bool out_of_memory;
+  // The caller-provided buffer, for STRBUILDER_SPILL
+  char *initial_buf;
+  // The String being built, for STRBUILDER_RSTRING
+  VALUE rstring;
 } strbuilder_t;
 
 void strbuilder_append(strbuilder_t *str, const char *cat);
-void strbuilder_appendf(strbuilder_t *str, const char *fmt, ...);
+// Like strbuilder_append, for when the length of cat is already known; cat
+// need not be NULL-terminated
+void strbuilder_append_len(strbuilder_t *str, const char *cat, size_t len);
+#define strbuilder_append_literal(str, literal)                                \
+  strbuilder_append_len((str), "" literal, sizeof(literal) - 1)
+void strbuilder_appendf(strbuilder_t *str, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
 void strbuilder_append_value(strbuilder_t *str, VALUE val);
+// Returns a new String with the contents built so far
 VALUE strbuilder_to_value(strbuilder_t *str);
 void strbuilder_init(strbuilder_t *str, char *buf, size_t bufsize);
 void strbuilder_init_growable(strbuilder_t *str, size_t initial_bufsize);
+void strbuilder_init_spill(strbuilder_t *str, char *buf, size_t bufsize);
+// Builds the string straight into a new String with room for capa bytes; it
+// must be finished with strbuilder_finish_rstring, which returns it
+void strbuilder_init_rstring(strbuilder_t *str, size_t capa);
+VALUE strbuilder_finish_rstring(strbuilder_t *str);
+// Frees the memory of a STRBUILDER_MALLOC or STRBUILDER_SPILL builder
 void strbuilder_free_growable(strbuilder_t *str);
+void strbuilder_reset(strbuilder_t *str);
+// Arena mode: ends the string being built, so that the next one gets built
+// right after it (past its NULL terminator) in the same buffer. Returns the
+// offset at which the next string starts. Keep offsets rather than pointers,
+// as the buffer may move when it grows.
+size_t strbuilder_arena_next(strbuilder_t *str);
 #endif
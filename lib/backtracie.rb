@@ -20,6 +20,7 @@
 
 require "backtracie/version"
 require "backtracie/location"
+require "backtracie/minimal_location"
 
 # Note: This should be the last require, because the native extension expects all of the Ruby-defined classes above
 # to exist by the time it gets initialized
@@ -28,21 +29,72 @@ require "backtracie_native_extension"
 module Backtracie
   module_function
 
+  # Like Kernel#caller_locations, `start` and `length` can be used to only get part of the backtrace; `max_depth` caps
+  # the number of locations returned. Only the requested frames are captured, so asking for a single frame is a lot
+  # cheaper than getting the whole backtrace and picking from it.
   if RUBY_VERSION < "2.5"
-    def caller_locations
+    def caller_locations(start = 1, length = nil, debug: false, max_depth: nil)
       # FIXME: We're having some trouble getting the current thread on older Rubies, see the FIXME on
       # backtracie_rb_profile_frames. A workaround is to just pass in the reference to the current thread explicitly
-      # (and slice off a few frames, since caller_locations is supposed to start from the caller of our caller)
-      backtrace_locations(Thread.current)[3..-1]
+      # (and skip a few more frames, since caller_locations is supposed to start from the caller of our caller)
+      raise ArgumentError, "negative level (#{start})" if start < 0
+
+      backtrace_locations(Thread.current, start + 2, length, debug: debug, max_depth: max_depth)
     end
   else
-    def caller_locations
-      Primitive.caller_locations
+    def caller_locations(start = 1, length = nil, debug: false, max_depth: nil)
+      Primitive.caller_locations(start, length, debug, max_depth)
     end
   end
 
+  # Returns a single Backtracie::Location, for the caller of the current method (or, when `skip` is given, for the
+  # caller `skip` frames further up the stack), or nil if there's no such frame. This is the same as
+  # `caller_locations(1 + skip, 1).first`, but cheaper.
+  #
+  # `filter` can be used to skip over frames from libraries: if given a path prefix (or an Array of them), the first
+  # Ruby frame whose absolute path does not start with any of them is returned instead. For instance,
+  # `caller_location(filter: Gem.path)` returns the first frame that's not from a gem. The stack is only walked up to
+  # the frame that gets returned.
+  def caller_location(skip: 0, filter: nil)
+    filter = Array(filter) unless filter.nil? || filter.is_a?(Array)
+    Primitive.caller_location(skip, filter)
+  end
+
+  # Returns a 64-bit hash (an Integer) identifying the stack of the caller of the current method (or, as with
+  # caller_location, of the caller `skip` frames further up the stack), e.g. for grouping errors that happened in the
+  # same place. It covers the qualified method name and absolute path of every frame (or of the first `depth` ones),
+  # plus their line numbers if `lineno` is true, so the same code running on the same Ruby version gets the same
+  # fingerprint in every process. No Locations or Strings get created to compute it.
+  def caller_fingerprint(skip: 0, depth: nil, lineno: false)
+    Primitive.caller_fingerprint(skip, depth, lineno)
+  end
+
   # Defined via native code only; not redirecting via Primitive to avoid an extra stack frame on the stack
-  # def backtrace_locations(thread); end
+  # def backtrace_locations(thread, start = 0, length = nil, debug: false, max_depth: nil); end
+
+  if RUBY_VERSION < "2.5"
+    def minimal_caller_locations
+      # See FIXME on caller_locations above
+      minimal_backtrace_locations(Thread.current)[3..-1]
+    end
+  else
+    def minimal_caller_locations
+      Primitive.minimal_caller_locations
+    end
+  end
+
+  # Defined via native code only; like backtrace_locations, but returns Backtracie::MinimalLocations
+  # def minimal_backtrace_locations(thread); end
+
+  # Defined via native code only; renders a whole backtrace (an Array of Backtracie::Locations,
+  # Backtracie::MinimalLocations or anything else that responds to #to_s, such as Thread::Backtrace::Locations) into a
+  # single String, one location per line, without any intermediate Strings. Locations are rendered as by their #to_s
+  # or, with `style: :fancy`, by Location#fancy_to_s.
+  # def format_backtrace(locations, style: :default); end
+
+  # Defined via native code only; returns the hit/miss counters for backtracie's internal caches, e.g.
+  # `{line_number_cache: {hits: 10, misses: 2}, name_cache: {hits: 7, misses: 3}}`
+  # def cache_stats; end
 
   private_class_method def ensure_object_is_thread(object)
     unless object.is_a?(Thread)
@@ -20,17 +20,20 @@
 
 module Backtracie
   # A more advanced version of Ruby's built-in Thread::Backtrace::Location
+  #
+  # Locations returned by Backtracie are lazy: they keep a reference to the raw frames captured by the native
+  # extension, and each field is only computed the first time it gets read. They are frozen nonetheless, as are the ones
+  # created with Location.new: the fields get memoized outside of the location. The readers (#absolute_path,
+  # #base_label, #label, #lineno, #path, #qualified_method_name and #path_is_synthetic), as well as #to_s and
+  # #fancy_to_s, are defined in the native extension. The Strings the readers return are frozen, and shared with
+  # other locations (and, for paths and labels, with the VM), rather than copied for every location.
   class Location
-    attr_accessor :absolute_path
-    attr_accessor :base_label
-    attr_accessor :label
-    attr_accessor :lineno
-    attr_accessor :path
-    attr_accessor :qualified_method_name
-    attr_accessor :path_is_synthetic
+    # Extra information about how this location was computed; only available when it was requested by passing
+    # `debug: true` when getting the backtrace, and nil otherwise.
+    attr_reader :debug
 
-    # Note: The order of arguments is hardcoded in the native extension in the `new_location` function --
-    # keep them in sync
+    # Note: The native extension does not call this method; it is kept so that a Location can still be created with
+    # all of its fields already computed.
     def initialize(
       absolute_path, base_label, label, lineno, path, qualified_method_name,
       path_is_synthetic, debug
@@ -47,21 +50,12 @@ module Backtracie
       freeze
     end
 
-    def to_s
-      if @lineno != 0
-        "#{@path}:#{@lineno}:in `#{@label}'"
-      else
-        "#{@path}:in `#{@label}'"
-      end
-    end
+    # Defined via native code only; renders the location as "path:lineno:in `label'", like
+    # Thread::Backtrace::Location#to_s
+    # def to_s; end
 
-    # Still WIP
-    def fancy_to_s
-      if @lineno != 0
-        "#{@path}:#{@lineno}:in #{@qualified_method_name}"
-      else
-        "#{@path}:in #{@qualified_method_name}"
-      end
-    end
+    # Defined via native code only (and still WIP); like #to_s, but with the qualified method name instead of the
+    # label, e.g. "path:lineno:in Foo#bar"
+    # def fancy_to_s; end
   end
 end
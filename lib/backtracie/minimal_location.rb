@@ -0,0 +1,34 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+module Backtracie
+  # A lighter version of Backtracie::Location, returned by Backtracie.minimal_caller_locations and
+  # Backtracie.minimal_backtrace_locations.
+  #
+  # A Location keeps the frames it was computed from alive, including their instruction sequences, which can add up
+  # to a lot of memory when holding on to many backtraces (e.g. when sampling). A MinimalLocation instead only keeps
+  # the few objects needed to describe its frame: the absolute path of its source file, its base label, and the
+  # object or class the method was called on. As a trade-off, it only provides #absolute_path, #lineno,
+  # #qualified_method_name and #path_is_synthetic, which are defined in the native extension.
+  class MinimalLocation
+    # Defined via native code only; renders the location as "absolute_path:lineno:in qualified_method_name"
+    # def to_s; end
+  end
+end
@@ -19,8 +19,11 @@
 # along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
 
 require "backtracie"
+require "fiber"
+require "stringio"
 
 require "unit/interesting_backtrace_helper"
+require "unit/pprof_helper"
 
 # Used for testing below
 TOP_LEVEL_BLOCK = proc { |&block| block.call }
@@ -75,6 +78,177 @@ RSpec.describe Backtracie do
 
       it_should_behave_like "an equivalent of the Ruby API (using locations)"
     end
+
+    context "when passing start and length" do
+      let(:backtracie_stack) { described_class.caller_locations(2, 3) }
+      let(:ruby_stack) { Kernel.caller_locations(2, 3) }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+      it "returns only the requested frames" do
+        expect(backtracie_stack.size).to eq 3
+      end
+    end
+
+    it "returns at most max_depth frames" do
+      expect(described_class.caller_locations(max_depth: 2).size).to eq 2
+      expect(described_class.caller_locations(1, 5, max_depth: 2).size).to eq 2
+      expect(described_class.caller_locations(1, 1, max_depth: 2).size).to eq 1
+    end
+
+    it "returns nil when start is past the end of the stack" do
+      expect(described_class.caller_locations(100_000)).to be nil
+      expect(described_class.caller_locations(100_000, 0)).to be nil
+    end
+
+    it "behaves like Kernel#caller_locations around the end of the stack" do
+      stack_size = caller_locations.size
+
+      expect(described_class.caller_locations(stack_size)&.size).to be 1
+      expect(described_class.caller_locations(stack_size + 1)).to eq []
+      expect(described_class.caller_locations(stack_size + 2)).to be nil
+      expect(caller_locations(stack_size + 1)).to eq []
+      expect(caller_locations(stack_size + 2)).to be nil
+    end
+
+    it "raises ArgumentError for negative arguments" do
+      expect { described_class.caller_locations(-1) }.to raise_exception(ArgumentError)
+      expect { described_class.caller_locations(1, -1) }.to raise_exception(ArgumentError)
+      expect { described_class.caller_locations(max_depth: -1) }.to raise_exception(ArgumentError)
+    end
+  end
+
+  describe ".caller_location" do
+    def method_calling_caller_location(**options)
+      described_class.caller_location(**options)
+    end
+
+    it "returns the location of the caller of the current method" do
+      # These two function calls should never be reformatted to be on different lines!
+      location, expected = method_calling_caller_location, described_class.caller_locations(0, 1).first
+
+      expect(location).to be_a(Backtracie::Location)
+      expect(location.to_s).to eq expected.to_s
+      expect(location.qualified_method_name).to eq expected.qualified_method_name
+    end
+
+    it "skips the given number of frames" do
+      expect(method_calling_caller_location(skip: 2).to_s).to eq described_class.caller_locations(2, 1).first.to_s
+    end
+
+    it "returns the first Ruby frame not matching any of the given path prefixes" do
+      filter = [File.join(__dir__, "does_not_exist"), File.realpath(__FILE__)]
+
+      # Skips this block, and then the Array#map cfunc and this example's frames are filtered out
+      location = [1].map { method_calling_caller_location(skip: 1, filter: filter) }.first
+
+      expect(location.absolute_path).to_not eq File.realpath(__FILE__)
+      expect(location.absolute_path).to eq(
+        described_class.caller_locations(0).find { |it| it.absolute_path != File.realpath(__FILE__) }.absolute_path
+      )
+    end
+
+    it "accepts a single path prefix as filter" do
+      expect(method_calling_caller_location(filter: __FILE__).absolute_path).to_not eq File.realpath(__FILE__)
+    end
+
+    it "returns nil when there is no matching frame" do
+      expect(method_calling_caller_location(filter: "/")).to be nil
+      expect(method_calling_caller_location(skip: 100_000)).to be nil
+    end
+  end
+
+  describe ".caller_fingerprint" do
+    def fingerprint_here(**options)
+      described_class.caller_fingerprint(**options)
+    end
+
+    it "returns the same fingerprint when called again from the same place" do
+      fingerprints = Array.new(2) { fingerprint_here }
+
+      expect(fingerprints.first).to be_a(Integer)
+      expect(fingerprints.first).to eq fingerprints.last
+    end
+
+    it "only changes with the line number when including line numbers" do
+      # These function calls should never be reformatted to be on the same line!
+      first, first_with_lineno = fingerprint_here, fingerprint_here(lineno: true)
+      second, second_with_lineno = fingerprint_here, fingerprint_here(lineno: true)
+
+      expect(first).to eq second
+      expect(first_with_lineno).to_not eq second_with_lineno
+    end
+
+    it "changes with the frames it covers" do
+      expect(fingerprint_here(depth: 1)).to_not eq fingerprint_here(depth: 2)
+      expect(fingerprint_here).to_not eq fingerprint_here(skip: 1)
+      expect([1].map { fingerprint_here }.first).to_not eq fingerprint_here
+    end
+
+    it "returns the same fingerprint across GCs" do
+      fingerprints = Array.new(3) do |it|
+        GC.start(full_mark: it.odd?)
+        fingerprint_here
+      end
+
+      expect(fingerprints.uniq.size).to be 1
+    end
+
+    it "returns the same fingerprint in other processes running the same code" do
+      script = <<~RUBY
+        require "backtracie"
+        def fingerprint_here; Backtracie.caller_fingerprint(lineno: true); end
+        def caller_of_fingerprint_here; fingerprint_here; end
+        print Class.new(Array) { def anonymous_caller; caller_of_fingerprint_here; end }.new.anonymous_caller
+      RUBY
+      load_path = $LOAD_PATH.flat_map { |it| ["-I", it] }
+
+      fingerprints = Array.new(2) { IO.popen([RbConfig.ruby, *load_path, "-e", script], &:read) }
+
+      expect(fingerprints.first).to match(/\A\d+\z/)
+      expect(fingerprints.first).to eq fingerprints.last
+    end
+
+    it "raises ArgumentError for negative arguments" do
+      expect { fingerprint_here(skip: -1) }.to raise_exception(ArgumentError)
+      expect { fingerprint_here(depth: -1) }.to raise_exception(ArgumentError)
+    end
+  end
+
+  describe "debug information" do
+    it "is not included by default" do
+      expect(described_class.caller_locations.map(&:debug)).to all(be_nil)
+      expect(described_class.backtrace_locations(Thread.current).map(&:debug)).to all(be_nil)
+    end
+
+    it "is included when requested using debug: true" do
+      expect(described_class.caller_locations(debug: true).map(&:debug)).to all(be_a(Hash))
+      expect(described_class.backtrace_locations(Thread.current, debug: true).first.debug)
+        .to include(:ruby_frame?, :self_is_real_self?, :rb_profile_frames)
+    end
+
+    it "returns the same number of frames as without debug information" do
+      # These two function calls should never be reformatted to be on different lines!
+      expect(described_class.caller_locations(debug: true).size).to eq(described_class.caller_locations.size)
+    end
+  end
+
+  describe "capturing backtraces repeatedly" do
+    def deep_stack(depth, &block)
+      (depth == 0) ? yield : deep_stack(depth - 1, &block)
+    end
+
+    it "keeps the locations returned earlier intact" do
+      deep_locations = deep_stack(200) { described_class.caller_locations }
+      expected = deep_locations.map(&:to_s)
+
+      shallow_locations = described_class.caller_locations
+      deeper_locations = deep_stack(500) { described_class.caller_locations }
+
+      expect(deep_locations.map(&:to_s)).to eq expected
+      expect(deep_locations.size).to eq(shallow_locations.size + 202)
+      expect(deeper_locations.size).to eq(shallow_locations.size + 502)
+    end
   end
 
   describe ".backtrace_locations" do
@@ -100,6 +274,20 @@ RSpec.describe Backtracie do
       it_should_behave_like "an equivalent of the Ruby API (using locations)"
     end
 
+    context "when passing start and length" do
+      let!(:backtraces_for_comparison) {
+        # These two procs should never be reformatted to be on different lines! See above for why.
+        [proc { described_class.backtrace_locations(Thread.main, 1, 4) }, proc { Thread.main.backtrace_locations(1, 4) }]
+          .map { |target_proc| Thread.new(&target_proc).value }
+      }
+
+      it_should_behave_like "an equivalent of the Ruby API (using locations)"
+
+      it "returns only the requested frames" do
+        expect(backtracie_stack.size).to eq 4
+      end
+    end
+
     context "when sampling an eval" do
       let!(:backtraces_for_comparison) {
         # These two function calls should never be reformatted to be on different lines!
@@ -524,6 +712,23 @@ RSpec.describe Backtracie do
       end
     end
 
+    context "when start is at or past the end of the stack" do
+      let(:thread) { Thread.new { sleep } }
+
+      before { Thread.pass until thread.status == "sleep" }
+      after { thread.kill.join }
+
+      it "behaves like Thread#backtrace_locations" do
+        stack_size = thread.backtrace_locations.size
+
+        [stack_size - 1, stack_size, stack_size + 1].each do |start|
+          expect(described_class.backtrace_locations(thread, start)&.size)
+            .to be thread.backtrace_locations(start)&.size
+        end
+        expect(described_class.backtrace_locations(thread, stack_size + 1)).to be nil
+      end
+    end
+
     context "when sampling a refinement" do
       module TheRefinement
         refine Integer do
@@ -645,6 +850,96 @@ RSpec.describe Backtracie do
       end
     end
 
+    context "when sampling an anonymous class that later gets a name" do
+      let(:anonymous_class) {
+        Class.new(Array) do
+          def test_method
+            yield
+          end
+        end
+      }
+
+      after { Object.send(:remove_const, :ClassNamedAfterBeingSampled) }
+
+      it "uses the new name of the class" do
+        object = anonymous_class.new
+        expect(object.test_method { described_class.backtrace_locations(Thread.current) }[2].qualified_method_name)
+          .to eq "Array$anonymous#test_method"
+
+        Object.const_set(:ClassNamedAfterBeingSampled, anonymous_class)
+
+        expect(object.test_method { described_class.backtrace_locations(Thread.current) }[2].qualified_method_name)
+          .to eq "ClassNamedAfterBeingSampled#test_method"
+      end
+    end
+
+    context "when sampling methods of objects that later become unreachable" do
+      def sample_test_method(object)
+        object.test_method { described_class.backtrace_locations(Thread.current).map(&:qualified_method_name) }
+      end
+
+      def sample_and_forget
+        anonymous_class = Class.new do
+          def test_method
+            yield
+          end
+        end
+        singleton_object = Object.new
+        def singleton_object.test_method
+          yield
+        end
+        sample_test_method(anonymous_class.allocate)
+        sample_test_method(singleton_object)
+        [WeakRef.new(anonymous_class), WeakRef.new(singleton_object)]
+      end
+
+      it "does not keep them alive" do
+        require "weakref"
+        references = Thread.new { sample_and_forget }.value
+        # The inline method cache of the call in sample_test_method would keep the last one alive otherwise
+        sample_test_method(ClassWithMethod.new)
+        4.times { GC.start }
+
+        expect(references.map(&:weakref_alive?)).to eq [nil, nil]
+      end
+    end
+
+    context "when sampling a method with really long names and path" do
+      let(:class_name) { "ClassWithAReallyLongName" * 12 }
+      let(:method_name) { "method_with_a_really_long_name_" * 10 }
+      let(:path) { "/" + "directory_with_a_really_long_name/" * 10 + "file.rb" }
+
+      before do
+        eval("class #{class_name}; def #{method_name}; yield; end; end", binding, path, 1)
+      end
+
+      after { Object.send(:remove_const, class_name) }
+
+      it "renders them in full" do
+        location = Object.const_get(class_name).new.public_send(method_name) do
+          described_class.backtrace_locations(Thread.current)
+        end[2]
+
+        expect(location.qualified_method_name).to eq "#{class_name}##{method_name}"
+        expect(location.label).to eq method_name
+        expect(location.path).to eq path
+      end
+    end
+
+    context "when the heap gets compacted between samples" do
+      before do
+        skip "GC.compact not supported" unless GC.respond_to?(:compact)
+      end
+
+      it "returns the same qualified_method_names" do
+        before_compact = described_class.caller_locations.map(&:qualified_method_name)
+        GC.compact
+        after_compact = described_class.caller_locations.map(&:qualified_method_name)
+
+        expect(after_compact).to eq before_compact
+      end
+    end
+
     context "when sampling an eval triggered with :send" do
       class EvalTriggeredWithSend
         def test_method
@@ -692,6 +987,984 @@ RSpec.describe Backtracie do
     end
   end
 
+  describe "Backtracie::Location" do
+    let(:location) { described_class.caller_locations.first }
+
+    it "is frozen, like the locations created with Location.new" do
+      expect(location.frozen?).to be true
+      expect(described_class::Location.new(*Array.new(8)).frozen?).to be true
+    end
+
+    it "computes its fields when they are first read, even though it is frozen" do
+      backtracie_location, kernel_location = [described_class.caller_locations.first, Kernel.caller_locations.first]
+
+      [:absolute_path, :base_label, :label, :lineno, :path].each do |field|
+        expect(backtracie_location.public_send(field)).to eq kernel_location.public_send(field)
+        expect(backtracie_location.public_send(field)).to be backtracie_location.public_send(field)
+      end
+      expect(backtracie_location.qualified_method_name).to eq "BasicObject#instance_exec"
+    end
+
+    it "returns frozen Strings, shared with other locations for the same frame" do
+      first, second = Array.new(2) { described_class.caller_locations.first }
+
+      [:absolute_path, :base_label, :label, :path, :qualified_method_name].each do |field|
+        expect(first.public_send(field).frozen?).to be true
+        expect(second.public_send(field)).to be first.public_send(field)
+      end
+    end
+
+    it "renders the same #to_s as the Ruby API" do
+      backtracie_location, kernel_location = [described_class.caller_locations.first, Kernel.caller_locations.first]
+
+      expect(backtracie_location.to_s).to eq kernel_location.to_s
+    end
+
+    it "renders #fancy_to_s with the qualified method name" do
+      expect(location.fancy_to_s)
+        .to eq "#{location.path}:#{location.lineno}:in #{location.qualified_method_name}"
+    end
+
+    it "renders #to_s for a location created with all of its fields" do
+      location = Backtracie::Location.new("/a.rb", "b", "block in b", 0, "/a.rb", "Foo#b", false, nil)
+
+      expect(location.to_s).to eq "/a.rb:in `block in b'"
+    end
+  end
+
+  describe ".format_backtrace" do
+    let(:locations) { described_class.caller_locations }
+
+    it "renders every location like #to_s, one per line" do
+      expect(described_class.format_backtrace(locations)).to eq locations.map(&:to_s).join("\n")
+    end
+
+    it "renders every location like #fancy_to_s when using the fancy style" do
+      expect(described_class.format_backtrace(locations, style: :fancy)).to eq locations.map(&:fancy_to_s).join("\n")
+    end
+
+    it "renders other kinds of locations with their own #to_s" do
+      mixed_locations = [described_class.minimal_caller_locations.first, Kernel.caller_locations.first, "string"]
+
+      expect(described_class.format_backtrace(mixed_locations)).to eq mixed_locations.map(&:to_s).join("\n")
+    end
+
+    it "raises an ArgumentError for an unknown style" do
+      expect { described_class.format_backtrace(locations, style: :other) }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe "building a String with strbuilder" do
+    let(:test_helpers) { Backtracie::TestHelpers }
+
+    it "keeps the contents of short Strings" do
+      expect(test_helpers.strbuilder_rstring_from_parts(["Kernel", "#", "sleep"], 1)).to eq "Kernel#sleep"
+    end
+
+    it "keeps the contents of Strings that outgrow their initial capacity" do
+      parts = Array.new(100) { |it| "part #{it};" }
+
+      expect(test_helpers.strbuilder_rstring_from_parts(parts, 1)).to eq parts.join
+    end
+  end
+
+  describe "backtracie_capture_frames_for_thread" do
+    let(:test_helpers) { Backtracie::TestHelpers }
+    let(:thread) { Thread.new { sleep }.tap { |it| sleep 0.01 until it.status == "sleep" } }
+
+    after { thread.kill.join }
+
+    it "captures the same frames as calling backtracie_capture_frame_for_thread for every index" do
+      expect(test_helpers.frame_names_from_bulk_capture(thread, 0, 1000))
+        .to eq test_helpers.frame_names_from_single_captures(thread)
+    end
+
+    it "renders the same names when not going through the name cache" do
+      expect(test_helpers.frame_names_without_name_cache(thread))
+        .to eq test_helpers.frame_names_from_single_captures(thread)
+    end
+
+    it "skips the first start frames and captures at most max frames" do
+      all_frames = test_helpers.frame_names_from_single_captures(thread)
+
+      expect(test_helpers.frame_names_from_bulk_capture(thread, 1, 1)).to eq all_frames[1, 1]
+    end
+
+    it "captures nothing for a dead thread" do
+      dead_thread = Thread.new {}.tap(&:join)
+
+      expect(test_helpers.frame_names_from_bulk_capture(dead_thread, 0, 1000)).to eq []
+    end
+  end
+
+  describe ".all_thread_backtraces" do
+    def sleeping_in_some_method
+      sleep
+    end
+
+    let!(:threads) {
+      Array.new(3) { Thread.new { sleeping_in_some_method } }.each { |it| sleep 0.01 until it.status == "sleep" }
+    }
+
+    after { threads.each { |it| it.kill.join } }
+
+    it "returns the backtrace of every live thread, keyed by thread" do
+      backtraces = described_class.all_thread_backtraces
+
+      expect(backtraces.keys).to eq Thread.list
+      threads.each do |thread|
+        expect(backtraces[thread].map(&:to_s)).to eq described_class.backtrace_locations(thread).map(&:to_s)
+      end
+    end
+
+    it "shares a single frame wrapper between all returned locations" do
+      locations = described_class.all_thread_backtraces.values.flatten
+      frame_wrappers = locations.map { |it| it.instance_variable_get(:@frame_wrapper) }
+
+      expect(frame_wrappers.uniq.size).to be 1
+    end
+
+    it "does not include dead threads" do
+      dead_thread = Thread.new {}.tap(&:join)
+
+      expect(described_class.all_thread_backtraces).to_not include(dead_thread)
+    end
+  end
+
+  describe "fibers" do
+    def fiber_inner
+      Fiber.yield
+    end
+
+    def fiber_outer
+      fiber_inner
+    end
+
+    let!(:suspended_fibers) { Array.new(3) { Fiber.new { fiber_outer }.tap(&:resume) } }
+
+    describe ".fiber_backtrace_locations" do
+      it "returns the backtrace of a suspended fiber, without resuming it" do
+        locations = described_class.fiber_backtrace_locations(suspended_fibers.first)
+
+        expect(locations.map(&:qualified_method_name)[0..2]).to eq [
+          "Fiber.yield",
+          "RSpec::ExampleGroups::Backtracie::Fibers#fiber_inner",
+          "RSpec::ExampleGroups::Backtracie::Fibers#fiber_outer"
+        ]
+        expect(locations.size).to be 4
+        expect(locations.last.label).to start_with "block"
+        expect(suspended_fibers.first.alive?).to be true
+      end
+
+      if Fiber.method_defined?(:backtrace_locations)
+        it "returns the same locations as Fiber#backtrace_locations" do
+          fiber = suspended_fibers.first
+
+          expect(described_class.fiber_backtrace_locations(fiber).map(&:to_s))
+            .to eq fiber.backtrace_locations.map(&:to_s)
+        end
+      end
+
+      it "returns nil for fibers that were not started, or have already finished" do
+        finished_fiber = Fiber.new {}.tap(&:resume)
+
+        expect(described_class.fiber_backtrace_locations(Fiber.new {})).to be nil
+        expect(described_class.fiber_backtrace_locations(finished_fiber)).to be nil
+      end
+
+      it "raises an ArgumentError when not given a fiber" do
+        expect { described_class.fiber_backtrace_locations(Thread.current) }.to raise_error(ArgumentError)
+      end
+    end
+
+    describe ".all_fiber_backtraces" do
+      it "returns the backtraces of all of the current thread's fibers, keyed by fiber" do
+        backtraces = described_class.all_fiber_backtraces
+
+        expect(backtraces.keys).to include(Fiber.current, *suspended_fibers)
+        suspended_fibers.each do |fiber|
+          expect(backtraces[fiber].map(&:to_s)).to eq described_class.fiber_backtrace_locations(fiber).map(&:to_s)
+        end
+        expect(backtraces[Fiber.current].first.base_label).to eq "all_fiber_backtraces"
+      end
+
+      it "only returns the fibers of the given thread" do
+        suspended_fibers
+
+        expect(Thread.new { described_class.all_fiber_backtraces(Thread.main).keys }.value)
+          .to include(*suspended_fibers)
+        expect(Thread.new { described_class.all_fiber_backtraces.keys }.value).to_not include(*suspended_fibers)
+      end
+    end
+  end
+
+  describe "minimal locations" do
+    def describe_locations(locations)
+      locations.map { |it| [it.absolute_path, it.lineno, it.qualified_method_name, it.path_is_synthetic] }
+    end
+
+    it "returns the same information as .caller_locations from .minimal_caller_locations" do
+      # These two function calls should never be reformatted to be on different lines!
+      minimal_locations, locations = described_class.minimal_caller_locations, described_class.caller_locations
+
+      expect(minimal_locations).to all(be_a(Backtracie::MinimalLocation))
+      expect(describe_locations(minimal_locations)).to eq describe_locations(locations)
+    end
+
+    context "when sampling another thread" do
+      let(:thread) { Thread.new { sleep }.tap { |it| sleep 0.01 until it.status == "sleep" } }
+
+      after { thread.kill.join }
+
+      it "returns the same information as .backtrace_locations from .minimal_backtrace_locations" do
+        expect(describe_locations(described_class.minimal_backtrace_locations(thread)))
+          .to eq describe_locations(described_class.backtrace_locations(thread))
+      end
+
+      it "does not keep the instruction sequences of the frames alive" do
+        require "objspace"
+        retained_by = lambda do |location|
+          ObjectSpace.reachable_objects_from(location.instance_variable_get(:@frame_wrapper))
+            .grep(ObjectSpace::InternalObjectWrapper).select { |it| it.inspect.include?("T_IMEMO") }
+        end
+
+        expect(retained_by.call(described_class.backtrace_locations(thread).first)).to_not be_empty
+        expect(retained_by.call(described_class.minimal_backtrace_locations(thread).first)).to be_empty
+      end
+    end
+
+    it "returns nil for a dead thread" do
+      expect(described_class.minimal_backtrace_locations(Thread.new {}.tap(&:join))).to be nil
+    end
+
+    it "returns frozen locations" do
+      location = described_class.minimal_caller_locations.first
+
+      expect(location.frozen?).to be true
+      expect(location.qualified_method_name).to be location.qualified_method_name
+    end
+
+    context "when the heap gets compacted" do
+      before do
+        skip "GC compaction not supported" unless GC.respond_to?(:verify_compaction_references)
+      end
+
+      it "keeps returning the same information as .caller_locations" do
+        # These two function calls should never be reformatted to be on different lines!
+        minimal_locations, locations = described_class.minimal_caller_locations, described_class.caller_locations
+
+        GC.verify_compaction_references(double_heap: true, toward: :empty)
+
+        expect(describe_locations(minimal_locations)).to eq describe_locations(locations)
+      end
+    end
+
+    it "includes the path and line number in #to_s" do
+      location = described_class.minimal_caller_locations.first
+
+      expect(location.to_s).to eq "#{location.absolute_path}:#{location.lineno}:in #{location.qualified_method_name}"
+    end
+  end
+
+  describe ".cache_stats" do
+    let(:thread) { Thread.new { sleep }.tap { |it| sleep 0.01 until it.status == "sleep" } }
+
+    after { thread.kill.join }
+
+    it "reports hits on the line number cache when sampling the same frames again" do
+      first_sample, second_sample, hits_before, hits_after = nil
+
+      begin
+        GC.disable
+        first_sample = described_class.backtrace_locations(thread).map(&:lineno)
+        hits_before = described_class.cache_stats[:line_number_cache][:hits]
+        second_sample = described_class.backtrace_locations(thread).map(&:lineno)
+        hits_after = described_class.cache_stats[:line_number_cache][:hits]
+      ensure
+        GC.enable
+      end
+
+      expect(hits_after).to be >= hits_before + first_sample.size - 1
+      expect(second_sample).to eq first_sample
+      expect(second_sample).to eq thread.backtrace_locations.map(&:lineno)
+    end
+
+    it "trusts the line number cache across a minor GC, for frames whose iseqs are old" do
+      # Makes sure the iseqs of the thread's frames are old
+      4.times { GC.start }
+      described_class.backtrace_locations(thread).map(&:lineno)
+      major_gc_count = GC.stat(:major_gc_count)
+      GC.start(full_mark: false)
+      skip "Ruby did a major GC anyway" if GC.stat(:major_gc_count) != major_gc_count
+      misses_before = described_class.cache_stats[:line_number_cache][:misses]
+      described_class.backtrace_locations(thread).map(&:lineno)
+
+      expect(described_class.cache_stats[:line_number_cache][:misses]).to be misses_before
+    end
+
+    it "does not trust the line number cache across a major GC" do
+      described_class.backtrace_locations(thread).map(&:lineno)
+      GC.start(full_mark: true)
+      misses_before = described_class.cache_stats[:line_number_cache][:misses]
+      described_class.backtrace_locations(thread).map(&:lineno)
+
+      expect(described_class.cache_stats[:line_number_cache][:misses]).to be > misses_before
+    end
+
+    it "does not trust the line number cache across a minor GC, for frames whose iseqs are young" do
+      young_thread = Thread.new { eval("sleep", binding, __FILE__, __LINE__) }
+      Thread.pass until young_thread.status == "sleep"
+      described_class.backtrace_locations(young_thread).map(&:lineno)
+      GC.start(full_mark: false)
+      misses_before = described_class.cache_stats[:line_number_cache][:misses]
+      described_class.backtrace_locations(young_thread).map(&:lineno)
+      young_thread.kill.join
+
+      expect(described_class.cache_stats[:line_number_cache][:misses]).to be > misses_before
+    end
+
+    it "does not create any Symbols when checking for GCs, as that can happen where allocating isn't allowed" do
+      script = <<~RUBY
+        require "backtracie"
+        def fingerprint_here; Backtracie.caller_fingerprint(lineno: true); end
+        symbol_count = Symbol.all_symbols.size
+        fingerprint_here
+        print Symbol.all_symbols.size - symbol_count
+      RUBY
+      load_path = $LOAD_PATH.flat_map { |it| ["-I", it] }
+
+      expect(IO.popen([RbConfig.ruby, *load_path, "-e", script], &:read)).to eq "0"
+    end
+  end
+
+  describe Backtracie::StackTable do
+    subject(:stack_table) { described_class.new }
+
+    let(:thread) { Thread.new { sleep }.tap { |it| sleep 0.01 until it.status == "sleep" } }
+
+    after { thread.kill.join }
+
+    def sample_stack_at_depth(depth)
+      if depth > 0
+        sample_stack_at_depth(depth - 1)
+      else
+        stack_table.capture(Thread.current)
+      end
+    end
+
+    it "returns the same stack id for the same stack" do
+      expect(stack_table.capture(thread)).to eq stack_table.capture(thread)
+    end
+
+    it "records the frames of the stack, innermost first" do
+      stack_id = stack_table.capture(thread)
+
+      expect(stack_table.stack_frames(stack_id).map { |it| stack_table.frame_qualified_method_name(it) })
+        .to eq Backtracie.backtrace_locations(thread).map(&:qualified_method_name)
+      # Frame 0 is the call to sleep, which being a cfunc has no line number of its own
+      expect(stack_table.frame_lineno(stack_table.stack_frames(stack_id)[1]))
+        .to eq Backtracie.backtrace_locations(thread)[1].lineno
+    end
+
+    it "shares the common prefix between different stacks" do
+      stack_count, frame_count = nil
+
+      [0, 3].each do |depth|
+        stack_count, frame_count = stack_table.stack_count, stack_table.frame_count
+        sample_stack_at_depth(depth)
+      end
+
+      # Three more sample_stack_at_depth frames, and the ones on top of them, on top of the shared prefix; of these, only
+      # the recursive call to sample_stack_at_depth is a new frame
+      expect(stack_table.stack_count).to eq stack_count + 5
+      expect(stack_table.frame_count).to eq frame_count + 1
+    end
+
+    it "keeps finding the same stacks after growing" do
+      # Well past the initial capacity of the stacks and of their index; both rounds come from the same line, so that
+      # they capture the same stacks
+      first_round, second_round = Array.new(2) do
+        [(0...600).step(50).map { |depth| sample_stack_at_depth(depth) }, stack_table.stack_count, stack_table.frame_count]
+      end
+
+      expect(second_round).to eq first_round
+      expect(first_round[1]).to be > 512
+    end
+
+    it "returns nil for a dead thread" do
+      expect(stack_table.capture(Thread.new {}.tap(&:join))).to be nil
+    end
+
+    it "only captures the innermost max_depth frames when passed max_depth" do
+      full_stack = stack_table.stack_frames(stack_table.capture(thread))
+      truncated_stack = stack_table.stack_frames(stack_table.capture(thread, max_depth: 2))
+
+      expect(truncated_stack.map { |it| stack_table.frame_qualified_method_name(it) })
+        .to eq full_stack.first(2).map { |it| stack_table.frame_qualified_method_name(it) }
+    end
+
+    it "raises for an unknown stack id" do
+      expect { stack_table.stack_frames(stack_table.stack_count) }.to raise_exception(IndexError)
+    end
+
+    describe "#write_collapsed" do
+      let(:stack_id) { stack_table.capture(thread) }
+      let(:expected_line) do
+        stack_table.stack_frames(stack_id).reverse.map { |it| stack_table.frame_qualified_method_name(it) }.join(";") +
+          " 3\n"
+      end
+
+      it "writes one line per stack, with its sample count, to an IO" do
+        output = StringIO.new
+
+        bytes_written = stack_table.write_collapsed({stack_id => 3, 0 => 1}, output)
+
+        expect(output.string).to eq expected_line
+        expect(bytes_written).to eq expected_line.bytesize
+      end
+
+      it "writes to a file descriptor" do
+        read_end, write_end = IO.pipe
+        stack_table.write_collapsed({stack_id => 3}, write_end.fileno)
+        write_end.close
+
+        expect(read_end.read).to eq expected_line
+      ensure
+        read_end.close
+      end
+
+      it "lets other threads use the stack table while writing to a file descriptor" do
+        samples = (0...150).map { |depth| [sample_stack_at_depth(depth), 1] }.to_h
+        expected_output = StringIO.new
+        stack_table.write_collapsed(samples, expected_output)
+        read_end, write_end = IO.pipe
+
+        writer = Thread.new { stack_table.write_collapsed(samples, write_end.fileno) }
+        # The output doesn't fit in the pipe, so the writer blocks until we read it
+        sleep 0.01 until writer.status == "sleep"
+        new_stack_ids = (150...160).map { |depth| sample_stack_at_depth(depth) }
+        output = read_end.read(expected_output.string.bytesize)
+
+        expect(writer.value).to eq expected_output.string.bytesize
+        expect(output).to eq expected_output.string
+        expect(new_stack_ids.uniq.size).to eq 10
+      ensure
+        read_end.close
+        write_end.close
+      end
+
+      it "can be written from a native thread, from a snapshot of the table" do
+        expect(Backtracie::TestHelpers.write_collapsed_from_native_thread(stack_table, stack_id, 3))
+          .to eq expected_line
+      end
+
+      it "raises ArgumentError for negative sample counts or stack ids" do
+        expect { stack_table.write_collapsed({stack_id => -1}, StringIO.new) }.to raise_exception(ArgumentError)
+        expect { stack_table.write_collapsed({-1 => 1}, StringIO.new) }.to raise_exception(ArgumentError)
+      end
+    end
+
+    describe "#write_pprof" do
+      let(:stack_id) { stack_table.capture(thread) }
+      let(:expected_stack) do
+        stack_table.stack_frames(stack_id).map do |it|
+          [stack_table.frame_qualified_method_name(it), stack_table.frame_lineno(it)]
+        end
+      end
+
+      def decoded_stacks(bytes)
+        PprofHelper.sample_stacks(PprofHelper.decode_profile(bytes))
+          .map { |stack, count| [stack.map { |name, _filename, line| [name, line] }, count] }
+      end
+
+      it "writes a pprof profile with each stack and its sample count to an IO" do
+        output = StringIO.new
+
+        bytes_written = stack_table.write_pprof({stack_id => 3, 0 => 1}, output)
+
+        profile = PprofHelper.decode_profile(output.string)
+        expect(bytes_written).to eq output.string.bytesize
+        expect(profile.string_table.first).to eq ""
+        expect(profile.string_table.uniq).to eq profile.string_table
+        expect(profile.sample_type.map { |it| profile.string_table[it[1]] + "/" + profile.string_table[it[2]] })
+          .to eq ["samples/count"]
+        expect(decoded_stacks(output.string)).to eq [[expected_stack, 3]]
+        expect(PprofHelper.sample_stacks(profile).first.first.map { |_name, filename, _line| filename })
+          .to include(File.realpath(__FILE__))
+      end
+
+      it "writes each location and function only once" do
+        other_stack_id = stack_table.capture(Thread.current)
+        output = StringIO.new
+
+        stack_table.write_pprof({stack_id => 3, other_stack_id => 2}, output)
+
+        profile = PprofHelper.decode_profile(output.string)
+        expect(profile.locations.size).to eq profile.samples.flat_map(&:location_ids).uniq.size
+        expect(profile.functions.values.map { |it| [it.name, it.filename] }.uniq.size).to eq profile.functions.size
+        expect(decoded_stacks(output.string).map(&:last)).to eq [3, 2]
+      end
+
+      it "raises ArgumentError for negative sample counts" do
+        expect { stack_table.write_pprof({stack_id => -1}, StringIO.new) }.to raise_exception(ArgumentError)
+      end
+
+      it "writes to a file descriptor" do
+        read_end, write_end = IO.pipe
+        stack_table.write_pprof({stack_id => 3}, write_end.fileno)
+        write_end.close
+
+        expect(decoded_stacks(read_end.read)).to eq [[expected_stack, 3]]
+      ensure
+        read_end.close
+      end
+
+      it "compresses the profile when gzip: true is passed" do
+        require "zlib"
+        output = StringIO.new
+
+        stack_table.write_pprof({stack_id => 3}, output, gzip: true)
+
+        expect(decoded_stacks(Zlib.gunzip(output.string))).to eq [[expected_stack, 3]]
+        expect(output.closed?).to be false
+      end
+
+      it "compresses the profile when writing to a file descriptor" do
+        require "zlib"
+        read_end, write_end = IO.pipe
+        stack_table.write_pprof({stack_id => 3}, write_end.fileno, gzip: true)
+
+        expect(write_end.closed?).to be false
+        write_end.close
+        expect(decoded_stacks(Zlib.gunzip(read_end.read))).to eq [[expected_stack, 3]]
+      ensure
+        read_end.close
+      end
+    end
+
+    context "when the heap gets compacted" do
+      before do
+        skip "GC.compact not supported" unless GC.respond_to?(:compact)
+      end
+
+      it "keeps returning the same stack id for the same stack" do
+        stack_id = stack_table.capture(thread)
+        GC.compact
+
+        expect(stack_table.capture(thread)).to eq stack_id
+      end
+    end
+  end
+
+  describe Backtracie::SampleRing do
+    subject(:ring) { described_class.new(capacity: 4, max_depth: 8) }
+
+    let(:stack_table) { Backtracie::StackTable.new }
+
+    def capture_in_ring(value)
+      ring.capture(Thread.current, value)
+    end
+
+    def stack_names(stack_id)
+      stack_table.stack_frames(stack_id).map { |it| stack_table.frame_qualified_method_name(it) }
+    end
+
+    it "drains captured stacks into a stack table, oldest first" do
+      capture_in_ring(10)
+      capture_in_ring(20)
+
+      expect(ring.size).to eq 2
+      samples = ring.drain(stack_table)
+
+      expect(samples.map(&:last)).to eq [10, 20]
+      expect(stack_names(samples.first.first).first(2))
+        .to eq ["Backtracie::SampleRing#capture", "RSpec::ExampleGroups::Backtracie::BacktracieSampleRing#capture_in_ring"]
+      expect(ring.size).to eq 0
+    end
+
+    it "keeps only the innermost max_depth frames of each stack" do
+      capture_in_ring(1)
+
+      stack_id, = ring.drain(stack_table).first
+      expect(stack_table.stack_frames(stack_id).size).to eq 8
+    end
+
+    it "drops samples when full" do
+      results = Array.new(6) { |it| capture_in_ring(it) }
+
+      expect(results).to eq [true, true, true, true, false, false]
+      expect(ring.dropped_count).to eq 2
+      expect(ring.drain(stack_table).map(&:last)).to eq [0, 1, 2, 3]
+    end
+
+    it "does not capture dead threads, without counting them as dropped" do
+      expect(ring.capture(Thread.new {}.tap(&:join), 1)).to be false
+      expect(ring.size).to eq 0
+      expect(ring.dropped_count).to eq 0
+    end
+
+    it "can be drained in batches, wrapping around" do
+      3.times { |it| capture_in_ring(it) }
+      expect(ring.drain(stack_table, 2).map(&:last)).to eq [0, 1]
+
+      3.times { |it| capture_in_ring(it + 3) }
+      expect(ring.drain(stack_table).map(&:last)).to eq [2, 3, 4, 5]
+    end
+
+    it "can be drained from a background thread" do
+      3.times { |it| capture_in_ring(it) }
+
+      expect(Thread.new { ring.drain(stack_table).map(&:last) }.value).to eq [0, 1, 2]
+    end
+
+    it "can be drained from a native thread, without the GVL" do
+      3.times { |it| capture_in_ring(it + 1) }
+
+      samples, frames, value_sum = Backtracie::TestHelpers.drain_sample_ring_from_native_thread(ring)
+
+      expect([samples, frames, value_sum]).to eq [3, 24, 6]
+      expect(ring.size).to eq 0
+    end
+
+    it "keeps the frames of the samples it contains alive" do
+      eval("def sample_ring_temporary_method; ring.capture(Thread.current, 1); end", binding, "(temporary file)")
+      sample_ring_temporary_method
+      singleton_class.send(:remove_method, :sample_ring_temporary_method)
+      GC.start
+      GC.verify_compaction_references(toward: :empty) if GC.respond_to?(:verify_compaction_references)
+
+      stack_id, = ring.drain(stack_table).first
+      expect(stack_table.frame_qualified_method_name(stack_table.stack_frames(stack_id)[1]))
+        .to end_with "#sample_ring_temporary_method"
+    end
+
+    it "rejects invalid capacities and depths" do
+      expect { described_class.new(capacity: 0) }.to raise_exception(ArgumentError)
+      expect { described_class.new(max_depth: 0) }.to raise_exception(ArgumentError)
+    end
+  end
+
+  describe Backtracie::Sampler do
+    subject(:sampler) { described_class.new(frequency: 1000) }
+
+    after { sampler.stop }
+
+    def busy_method_for_sampler(until_ticks)
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 10
+      until sampler.tick_count >= until_ticks
+        raise "sampler stopped ticking" if Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+        Thread.pass
+      end
+    end
+
+    def stack_names(stack_id)
+      sampler.stack_table.stack_frames(stack_id).map { |it| sampler.stack_table.frame_qualified_method_name(it) }
+    end
+
+    it "periodically samples the thread that is running" do
+      sampler.start
+      busy_method_for_sampler(5)
+      sampler.stop
+
+      expect(sampler.tick_count).to be >= 5
+      expect(sampler.samples.keys.flat_map { |it| stack_names(it) })
+        .to include("RSpec::ExampleGroups::Backtracie::BacktracieSampler#busy_method_for_sampler")
+    end
+
+    it "samples other threads too" do
+      thread = Thread.new { sleep }.tap { |it| sleep 0.01 until it.status == "sleep" }
+
+      sampler.start
+      busy_method_for_sampler(5)
+      sampler.stop
+      thread.kill.join
+
+      expect(sampler.samples.keys.flat_map { |it| stack_names(it) }).to include("Kernel#sleep")
+    end
+
+    it "counts how many times each stack was sampled" do
+      sampler.start
+      busy_method_for_sampler(5)
+      sampler.stop
+
+      expect(sampler.samples.values.sum).to eq sampler.sample_count
+      expect(sampler.sampling_time).to be > 0
+    end
+
+    it "does not sample while stopped" do
+      sampler.start
+      busy_method_for_sampler(1)
+      sampler.stop
+      sample_count = sampler.sample_count
+      sleep 0.01
+
+      expect(sampler.running?).to be false
+      expect(sampler.sample_count).to eq sample_count
+    end
+
+    it "does not allow two samplers to run at the same time" do
+      other_sampler = described_class.new
+      sampler.start
+
+      expect { other_sampler.start }.to raise_exception(RuntimeError)
+    end
+
+    context "when its timer thread gets interrupted" do
+      let!(:timer_thread) do
+        threads_before = Thread.list
+        sampler.start
+        (Thread.list - threads_before).first
+      end
+
+      it "keeps sampling" do
+        busy_method_for_sampler(1)
+        timer_thread.wakeup
+        tick_count = sampler.tick_count
+        busy_method_for_sampler(tick_count + 5)
+
+        expect(sampler.running?).to be true
+        expect(timer_thread.alive?).to be true
+      end
+
+      it "is not running anymore once the timer thread gets killed, and can be started again" do
+        timer_thread.kill.join
+
+        expect(sampler.running?).to be false
+
+        sampler.start
+        tick_count = sampler.tick_count
+        busy_method_for_sampler(tick_count + 5)
+
+        expect(sampler.running?).to be true
+      end
+    end
+
+    it "is not running in a forked child, which can start it again and exit" do
+      skip "fork is not supported" unless Process.respond_to?(:fork)
+
+      sampler.start
+      pid = fork do
+        running_after_fork = sampler.running?
+        sampler.start
+        busy_method_for_sampler(sampler.tick_count + 5)
+        sampler.stop
+        exit(!running_after_fork)
+      end
+
+      # The child used to hang at exit, when freeing the sampler
+      deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 10
+      sleep 0.01 until Process.wait(pid, Process::WNOHANG) ||
+        Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+      unless $?&.pid == pid
+        Process.kill(:KILL, pid)
+        Process.wait(pid)
+        raise "forked child did not exit"
+      end
+
+      expect($?.success?).to be true
+    end
+
+    it "writes its samples in collapsed format" do
+      sampler.start
+      busy_method_for_sampler(5)
+      sampler.stop
+
+      expected_output = StringIO.new
+      sampler.stack_table.write_collapsed(sampler.samples, expected_output)
+      output = StringIO.new
+      sampler.write_collapsed(output)
+
+      expect(output.string).to eq expected_output.string
+      expect(output.string.lines.size).to eq sampler.samples.size
+    end
+
+    it "writes its samples as a pprof profile, including the sampling period" do
+      sampler.start
+      busy_method_for_sampler(5)
+      sampler.stop
+
+      expected_output = StringIO.new
+      sampler.stack_table.write_pprof(sampler.samples, expected_output)
+      output = StringIO.new
+      sampler.write_pprof(output)
+
+      profile = PprofHelper.decode_profile(output.string)
+      expected_profile = PprofHelper.decode_profile(expected_output.string)
+      expect(profile.period).to eq 1_000_000
+      expect(profile.string_table.values_at(*profile.period_type.values)).to eq ["wall", "nanoseconds"]
+      expect(PprofHelper.sample_stacks(profile)).to eq PprofHelper.sample_stacks(expected_profile)
+      expect(profile.samples.map { |it| it.values.first }.sum).to eq sampler.sample_count
+    end
+
+    it "rejects invalid frequencies" do
+      expect { described_class.new(frequency: 0) }.to raise_exception(ArgumentError)
+    end
+
+    it "rejects instances that were never initialized" do
+      expect { described_class.allocate.start }.to raise_exception(RuntimeError, /not initialized/)
+    end
+  end
+
+  describe Backtracie::AllocationSampler do
+    subject(:sampler) { described_class.new(interval: 10) }
+
+    after { sampler.stop }
+
+    def allocate_kept_objects
+      Array.new(1000) { Object.new }
+    end
+
+    def allocate_garbage
+      10_000.times { Object.new }
+      nil
+    end
+
+    def stack_names(stack_id)
+      sampler.stack_table.stack_frames(stack_id).map { |it| sampler.stack_table.frame_qualified_method_name(it) }
+    end
+
+    def live_samples_from(method_name)
+      sampler.live_samples.select { |stack_id, _| stack_names(stack_id).include?(method_name) }.values.sum
+    end
+
+    it "samples one in every interval allocations" do
+      sampler.start
+      allocate_garbage
+      sampler.stop
+
+      expect(sampler.allocation_count).to be >= 10_000
+      expect(sampler.sample_count).to eq sampler.allocation_count / 10
+      expect(sampler.samples.values.sum).to eq sampler.sample_count
+      expect(sampler.samples.keys.flat_map { |it| stack_names(it) })
+        .to include("RSpec::ExampleGroups::Backtracie::BacktracieAllocationSampler#allocate_garbage")
+    end
+
+    it "keeps track of which sampled objects are still alive" do
+      sampler.start
+      kept_objects = allocate_kept_objects
+      allocate_garbage
+      GC.start
+      sampler.stop
+
+      kept_method = "RSpec::ExampleGroups::Backtracie::BacktracieAllocationSampler#allocate_kept_objects"
+      garbage_method = "RSpec::ExampleGroups::Backtracie::BacktracieAllocationSampler#allocate_garbage"
+      expect(live_samples_from(kept_method)).to be_within(1).of(100)
+      expect(live_samples_from(garbage_method)).to be < 10
+      expect(kept_objects.size).to eq 1000
+    end
+
+    it "returns the allocation stack of sampled objects" do
+      sampler.start
+      kept_objects = allocate_kept_objects
+      sampled_objects = kept_objects.select { |it| sampler.allocation_stack(it) }
+
+      expect(sampled_objects.size).to be_within(1).of(100)
+      expect(stack_names(sampler.allocation_stack(sampled_objects.first)))
+        .to include("RSpec::ExampleGroups::Backtracie::BacktracieAllocationSampler#allocate_kept_objects")
+      expect(sampler.allocation_stack(:symbol)).to be nil
+    end
+
+    if GC.respond_to?(:verify_compaction_references)
+      it "keeps track of sampled objects that get moved by GC compaction" do
+        sampler.start
+        kept_objects = allocate_kept_objects
+        sampled_count = kept_objects.count { |it| sampler.allocation_stack(it) }
+
+        GC.verify_compaction_references(toward: :empty)
+
+        expect(kept_objects.count { |it| sampler.allocation_stack(it) }).to eq sampled_count
+      end
+    end
+
+    it "does not sample while stopped" do
+      sampler.start
+      sampler.stop
+      allocation_count = sampler.allocation_count
+      allocate_garbage
+
+      expect(sampler.running?).to be false
+      expect(sampler.allocation_count).to eq allocation_count
+    end
+
+    it "does not allow two allocation samplers to run at the same time" do
+      other_sampler = described_class.new
+      sampler.start
+
+      expect { other_sampler.start }.to raise_exception(RuntimeError)
+    end
+
+    it "rejects invalid intervals" do
+      expect { described_class.new(interval: 0) }.to raise_exception(ArgumentError)
+    end
+  end
+
+  describe Backtracie::GvlProfiler do
+    subject(:profiler) { described_class.new }
+
+    after { profiler.stop }
+
+    if RUBY_VERSION >= "3.2"
+      def contend_for_gvl(duration)
+        deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + duration
+        nil while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+      end
+
+      def stack_names(stack_id)
+        profiler.stack_table.stack_frames(stack_id).map { |it| profiler.stack_table.frame_qualified_method_name(it) }
+      end
+
+      it "records how long threads waited for the GVL, and where" do
+        profiler.start
+        Array.new(2) { Thread.new { contend_for_gvl(0.3) } }.each(&:join)
+        profiler.stop
+
+        expect(profiler.wait_count).to be > 0
+        expect(profiler.wait_time).to be > 0.1
+        expect(profiler.samples.values.sum).to eq profiler.wait_count
+        expect(profiler.wait_times.values.sum).to eq (profiler.wait_time * 1e9).round
+        expect(profiler.wait_times.keys.flat_map { |it| stack_names(it) })
+          .to include("RSpec::ExampleGroups::Backtracie::BacktracieGvlProfiler#contend_for_gvl")
+      end
+
+      it "does not record waits while stopped" do
+        profiler.start
+        profiler.stop
+        Array.new(2) { Thread.new { contend_for_gvl(0.2) } }.each(&:join)
+
+        expect(profiler.running?).to be false
+        expect(profiler.wait_count).to eq 0
+      end
+
+      it "writes its wait times in collapsed format" do
+        profiler.start
+        Array.new(2) { Thread.new { contend_for_gvl(0.2) } }.each(&:join)
+        profiler.stop
+
+        output = StringIO.new
+        profiler.write_collapsed(output)
+
+        # Empty stacks (e.g. of threads that are just starting) are skipped
+        expect(output.string.lines.map { |it| it.split(" ").last.to_i }.sum)
+          .to eq profiler.wait_times.reject { |stack_id, _| stack_id == 0 }.values.sum
+      end
+
+      it "does not allow two GVL profilers to run at the same time" do
+        other_profiler = described_class.new
+        profiler.start
+
+        expect { other_profiler.start }.to raise_exception(RuntimeError)
+      end
+    else
+      it "is not supported" do
+        expect { profiler.start }.to raise_exception(NotImplementedError)
+      end
+    end
+
+    it "rejects invalid max depths" do
+      expect { described_class.new(max_depth: 0) }.to raise_exception(ArgumentError)
+    end
+  end
+
   context 'when sampling a thread from rb_create_thread, with no ruby frames' do
     let(:backtracie_backtrace) { Backtracie::TestHelpers.backtracie_backtrace_from_thread }
 
@@ -0,0 +1,129 @@
+# frozen_string_literal: true
+
+# backtracie: Ruby gem for beautiful backtraces
+# Copyright (C) 2021 Ivo Anjo <ivo@ivoanjo.me>
+#
+# This file is part of backtracie.
+#
+# backtracie is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# backtracie is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with backtracie.  If not, see <http://www.gnu.org/licenses/>.
+
+# Minimal decoder for the pprof profiles written by Backtracie, so that specs can check their contents without
+# depending on a protobuf library. Only handles the fields Backtracie writes,
+# see https://github.com/google/pprof/blob/main/proto/profile.proto
+
+module PprofHelper
+  Profile = Struct.new(:sample_type, :samples, :locations, :functions, :string_table, :period_type, :period)
+  Sample = Struct.new(:location_ids, :values)
+  Location = Struct.new(:id, :function_id, :line)
+  Function = Struct.new(:id, :name, :filename)
+
+  module_function
+
+  def decode_profile(bytes)
+    profile = Profile.new([], [], {}, {}, [], nil, nil)
+
+    each_field(bytes) do |field, value|
+      case field
+      when 1 then profile.sample_type << decode_fields(value)
+      when 2
+        fields = decode_fields(value, repeated: [1, 2])
+        profile.samples << Sample.new(
+          fields[1].flat_map { |it| decode_packed(it) },
+          fields[2].flat_map { |it| decode_packed(it) }
+        )
+      when 4
+        fields = decode_fields(value)
+        line = decode_fields(fields[4])
+        profile.locations[fields[1]] = Location.new(fields[1], line[1], line[2])
+      when 5
+        fields = decode_fields(value)
+        profile.functions[fields[1]] = Function.new(fields[1], fields[2], fields[4])
+      when 6 then profile.string_table << value.dup.force_encoding(Encoding::UTF_8)
+      when 11 then profile.period_type = decode_fields(value)
+      when 12 then profile.period = value
+      else raise "Unexpected field #{field}"
+      end
+    end
+
+    profile
+  end
+
+  # Returns the stack for each sample as [[function name, filename, line], ...] starting from the innermost frame
+  def sample_stacks(profile)
+    profile.samples.map do |sample|
+      stack = sample.location_ids.map do |location_id|
+        location = profile.locations.fetch(location_id)
+        function = profile.functions.fetch(location.function_id)
+        [profile.string_table[function.name], profile.string_table[function.filename], location.line]
+      end
+      [stack, sample.values.first]
+    end
+  end
+
+  def decode_fields(bytes, repeated: [])
+    fields = repeated.map { |field| [field, []] }.to_h
+    each_field(bytes) do |field, value|
+      if repeated.include?(field)
+        fields[field] << value
+      else
+        fields[field] = value
+      end
+    end
+    fields
+  end
+
+  # Packed repeated fields are length-delimited, but a single unpacked value is also valid protobuf
+  def decode_packed(value)
+    return [value] if value.is_a?(Integer)
+
+    values = []
+    position = 0
+    while position < value.bytesize
+      decoded, position = decode_varint(value, position)
+      values << decoded
+    end
+    values
+  end
+
+  def each_field(bytes)
+    bytes = bytes.b
+    position = 0
+    while position < bytes.bytesize
+      key, position = decode_varint(bytes, position)
+      case key & 7
+      when 0
+        value, position = decode_varint(bytes, position)
+      when 2
+        length, position = decode_varint(bytes, position)
+        value = bytes.byteslice(position, length)
+        position += length
+      else
+        raise "Unexpected wire type #{key & 7}"
+      end
+      yield key >> 3, value
+    end
+  end
+
+  def decode_varint(bytes, position)
+    value = 0
+    shift = 0
+    loop do
+      byte = bytes.getbyte(position)
+      position += 1
+      value |= (byte & 0x7f) << shift
+      shift += 7
+      return [value, position] if byte < 0x80
+    end
+  end
+end